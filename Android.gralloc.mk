@@ -7,5 +7,6 @@ LOCAL_CPP_EXTENSION := .cc
 LOCAL_SRC_FILES += \
 	cros_gralloc/cros_gralloc_buffer.cc \
 	cros_gralloc/cros_gralloc_driver.cc \
+	cros_gralloc/cros_gralloc_fence.cc \
 	cros_gralloc/cros_gralloc_helpers.cc \
 	cros_gralloc/gralloc0/gralloc0.cc
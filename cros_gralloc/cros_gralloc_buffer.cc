@@ -13,8 +13,8 @@ cros_gralloc_buffer::cros_gralloc_buffer(uint32_t id, struct bo *acquire_bo,
 					 struct cros_gralloc_handle *acquire_handle,
 					 int32_t reserved_region_fd, uint64_t reserved_region_size)
     : id_(id), bo_(acquire_bo), hnd_(acquire_handle), refcount_(1), lockcount_(0),
-      reserved_region_fd_(reserved_region_fd), reserved_region_size_(reserved_region_size),
-      reserved_region_addr_(nullptr)
+      flush_pending_(false), reserved_region_fd_(reserved_region_fd),
+      reserved_region_size_(reserved_region_size), reserved_region_addr_(nullptr)
 {
 	assert(bo_);
 	num_planes_ = drv_bo_get_num_planes(bo_);
@@ -54,9 +54,13 @@ int32_t cros_gralloc_buffer::lock(const struct rectangle *rect, uint32_t map_fla
 				  uint8_t *addr[DRV_MAX_PLANES])
 {
 	void *vaddr = nullptr;
+	std::lock_guard<std::mutex> lock(mutex_);
 
 	memset(addr, 0, DRV_MAX_PLANES * sizeof(*addr));
 
+	if (flush_pending_)
+		finish_unlock(nullptr);
+
 	/*
 	 * Gralloc consumers don't support more than one kernel buffer per buffer object yet, so
 	 * just use the first kernel buffer.
@@ -67,21 +71,24 @@ int32_t cros_gralloc_buffer::lock(const struct rectangle *rect, uint32_t map_fla
 	}
 
 	if (map_flags) {
+		struct rectangle r = *rect;
+
+		if (!r.width && !r.height && !r.x && !r.y) {
+			/*
+			 * Android IMapper.hal: An accessRegion of all-zeros means the
+			 * entire buffer.
+			 */
+			r.width = drv_bo_get_width(bo_);
+			r.height = drv_bo_get_height(bo_);
+		}
+
 		if (lock_data_[0]) {
-			drv_bo_invalidate(bo_, lock_data_[0]);
+			/* Nested locks share the mapping, which has to cover their regions too. */
+			drv_bo_extend_mapping(bo_, lock_data_[0], &r);
+			if (!(map_flags & BO_MAP_NO_INVALIDATE))
+				drv_bo_invalidate(bo_, lock_data_[0]);
 			vaddr = lock_data_[0]->vma->addr;
 		} else {
-			struct rectangle r = *rect;
-
-			if (!r.width && !r.height && !r.x && !r.y) {
-				/*
-				 * Android IMapper.hal: An accessRegion of all-zeros means the
-				 * entire buffer.
-				 */
-				r.width = drv_bo_get_width(bo_);
-				r.height = drv_bo_get_height(bo_);
-			}
-
 			vaddr = drv_bo_map(bo_, &r, map_flags, &lock_data_[0], 0);
 		}
 
@@ -89,6 +96,10 @@ int32_t cros_gralloc_buffer::lock(const struct rectangle *rect, uint32_t map_fla
 			drv_log("Mapping failed.\n");
 			return -EFAULT;
 		}
+
+		/* Writes outside the access region are undefined, so only it needs flushing. */
+		if (map_flags & BO_MAP_WRITE)
+			drv_bo_add_damage(bo_, lock_data_[0], &r);
 	}
 
 	for (uint32_t plane = 0; plane < num_planes_; plane++)
@@ -102,9 +113,13 @@ int32_t cros_gralloc_buffer::lock(const struct rectangle *rect, uint32_t map_fla
 int32_t cros_gralloc_buffer::lock(uint32_t map_flags, uint8_t *addr[DRV_MAX_PLANES])
 {
         void *vaddr = nullptr;
+        std::lock_guard<std::mutex> lock(mutex_);
 
         memset(addr, 0, DRV_MAX_PLANES * sizeof(*addr));
 
+        if (flush_pending_)
+                finish_unlock(nullptr);
+
         /*
          * Gralloc consumers don't support more than one kernel buffer per buffer object yet, so
          * just use the first kernel buffer.
@@ -148,21 +163,79 @@ int32_t cros_gralloc_buffer::lock(uint32_t map_flags, uint8_t *addr[DRV_MAX_PLAN
 
 int32_t cros_gralloc_buffer::unlock()
 {
+	std::lock_guard<std::mutex> lock(mutex_);
+
 	if (lockcount_ <= 0) {
 		drv_log("Buffer was not locked.\n");
 		return -EINVAL;
 	}
 
-	if (!--lockcount_) {
-		if (lock_data_[0]) {
-			drv_bo_flush_or_unmap(bo_, lock_data_[0]);
-			lock_data_[0] = nullptr;
-		}
+	if (!--lockcount_)
+		finish_unlock(nullptr);
+
+	return 0;
+}
+
+int32_t cros_gralloc_buffer::unlock_deferred()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (lockcount_ <= 0) {
+		drv_log("Buffer was not locked.\n");
+		return -EINVAL;
+	}
+
+	if (--lockcount_)
+		return 0;
+
+	/* Nothing to flush for read-only mappings, and unmapping them right away is cheap. */
+	if (!lock_data_[0] || !(lock_data_[0]->vma->map_flags & BO_MAP_WRITE)) {
+		finish_unlock(nullptr);
+		return 0;
 	}
 
+	flush_pending_ = true;
+	return 1;
+}
+
+void cros_gralloc_buffer::complete_unlock()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (flush_pending_)
+		finish_unlock(nullptr);
+}
+
+int32_t cros_gralloc_buffer::unlock_fenced(int32_t *release_fence)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	*release_fence = -1;
+	if (lockcount_ <= 0) {
+		drv_log("Buffer was not locked.\n");
+		return -EINVAL;
+	}
+
+	if (!--lockcount_)
+		finish_unlock(release_fence);
+
 	return 0;
 }
 
+void cros_gralloc_buffer::finish_unlock(int32_t *release_fence)
+{
+	if (lock_data_[0]) {
+		/* Backends with flush fences implement flushes, so the mapping stays either way. */
+		if (release_fence)
+			drv_bo_flush_fence(bo_, lock_data_[0], release_fence);
+		else
+			drv_bo_flush_or_unmap(bo_, lock_data_[0]);
+		lock_data_[0] = nullptr;
+	}
+
+	flush_pending_ = false;
+}
+
 int32_t cros_gralloc_buffer::resource_info(uint32_t strides[DRV_MAX_PLANES],
 					   uint32_t offsets[DRV_MAX_PLANES])
 {
@@ -171,6 +244,8 @@ int32_t cros_gralloc_buffer::resource_info(uint32_t strides[DRV_MAX_PLANES],
 
 int32_t cros_gralloc_buffer::invalidate()
 {
+	std::lock_guard<std::mutex> lock(mutex_);
+
 	if (lockcount_ <= 0) {
 		drv_log("Buffer was not locked.\n");
 		return -EINVAL;
@@ -183,15 +258,18 @@ int32_t cros_gralloc_buffer::invalidate()
 	return 0;
 }
 
-int32_t cros_gralloc_buffer::flush()
+int32_t cros_gralloc_buffer::flush(int32_t *release_fence)
 {
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	*release_fence = -1;
 	if (lockcount_ <= 0) {
 		drv_log("Buffer was not locked.\n");
 		return -EINVAL;
 	}
 
 	if (lock_data_[0]) {
-		return drv_bo_flush(bo_, lock_data_[0]);
+		return drv_bo_flush_fence(bo_, lock_data_[0], release_fence);
 	}
 
 	return 0;
@@ -199,6 +277,8 @@ int32_t cros_gralloc_buffer::flush()
 
 int32_t cros_gralloc_buffer::get_reserved_region(void **addr, uint64_t *size)
 {
+	std::lock_guard<std::mutex> lock(mutex_);
+
 	if (reserved_region_fd_ <= 0) {
 		drv_log("Buffer does not have reserved region.\n");
 		return -EINVAL;
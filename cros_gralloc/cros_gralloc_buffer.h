@@ -10,6 +10,8 @@
 #include "../drv.h"
 #include "cros_gralloc_helpers.h"
 
+#include <mutex>
+
 class cros_gralloc_buffer
 {
       public:
@@ -20,20 +22,35 @@ class cros_gralloc_buffer
 
 	uint32_t get_id() const;
 
-	/* The new reference count is returned by both these functions. */
+	/*
+	 * The new reference count is returned by both these functions. The reference count is
+	 * guarded by the driver; everything below is guarded by the buffer's own mutex.
+	 */
 	int32_t increase_refcount();
 	int32_t decrease_refcount();
 
+	/* With BO_MAP_NO_INVALIDATE the caller has to invalidate() before touching the buffer. */
 	int32_t lock(const struct rectangle *rect, uint32_t map_flags,
 		     uint8_t *addr[DRV_MAX_PLANES]);
 #ifdef USE_GRALLOC1
 	int32_t lock(uint32_t map_flags, uint8_t *addr[DRV_MAX_PLANES]);
 #endif
 	int32_t unlock();
+	/*
+	 * Like unlock(), but when the last lock of a writable mapping goes away the flush is left
+	 * to complete_unlock() and 1 is returned. A lock in between performs the flush itself.
+	 */
+	int32_t unlock_deferred();
+	void complete_unlock();
+	/*
+	 * Like unlock(), but the flush after the last unlock may return a fence in release_fence
+	 * instead of waiting for the device, see drv_bo_flush_fence().
+	 */
+	int32_t unlock_fenced(int32_t *release_fence);
 	int32_t resource_info(uint32_t strides[DRV_MAX_PLANES], uint32_t offsets[DRV_MAX_PLANES]);
 
 	int32_t invalidate();
-	int32_t flush();
+	int32_t flush(int32_t *release_fence);
 
 	int32_t get_reserved_region(void **reserved_region_addr, uint64_t *reserved_region_size);
 
@@ -41,6 +58,9 @@ class cros_gralloc_buffer
 	cros_gralloc_buffer(cros_gralloc_buffer const &);
 	cros_gralloc_buffer operator=(cros_gralloc_buffer const &);
 
+	/* Flushes or unmaps lock_data_[0], returning the flush's fence if release_fence is set. */
+	void finish_unlock(int32_t *release_fence);
+
 	uint32_t id_;
 	struct bo *bo_;
 
@@ -48,10 +68,14 @@ class cros_gralloc_buffer
 	struct cros_gralloc_handle *hnd_;
 
 	int32_t refcount_;
+
+	std::mutex mutex_;
 	int32_t lockcount_;
 	uint32_t num_planes_;
 
 	struct mapping *lock_data_[DRV_MAX_PLANES];
+	/* Set while lock_data_[0] still has to be flushed or unmapped after the last unlock. */
+	bool flush_pending_;
 
 	/* Optional additional shared memory region attached to some gralloc4 buffers. */
 	int32_t reserved_region_fd_;
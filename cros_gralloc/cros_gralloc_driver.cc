@@ -9,6 +9,7 @@
 #include <cstdlib>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <vector>
 #include <xf86drm.h>
 
 #include "../drv_priv.h"
@@ -19,6 +20,13 @@
 #include "i915_private_android.h"
 #endif
 
+// Maximum number of released buffers waiting to be destroyed in the background.
+static const uint32_t reaper_queue_size = 64;
+
+// Budget for CPU mappings kept alive between unlock and the next lock of the same buffer.
+static const uint32_t map_cache_max_count = 32;
+static const uint64_t map_cache_max_bytes = 256ull << 20;
+
 // drv_render_ aim to open the render node
 cros_gralloc_driver::cros_gralloc_driver() : drv_render_(nullptr)
 {
@@ -26,8 +34,12 @@ cros_gralloc_driver::cros_gralloc_driver() : drv_render_(nullptr)
 
 cros_gralloc_driver::~cros_gralloc_driver()
 {
+	// Deferred flushes still hold buffers, which must go before the driver does.
+	fence_worker_.stop();
+
+	for (auto &shard : handle_shards_)
+		shard.handles.clear();
 	buffers_.clear();
-	handles_.clear();
 
 	if (drv_render_) {
 		int fd = drv_get_fd(drv_render_);
@@ -153,6 +165,17 @@ int32_t cros_gralloc_driver::init()
 				drv_log("Failed to init render driver\n");
 				goto fail;
 			}
+
+			// Not fatal; buffers are then destroyed on the releasing thread.
+			if (drv_bo_reaper_configure(drv_render_, reaper_queue_size))
+				drv_log("Failed to enable deferred buffer destruction\n");
+
+			drv_bo_map_cache_configure(drv_render_, map_cache_max_count,
+						   map_cache_max_bytes);
+
+			// Not fatal either; fences are then waited for on the caller's thread.
+			if (fence_worker_.init())
+				drv_log("Failed to start fence worker\n");
 		}
 	}
 
@@ -211,86 +234,30 @@ int32_t create_reserved_region(const std::string &buffer_name, uint64_t reserved
 	return reserved_region_fd;
 }
 
-int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
-				      buffer_handle_t *out_handle)
+static int32_t create_handle(const struct cros_gralloc_buffer_descriptor *descriptor,
+			     struct bo *bo, struct cros_gralloc_handle **out_hnd)
 {
 #ifdef USE_GRALLOC1
 	uint64_t mod;
 #endif
-	uint32_t id;
 	size_t num_planes;
 	size_t num_fds;
 	size_t num_ints;
 	size_t num_bytes;
-	uint32_t resolved_format;
 	uint32_t bytes_per_pixel;
-	uint64_t use_flags;
 	int32_t reserved_region_fd;
 	char *name;
 
-	struct bo *bo;
 	struct cros_gralloc_handle *hnd;
 
-	struct driver *drv;
-	drv = drv_render_;
-
-	resolved_format = drv_resolve_format(drv, descriptor->drm_format, descriptor->use_flags);
-	use_flags = descriptor->use_flags;
-	/*
-	 * TODO(b/79682290): ARC++ assumes NV12 is always linear and doesn't
-	 * send modifiers across Wayland protocol, so we or in the
-	 * BO_USE_LINEAR flag here. We need to fix ARC++ to allocate and work
-	 * with tiled buffers.
-	 */
-	if (resolved_format == DRM_FORMAT_NV12)
-		use_flags |= BO_USE_LINEAR;
-
-	/*
-	 * This unmask is a backup in the case DRM_FORMAT_FLEX_IMPLEMENTATION_DEFINED is resolved
-	 * to non-YUV formats.
-	 */
-	if (descriptor->drm_format == DRM_FORMAT_FLEX_IMPLEMENTATION_DEFINED &&
-	    (resolved_format == DRM_FORMAT_XBGR8888 || resolved_format == DRM_FORMAT_ABGR8888)) {
-		use_flags &= ~BO_USE_HW_VIDEO_ENCODER;
-	}
-
-#ifdef USE_GRALLOC1
-	if (descriptor->modifier == 0) {
-		bo = drv_bo_create(drv, descriptor->width, descriptor->height, resolved_format,
-				   use_flags);
-	} else {
-		bo = drv_bo_create_with_modifiers(drv, descriptor->width, descriptor->height,
-						  resolved_format, &descriptor->modifier, 1);
-	}
-#else
-	bo = drv_bo_create(drv, descriptor->width, descriptor->height, resolved_format, use_flags);
-#endif
-	if (!bo) {
-		drv_log("Failed to create bo.\n");
-		return -ENOMEM;
-	}
-
-	/*
-	 * If there is a desire for more than one kernel buffer, this can be
-	 * removed once the ArcCodec and Wayland service have the ability to
-	 * send more than one fd. GL/Vulkan drivers may also have to modified.
-	 */
-	if (drv_num_buffers_per_bo(bo) != 1) {
-		drv_bo_destroy(bo);
-		drv_log("Can only support one buffer per bo.\n");
-		return -EINVAL;
-	}
-
 	num_planes = drv_bo_get_num_planes(bo);
 	num_fds = num_planes;
 
 	if (descriptor->reserved_region_size > 0) {
 		reserved_region_fd =
 		    create_reserved_region(descriptor->name, descriptor->reserved_region_size);
-		if (reserved_region_fd < 0) {
-			drv_bo_destroy(bo);
+		if (reserved_region_fd < 0)
 			return reserved_region_fd;
-		}
 		num_fds += 1;
 	} else {
 		reserved_region_fd = -1;
@@ -356,14 +323,114 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 	name = (char *)(&hnd->base.data[hnd->name_offset]);
 	snprintf(name, descriptor->name.size() + 1, "%s", descriptor->name.c_str());
 
-	id = drv_bo_get_plane_handle(bo, 0).u32;
-	auto buffer = new cros_gralloc_buffer(id, bo, hnd, hnd->fds[hnd->num_planes],
-					      hnd->reserved_region_size);
+	*out_hnd = hnd;
+	return 0;
+}
+
+int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
+				      buffer_handle_t *out_handle)
+{
+	return allocate_batch(descriptor, 1, out_handle);
+}
+
+int32_t cros_gralloc_driver::allocate_batch(const struct cros_gralloc_buffer_descriptor *descriptor,
+					    uint32_t count, buffer_handle_t *out_handles)
+{
+	int32_t ret;
+	uint32_t i;
+	uint32_t id;
+	uint32_t resolved_format;
+	uint64_t use_flags;
+	const uint64_t *modifiers = nullptr;
+	uint32_t modifier_count = 0;
+
+	struct driver *drv;
+	drv = drv_render_;
+
+	if (!count)
+		return 0;
+
+	resolved_format = drv_resolve_format(drv, descriptor->drm_format, descriptor->use_flags);
+	use_flags = descriptor->use_flags;
+	/*
+	 * TODO(b/79682290): ARC++ assumes NV12 is always linear and doesn't
+	 * send modifiers across Wayland protocol, so we or in the
+	 * BO_USE_LINEAR flag here. We need to fix ARC++ to allocate and work
+	 * with tiled buffers.
+	 */
+	if (resolved_format == DRM_FORMAT_NV12)
+		use_flags |= BO_USE_LINEAR;
+
+	/*
+	 * This unmask is a backup in the case DRM_FORMAT_FLEX_IMPLEMENTATION_DEFINED is resolved
+	 * to non-YUV formats.
+	 */
+	if (descriptor->drm_format == DRM_FORMAT_FLEX_IMPLEMENTATION_DEFINED &&
+	    (resolved_format == DRM_FORMAT_XBGR8888 || resolved_format == DRM_FORMAT_ABGR8888)) {
+		use_flags &= ~BO_USE_HW_VIDEO_ENCODER;
+	}
+
+#ifdef USE_GRALLOC1
+	if (descriptor->modifier != 0) {
+		modifiers = &descriptor->modifier;
+		modifier_count = 1;
+	}
+#endif
+
+	/* The layout is resolved once and all backend creates are issued back to back. */
+	std::vector<struct bo *> bos(count);
+	ret = drv_bo_create_batch(drv, descriptor->width, descriptor->height, resolved_format,
+				  use_flags, modifiers, modifier_count, count, bos.data());
+	if (ret) {
+		drv_log("Failed to create bo.\n");
+		return -ENOMEM;
+	}
+
+	/*
+	 * If there is a desire for more than one kernel buffer, this can be
+	 * removed once the ArcCodec and Wayland service have the ability to
+	 * send more than one fd. GL/Vulkan drivers may also have to modified.
+	 */
+	if (drv_num_buffers_per_bo(bos[0]) != 1) {
+		for (i = 0; i < count; i++)
+			drv_bo_destroy(bos[i]);
+		drv_log("Can only support one buffer per bo.\n");
+		return -EINVAL;
+	}
+
+	std::vector<cros_gralloc_buffer *> buffers(count);
+	std::vector<struct cros_gralloc_handle *> hnds(count);
+	for (i = 0; i < count; i++) {
+		ret = create_handle(descriptor, bos[i], &hnds[i]);
+		if (ret)
+			break;
+
+		id = drv_bo_get_plane_handle(bos[i], 0).u32;
+		buffers[i] = new cros_gralloc_buffer(id, bos[i], hnds[i],
+						     hnds[i]->fds[hnds[i]->num_planes],
+						     hnds[i]->reserved_region_size);
+	}
+
+	if (ret) {
+		/* Nothing has been published yet, so the whole batch can be undone. */
+		for (uint32_t j = 0; j < i; j++)
+			delete buffers[j];
+		for (uint32_t j = i; j < count; j++)
+			drv_bo_destroy(bos[j]);
+		return ret;
+	}
 
 	std::lock_guard<std::mutex> lock(mutex_);
-	buffers_.emplace(id, buffer);
-	handles_.emplace(hnd, std::make_pair(buffer, 1));
-	*out_handle = reinterpret_cast<buffer_handle_t>(hnd);
+	for (i = 0; i < count; i++) {
+		std::shared_ptr<cros_gralloc_buffer> buffer(buffers[i]);
+		auto &shard = get_shard(hnds[i]);
+
+		buffers_.emplace(buffer->get_id(), buffer);
+		std::lock_guard<std::mutex> shard_lock(shard.mutex);
+		shard.handles.emplace(hnds[i], std::make_pair(buffer, 1));
+		out_handles[i] = reinterpret_cast<buffer_handle_t>(hnds[i]);
+	}
+
 	return 0;
 }
 
@@ -381,11 +448,15 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 
 	drv = drv_render_;
 
-	auto buffer = get_buffer(hnd);
-	if (buffer) {
-		handles_[hnd].second++;
-		buffer->increase_refcount();
-		return 0;
+	auto &shard = get_shard(hnd);
+	{
+		std::lock_guard<std::mutex> shard_lock(shard.mutex);
+		auto it = shard.handles.find(hnd);
+		if (it != shard.handles.end()) {
+			it->second.second++;
+			it->second.first->increase_refcount();
+			return 0;
+		}
 	}
 
 	if (drmPrimeFDToHandle(drv_get_fd(drv), hnd->fds[0], &id)) {
@@ -393,8 +464,10 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 		return -errno;
 	}
 
-	if (buffers_.count(id)) {
-		buffer = buffers_[id];
+	std::shared_ptr<cros_gralloc_buffer> buffer;
+	auto it = buffers_.find(id);
+	if (it != buffers_.end()) {
+		buffer = it->second;
 		buffer->increase_refcount();
 	} else {
 		struct bo *bo;
@@ -418,17 +491,21 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 
 		id = drv_bo_get_plane_handle(bo, 0).u32;
 
-		buffer = new cros_gralloc_buffer(id, bo, nullptr, hnd->fds[hnd->num_planes],
-						 hnd->reserved_region_size);
+		buffer = std::make_shared<cros_gralloc_buffer>(id, bo, nullptr,
+							       hnd->fds[hnd->num_planes],
+							       hnd->reserved_region_size);
 		buffers_.emplace(id, buffer);
 	}
 
-	handles_.emplace(hnd, std::make_pair(buffer, 1));
+	std::lock_guard<std::mutex> shard_lock(shard.mutex);
+	shard.handles.emplace(hnd, std::make_pair(buffer, 1));
 	return 0;
 }
 
 int32_t cros_gralloc_driver::release(buffer_handle_t handle)
 {
+	/* Declared before the lock, so a buffer released for the last time is destroyed unlocked. */
+	std::shared_ptr<cros_gralloc_buffer> buffer;
 	std::lock_guard<std::mutex> lock(mutex_);
 
 	auto hnd = cros_gralloc_convert_handle(handle);
@@ -437,19 +514,22 @@ int32_t cros_gralloc_driver::release(buffer_handle_t handle)
 		return -EINVAL;
 	}
 
-	auto buffer = get_buffer(hnd);
-	if (!buffer) {
-		drv_log("Invalid Reference.\n");
-		return -EINVAL;
-	}
+	auto &shard = get_shard(hnd);
+	{
+		std::lock_guard<std::mutex> shard_lock(shard.mutex);
+		auto it = shard.handles.find(hnd);
+		if (it == shard.handles.end()) {
+			drv_log("Invalid Reference.\n");
+			return -EINVAL;
+		}
 
-	if (!--handles_[hnd].second)
-		handles_.erase(hnd);
+		buffer = it->second.first;
+		if (!--it->second.second)
+			shard.handles.erase(it);
+	}
 
-	if (buffer->decrease_refcount() == 0) {
+	if (buffer->decrease_refcount() == 0)
 		buffers_.erase(buffer->get_id());
-		delete buffer;
-	}
 
 	return 0;
 }
@@ -458,11 +538,11 @@ int32_t cros_gralloc_driver::lock(buffer_handle_t handle, int32_t acquire_fence,
 				  bool close_acquire_fence, const struct rectangle *rect,
 				  uint32_t map_flags, uint8_t *addr[DRV_MAX_PLANES])
 {
-	int32_t ret = cros_gralloc_sync_wait(acquire_fence, close_acquire_fence);
+	std::future<int32_t> acquired;
+	int32_t ret = fence_worker_.wait_async(acquire_fence, close_acquire_fence, &acquired);
 	if (ret)
 		return ret;
 
-	std::lock_guard<std::mutex> lock(mutex_);
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		drv_log("Invalid handle.\n");
@@ -475,7 +555,25 @@ int32_t cros_gralloc_driver::lock(buffer_handle_t handle, int32_t acquire_fence,
 		return -EINVAL;
 	}
 
-	return buffer->lock(rect, map_flags, addr);
+	/*
+	 * While the acquire fence is pending the buffer is mapped in parallel, and the CPU caches
+	 * are only invalidated once the fence has signaled.
+	 */
+	if (map_flags && acquired.valid())
+		ret = buffer->lock(rect, map_flags | BO_MAP_NO_INVALIDATE, addr);
+	else
+		ret = buffer->lock(rect, map_flags, addr);
+	if (ret || !acquired.valid())
+		return ret;
+
+	ret = cros_gralloc_fence_worker::wait(acquired);
+	if (!ret && map_flags)
+		ret = buffer->invalidate();
+
+	if (ret)
+		buffer->unlock();
+
+	return ret;
 }
 
 #ifdef USE_GRALLOC1
@@ -486,7 +584,6 @@ int32_t cros_gralloc_driver::lock(buffer_handle_t handle, int32_t acquire_fence,
         if (ret)
                 return ret;
 
-        std::lock_guard<std::mutex> lock(mutex_);
         auto hnd = cros_gralloc_convert_handle(handle);
         if (!hnd) {
                 drv_log("Invalid handle.");
@@ -505,8 +602,7 @@ int32_t cros_gralloc_driver::lock(buffer_handle_t handle, int32_t acquire_fence,
 
 int32_t cros_gralloc_driver::unlock(buffer_handle_t handle, int32_t *release_fence)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
+	int32_t ret;
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		drv_log("Invalid handle.\n");
@@ -519,20 +615,37 @@ int32_t cros_gralloc_driver::unlock(buffer_handle_t handle, int32_t *release_fen
 		return -EINVAL;
 	}
 
+	/* Flushes that complete asynchronously hand out their own fence, no need to defer them. */
+	if (release_fence && drv_has_flush_fences(drv_render_))
+		return buffer->unlock_fenced(release_fence);
+
+	if (release_fence && fence_worker_.can_defer()) {
+		ret = buffer->unlock_deferred();
+		if (ret > 0) {
+			/* The queued work keeps the buffer alive until it has been flushed. */
+			*release_fence =
+			    fence_worker_.defer([buffer]() { buffer->complete_unlock(); });
+			if (*release_fence < 0)
+				buffer->complete_unlock();
+			return 0;
+		}
+	} else {
+		ret = buffer->unlock();
+	}
+
 	/*
 	 * From the ANativeWindow::dequeueBuffer documentation:
 	 *
 	 * "A value of -1 indicates that the caller may access the buffer immediately without
 	 * waiting on a fence."
 	 */
-	*release_fence = -1;
-	return buffer->unlock();
+	if (release_fence)
+		*release_fence = -1;
+	return ret;
 }
 
 int32_t cros_gralloc_driver::invalidate(buffer_handle_t handle)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		drv_log("Invalid handle.\n");
@@ -550,8 +663,6 @@ int32_t cros_gralloc_driver::invalidate(buffer_handle_t handle)
 
 int32_t cros_gralloc_driver::flush(buffer_handle_t handle, int32_t *release_fence)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		drv_log("Invalid handle.\n");
@@ -570,14 +681,11 @@ int32_t cros_gralloc_driver::flush(buffer_handle_t handle, int32_t *release_fenc
 	 * "A value of -1 indicates that the caller may access the buffer immediately without
 	 * waiting on a fence."
 	 */
-	*release_fence = -1;
-	return buffer->flush();
+	return buffer->flush(release_fence);
 }
 
 int32_t cros_gralloc_driver::get_backing_store(buffer_handle_t handle, uint64_t *out_store)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		drv_log("Invalid handle.\n");
@@ -598,11 +706,15 @@ int32_t cros_gralloc_driver::get_backing_store(buffer_handle_t handle, uint64_t
 	return 0;
 }
 
+void cros_gralloc_driver::get_transfer_stats(uint64_t *flushes, uint64_t *transfers,
+					     uint64_t *submissions)
+{
+	drv_get_transfer_stats(drv_render_, flushes, transfers, submissions);
+}
+
 int32_t cros_gralloc_driver::resource_info(buffer_handle_t handle, uint32_t strides[DRV_MAX_PLANES],
 					   uint32_t offsets[DRV_MAX_PLANES])
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		drv_log("Invalid handle.\n");
@@ -622,8 +734,6 @@ int32_t cros_gralloc_driver::get_reserved_region(buffer_handle_t handle,
 						 void **reserved_region_addr,
 						 uint64_t *reserved_region_size)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		drv_log("Invalid handle.\n");
@@ -646,22 +756,33 @@ uint32_t cros_gralloc_driver::get_resolved_drm_format(uint32_t drm_format, uint6
 	return drv_resolve_format(drv, drm_format, usage);
 }
 
-cros_gralloc_buffer *cros_gralloc_driver::get_buffer(cros_gralloc_handle_t hnd)
+cros_gralloc_driver::handle_shard &cros_gralloc_driver::get_shard(cros_gralloc_handle_t hnd)
+{
+	/* Handles are heap allocated, so the low bits carry no information. */
+	return handle_shards_[(reinterpret_cast<uintptr_t>(hnd) >> 4) % num_handle_shards];
+}
+
+std::shared_ptr<cros_gralloc_buffer> cros_gralloc_driver::get_buffer(cros_gralloc_handle_t hnd)
 {
-	/* Assumes driver mutex is held. */
-	if (handles_.count(hnd))
-		return handles_[hnd].first;
+	auto &shard = get_shard(hnd);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	auto it = shard.handles.find(hnd);
+	if (it == shard.handles.end())
+		return nullptr;
 
-	return nullptr;
+	return it->second.first;
 }
 
 void cros_gralloc_driver::for_each_handle(
     const std::function<void(cros_gralloc_handle_t)> &function)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	for (auto &shard : handle_shards_) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
 
-	for (const auto &pair : handles_) {
-		function(pair.first);
+		for (const auto &pair : shard.handles) {
+			function(pair.first);
+		}
 	}
 }
 
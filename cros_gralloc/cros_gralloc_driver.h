@@ -8,8 +8,10 @@
 #define CROS_GRALLOC_DRIVER_H
 
 #include "cros_gralloc_buffer.h"
+#include "cros_gralloc_fence.h"
 
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <unordered_map>
 
@@ -23,6 +25,12 @@ class cros_gralloc_driver
 	bool is_supported(struct cros_gralloc_buffer_descriptor *descriptor);
 	int32_t allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
 			 buffer_handle_t *out_handle);
+	/*
+	 * Allocates count buffers from one descriptor. The layout is computed once and the driver
+	 * lock is taken once. On failure nothing is allocated.
+	 */
+	int32_t allocate_batch(const struct cros_gralloc_buffer_descriptor *descriptor,
+			       uint32_t count, buffer_handle_t *out_handles);
 
 	int32_t retain(buffer_handle_t handle);
 	int32_t release(buffer_handle_t handle);
@@ -34,12 +42,18 @@ class cros_gralloc_driver
 	int32_t lock(buffer_handle_t handle, int32_t acquire_fence, uint32_t map_flags,
 			                     uint8_t *addr[DRV_MAX_PLANES]);
 #endif
+	/*
+	 * Returns a release fence for the flush of written buffers when one can be created, or -1.
+	 * A null release_fence asks for the flush to complete before returning.
+	 */
 	int32_t unlock(buffer_handle_t handle, int32_t *release_fence);
 
 	int32_t invalidate(buffer_handle_t handle);
 	int32_t flush(buffer_handle_t handle, int32_t *release_fence);
 
 	int32_t get_backing_store(buffer_handle_t handle, uint64_t *out_store);
+	/* See drv_get_transfer_stats(). */
+	void get_transfer_stats(uint64_t *flushes, uint64_t *transfers, uint64_t *submissions);
 	int32_t resource_info(buffer_handle_t handle, uint32_t strides[DRV_MAX_PLANES],
 			      uint32_t offsets[DRV_MAX_PLANES]);
 
@@ -55,13 +69,28 @@ class cros_gralloc_driver
       private:
 	cros_gralloc_driver(cros_gralloc_driver const &);
 	cros_gralloc_driver operator=(cros_gralloc_driver const &);
-	cros_gralloc_buffer *get_buffer(cros_gralloc_handle_t hnd);
+	std::shared_ptr<cros_gralloc_buffer> get_buffer(cros_gralloc_handle_t hnd);
+
+	/*
+	 * Handles are spread over shards so that looking up different buffers never contends.
+	 * Lookups return a shared_ptr, so a buffer stays alive while it is being used even if the
+	 * last handle to it is released concurrently.
+	 */
+	struct handle_shard {
+		std::mutex mutex;
+		std::unordered_map<cros_gralloc_handle_t,
+				   std::pair<std::shared_ptr<cros_gralloc_buffer>, int32_t>>
+		    handles;
+	};
+	static const size_t num_handle_shards = 16;
+	handle_shard &get_shard(cros_gralloc_handle_t hnd);
 
 	struct driver *drv_render_;
+	/* Serializes allocate, retain and release, and guards buffers_ and buffer refcounts. */
 	std::mutex mutex_;
-	std::unordered_map<uint32_t, cros_gralloc_buffer *> buffers_;
-	std::unordered_map<cros_gralloc_handle_t, std::pair<cros_gralloc_buffer *, int32_t>>
-	    handles_;
+	std::unordered_map<uint32_t, std::shared_ptr<cros_gralloc_buffer>> buffers_;
+	handle_shard handle_shards_[num_handle_shards];
+	cros_gralloc_fence_worker fence_worker_;
 };
 
 #endif
@@ -0,0 +1,292 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "cros_gralloc_fence.h"
+
+#include "cros_gralloc_helpers.h"
+
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/types.h>
+#include <string.h>
+#include <sync/sync.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+/*
+ * The sw_sync debugfs interface, which the kernel doesn't export a header for. Each release fence
+ * is a point on our own timeline, and the timeline advances by one per completed piece of work.
+ */
+struct sw_sync_create_fence_data {
+	__u32 value;
+	char name[32];
+	__s32 fence;
+};
+
+#define SW_SYNC_IOC_MAGIC 'W'
+#define SW_SYNC_IOC_CREATE_FENCE _IOWR(SW_SYNC_IOC_MAGIC, 0, struct sw_sync_create_fence_data)
+#define SW_SYNC_IOC_INC _IOW(SW_SYNC_IOC_MAGIC, 1, __u32)
+
+struct fence_wait {
+	/* Owned by the wait. */
+	int32_t fd;
+	std::promise<int32_t> promise;
+};
+
+cros_gralloc_fence_worker::cros_gralloc_fence_worker()
+    : epoll_fd_(-1), event_fd_(-1), timeline_fd_(-1), timeline_value_(0), stop_(false),
+      running_(false)
+{
+}
+
+cros_gralloc_fence_worker::~cros_gralloc_fence_worker()
+{
+	stop();
+
+	if (timeline_fd_ >= 0)
+		close(timeline_fd_);
+	if (event_fd_ >= 0)
+		close(event_fd_);
+	if (epoll_fd_ >= 0)
+		close(epoll_fd_);
+}
+
+int32_t cros_gralloc_fence_worker::init()
+{
+	struct epoll_event event = {};
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd_ < 0)
+		return -errno;
+
+	event_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (event_fd_ < 0)
+		return -errno;
+
+	/* A null pointer marks the eventfd; every other event carries a fence_wait. */
+	event.events = EPOLLIN;
+	event.data.ptr = nullptr;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &event))
+		return -errno;
+
+#ifdef USE_SW_SYNC
+	/*
+	 * sw_sync is a debug interface and user builds don't allow clients to open it. Without it
+	 * unlock flushes synchronously and returns a release fence of -1.
+	 */
+	timeline_fd_ = open("/sys/kernel/debug/sync/sw_sync", O_RDWR | O_CLOEXEC);
+	if (timeline_fd_ < 0)
+		timeline_fd_ = open("/dev/sw_sync", O_RDWR | O_CLOEXEC);
+#endif
+
+	running_ = true;
+	thread_ = std::thread(&cros_gralloc_fence_worker::run, this);
+	return 0;
+}
+
+void cros_gralloc_fence_worker::stop()
+{
+	uint64_t one = 1;
+
+	if (!thread_.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+
+	if (write(event_fd_, &one, sizeof(one)) != sizeof(one))
+		drv_log("Failed to wake fence worker: %s\n", strerror(errno));
+
+	thread_.join();
+}
+
+int32_t cros_gralloc_fence_worker::wait_async(int32_t fence, bool close_fence,
+					      std::future<int32_t> *done)
+{
+	struct epoll_event event = {};
+	struct fence_wait *wait;
+	bool registered;
+
+	*done = std::future<int32_t>();
+
+	if (fence < 0)
+		return 0;
+
+	if (!thread_.joinable() || !sync_wait(fence, 0))
+		return cros_gralloc_sync_wait(fence, close_fence);
+
+	wait = new fence_wait;
+	wait->fd = close_fence ? fence : fcntl(fence, F_DUPFD_CLOEXEC, 0);
+	if (wait->fd < 0) {
+		delete wait;
+		return cros_gralloc_sync_wait(fence, close_fence);
+	}
+
+	*done = wait->promise.get_future();
+
+	/* The worker owns the wait as soon as it is registered. */
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = wait;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		registered = running_;
+		if (registered && epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wait->fd, &event)) {
+			drv_log("Failed to watch fence: %s\n", strerror(errno));
+			registered = false;
+		}
+		if (registered)
+			waits_.insert(wait);
+	}
+
+	if (!registered) {
+		*done = std::future<int32_t>();
+		if (!close_fence)
+			close(wait->fd);
+		delete wait;
+		return cros_gralloc_sync_wait(fence, close_fence);
+	}
+
+	return 0;
+}
+
+int32_t cros_gralloc_fence_worker::wait(std::future<int32_t> &done)
+{
+	/* Like cros_gralloc_sync_wait(), a slow fence is only reported and then waited for. */
+	if (done.wait_for(std::chrono::milliseconds(1000)) == std::future_status::timeout)
+		drv_log("Timed out on sync wait\n");
+
+	return done.get();
+}
+
+bool cros_gralloc_fence_worker::can_defer() const
+{
+	return timeline_fd_ >= 0 && running_;
+}
+
+int32_t cros_gralloc_fence_worker::defer(std::function<void()> work)
+{
+	struct sw_sync_create_fence_data data = {};
+	uint64_t one = 1;
+
+	if (!can_defer())
+		return -1;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!running_)
+		return -1;
+
+	/* Fences are created in queue order, so the timeline reaches them in that order too. */
+	data.value = timeline_value_ + 1;
+	strncpy(data.name, "cros_gralloc_release", sizeof(data.name) - 1);
+	if (ioctl(timeline_fd_, SW_SYNC_IOC_CREATE_FENCE, &data)) {
+		drv_log("Failed to create release fence: %s\n", strerror(errno));
+		return -1;
+	}
+
+	timeline_value_++;
+	deferred_.push_back(std::move(work));
+
+	if (write(event_fd_, &one, sizeof(one)) != sizeof(one))
+		drv_log("Failed to wake fence worker: %s\n", strerror(errno));
+
+	return data.fence;
+}
+
+void cros_gralloc_fence_worker::run_deferred()
+{
+	const __u32 one = 1;
+
+	for (;;) {
+		std::function<void()> work;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (deferred_.empty())
+				return;
+			work = std::move(deferred_.front());
+			deferred_.pop_front();
+		}
+
+		work();
+
+		if (ioctl(timeline_fd_, SW_SYNC_IOC_INC, &one))
+			drv_log("Failed to signal release fence: %s\n", strerror(errno));
+	}
+}
+
+void cros_gralloc_fence_worker::complete_wait(struct fence_wait *wait, int32_t result)
+{
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, wait->fd, nullptr);
+	wait->promise.set_value(result);
+	close(wait->fd);
+	delete wait;
+}
+
+void cros_gralloc_fence_worker::shut_down()
+{
+	std::unordered_set<struct fence_wait *> waits;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		running_ = false;
+		waits.swap(waits_);
+	}
+
+	/* Nothing can be queued any more, so this also signals every release fence handed out. */
+	run_deferred();
+
+	for (auto wait : waits)
+		complete_wait(wait, -EIO);
+}
+
+void cros_gralloc_fence_worker::run()
+{
+	struct epoll_event events[16];
+	uint64_t count;
+	int num_events;
+
+	for (;;) {
+		num_events = epoll_wait(epoll_fd_, events, 16, -1);
+		if (num_events < 0) {
+			if (errno == EINTR)
+				continue;
+			drv_log("Fence worker failed: %s\n", strerror(errno));
+			shut_down();
+			return;
+		}
+
+		for (int i = 0; i < num_events; i++) {
+			auto wait = static_cast<struct fence_wait *>(events[i].data.ptr);
+
+			if (!wait) {
+				if (read(event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+					drv_log("Failed to read eventfd: %s\n", strerror(errno));
+
+				run_deferred();
+
+				std::unique_lock<std::mutex> lock(mutex_);
+				if (stop_ && deferred_.empty()) {
+					lock.unlock();
+					shut_down();
+					return;
+				}
+				continue;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				waits_.erase(wait);
+			}
+
+			/* A signaled sync_file is readable; sync_wait() reports its error status. */
+			complete_wait(wait, sync_wait(wait->fd, 0) ? -errno : 0);
+		}
+	}
+}
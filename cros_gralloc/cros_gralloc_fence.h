@@ -0,0 +1,87 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef CROS_GRALLOC_FENCE_H
+#define CROS_GRALLOC_FENCE_H
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
+struct fence_wait;
+
+/*
+ * A small thread that waits for sync_file fences with epoll and runs deferred CPU work. It lets
+ * lock map a buffer while the acquire fence is still pending, and lets unlock hand out a release
+ * fence instead of flushing on the caller's thread.
+ */
+class cros_gralloc_fence_worker
+{
+      public:
+	cros_gralloc_fence_worker();
+	~cros_gralloc_fence_worker();
+
+	int32_t init();
+	/*
+	 * Runs all deferred work and stops the thread. Waits still pending fail with -EIO, and
+	 * fences then are waited for synchronously.
+	 */
+	void stop();
+
+	/*
+	 * Starts waiting for fence in the background and returns the result through done. The fence
+	 * is closed when close_fence is set, otherwise the caller keeps it. Fences that have already
+	 * signaled, and all fences when the worker isn't running, are waited for synchronously and
+	 * leave done invalid.
+	 */
+	int32_t wait_async(int32_t fence, bool close_fence, std::future<int32_t> *done);
+
+	/*
+	 * Blocks until a wait started by wait_async() completes and returns its result. A wait that
+	 * takes over a second is logged.
+	 */
+	static int32_t wait(std::future<int32_t> &done);
+
+	/* Whether defer() can produce release fences. */
+	bool can_defer() const;
+
+	/*
+	 * Queues work for the worker thread and returns a sync_file fence that signals once it has
+	 * run. Returns -1 without queueing anything if no fence could be created.
+	 */
+	int32_t defer(std::function<void()> work);
+
+      private:
+	cros_gralloc_fence_worker(cros_gralloc_fence_worker const &);
+	cros_gralloc_fence_worker operator=(cros_gralloc_fence_worker const &);
+
+	void run();
+	void run_deferred();
+	void complete_wait(struct fence_wait *wait, int32_t result);
+	/* Fails the registered waits and runs the remaining work once the thread exits. */
+	void shut_down();
+
+	int32_t epoll_fd_;
+	int32_t event_fd_;
+	/* sw_sync timeline the release fences are created on, or -1. */
+	int32_t timeline_fd_;
+
+	std::mutex mutex_;
+	uint32_t timeline_value_;
+	std::deque<std::function<void()>> deferred_;
+	/* Waits registered with epoll, owned by the worker. */
+	std::unordered_set<struct fence_wait *> waits_;
+	bool stop_;
+	/* Cleared under mutex_ when the thread exits, after which nothing new is accepted. */
+	std::atomic<bool> running_;
+	std::thread thread_;
+};
+
+#endif
@@ -31,6 +31,8 @@ enum {
 	GRALLOC_DRM_GET_FORMAT,
 	GRALLOC_DRM_GET_DIMENSIONS,
 	GRALLOC_DRM_GET_BACKING_STORE,
+	/* minigbm only: the device-wide drv_get_transfer_stats() counters. */
+	GRALLOC_DRM_GET_TRANSFER_STATS,
 };
 // clang-format on
 
@@ -228,24 +230,16 @@ static int gralloc0_lock(struct gralloc_module_t const *module, buffer_handle_t
 
 static int gralloc0_unlock(struct gralloc_module_t const *module, buffer_handle_t handle)
 {
-	int32_t fence_fd, ret;
 	auto mod = (struct gralloc0_module const *)module;
-	ret = mod->driver->unlock(handle, &fence_fd);
-	if (ret)
-		return ret;
-
-	ret = cros_gralloc_sync_wait(fence_fd, /*close_acquire_fence=*/true);
-	if (ret)
-		return ret;
-
-	return 0;
+	/* Without a release fence the flush completes before unlock returns. */
+	return mod->driver->unlock(handle, nullptr);
 }
 
 static int gralloc0_perform(struct gralloc_module_t const *module, int op, ...)
 {
 	va_list args;
 	int32_t *out_format, ret;
-	uint64_t *out_store;
+	uint64_t *out_store, *out_flushes, *out_transfers, *out_submissions;
 	buffer_handle_t handle;
 	uint32_t *out_width, *out_height, *out_stride;
 	uint32_t strides[DRV_MAX_PLANES] = { 0, 0, 0, 0 };
@@ -257,6 +251,7 @@ static int gralloc0_perform(struct gralloc_module_t const *module, int op, ...)
 	case GRALLOC_DRM_GET_FORMAT:
 	case GRALLOC_DRM_GET_DIMENSIONS:
 	case GRALLOC_DRM_GET_BACKING_STORE:
+	case GRALLOC_DRM_GET_TRANSFER_STATS:
 		break;
 	default:
 		return -EINVAL;
@@ -301,6 +296,12 @@ static int gralloc0_perform(struct gralloc_module_t const *module, int op, ...)
 		out_store = va_arg(args, uint64_t *);
 		ret = mod->driver->get_backing_store(handle, out_store);
 		break;
+	case GRALLOC_DRM_GET_TRANSFER_STATS:
+		out_flushes = va_arg(args, uint64_t *);
+		out_transfers = va_arg(args, uint64_t *);
+		out_submissions = va_arg(args, uint64_t *);
+		mod->driver->get_transfer_stats(out_flushes, out_transfers, out_submissions);
+		break;
 	default:
 		ret = -EINVAL;
 	}
@@ -12,9 +12,12 @@
  */
 
 #define _GNU_SOURCE
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <cutils/native_handle.h>
@@ -47,6 +50,7 @@ enum {
 	GRALLOC_DRM_GET_FORMAT,
 	GRALLOC_DRM_GET_DIMENSIONS,
 	GRALLOC_DRM_GET_BACKING_STORE,
+	GRALLOC_DRM_GET_TRANSFER_STATS,
 };
 
 struct gralloctest_context {
@@ -461,6 +465,55 @@ static int test_mapping(struct gralloctest_context *ctx)
 	return 1;
 }
 
+/*
+ * This function tests that a write lock of part of the buffer is flushed, and that it leaves
+ * the rest of the buffer alone.
+ */
+static int test_partial_flush(struct gralloctest_context *ctx)
+{
+	struct grallocinfo info;
+	uint32_t *ptr = NULL;
+	struct gralloc_module_t *mod = ctx->module;
+	int x, y, inside;
+
+	grallocinfo_init(&info, 512, 512, HAL_PIXEL_FORMAT_BGRA_8888,
+			 GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN);
+
+	CHECK(allocate(ctx->device, &info));
+
+	CHECK(mod->lock(mod, info.handle, info.usage, 0, 0, info.w, info.h, &info.vaddr) == 0);
+	ptr = (uint32_t *)info.vaddr;
+	CHECK(ptr);
+	for (y = 0; y < info.h; y++)
+		for (x = 0; x < info.w; x++)
+			ptr[y * info.stride + x] = 0x11111111;
+	CHECK(unlock(mod, &info));
+
+	CHECK(mod->lock(mod, info.handle, info.usage, 100, 200, 64, 32, &info.vaddr) == 0);
+	ptr = (uint32_t *)info.vaddr;
+	CHECK(ptr);
+	for (y = 200; y < 232; y++)
+		for (x = 100; x < 164; x++)
+			ptr[y * info.stride + x] = 0x22222222;
+	CHECK(unlock(mod, &info));
+
+	CHECK(mod->lock(mod, info.handle, GRALLOC_USAGE_SW_READ_OFTEN, 0, 0, info.w, info.h,
+			&info.vaddr) == 0);
+	ptr = (uint32_t *)info.vaddr;
+	CHECK(ptr);
+	for (y = 0; y < info.h; y++) {
+		for (x = 0; x < info.w; x++) {
+			inside = x >= 100 && x < 164 && y >= 200 && y < 232;
+			CHECK(ptr[y * info.stride + x] == (inside ? 0x22222222 : 0x11111111));
+		}
+	}
+	CHECK(unlock(mod, &info));
+
+	CHECK(deallocate(ctx->device, &info));
+
+	return 1;
+}
+
 /* This function tests the private API we use in ARC++ -- not part of official
  * gralloc. */
 static int test_perform(struct gralloctest_context *ctx)
@@ -501,6 +554,44 @@ static int test_perform(struct gralloctest_context *ctx)
 	return 1;
 }
 
+/*
+ * This function tests the transfer counters of the minigbm private API. They only move on
+ * drivers that copy written data to the device, and are printed so they can be compared
+ * between runs.
+ */
+static int test_transfer_stats(struct gralloctest_context *ctx)
+{
+	uint64_t flushes[2], transfers[2], submissions[2];
+	struct grallocinfo info;
+	struct gralloc_module_t *mod = ctx->module;
+
+	grallocinfo_init(&info, 512, 512, HAL_PIXEL_FORMAT_RGBA_8888,
+			 GRALLOC_USAGE_SW_WRITE_OFTEN | GRALLOC_USAGE_HW_TEXTURE);
+
+	CHECK(allocate(ctx->device, &info));
+	CHECK(mod->perform(mod, GRALLOC_DRM_GET_TRANSFER_STATS, info.handle, &flushes[0],
+			   &transfers[0], &submissions[0]) == 0);
+
+	CHECK(lock(mod, &info));
+	memset(info.vaddr, 0x80, info.stride * 4);
+	CHECK(unlock(mod, &info));
+
+	CHECK(mod->perform(mod, GRALLOC_DRM_GET_TRANSFER_STATS, info.handle, &flushes[1],
+			   &transfers[1], &submissions[1]) == 0);
+	CHECK(deallocate(ctx->device, &info));
+
+	/* Every counted flush takes at least one transfer, and a submission carries one or more. */
+	CHECK(flushes[1] >= flushes[0] && transfers[1] >= transfers[0]);
+	CHECK(transfers[1] - transfers[0] >= flushes[1] - flushes[0]);
+	CHECK(submissions[1] - submissions[0] <= transfers[1] - transfers[0]);
+
+	fprintf(stdout, "[ INFO     ] flushes %" PRIu64 ", transfers %" PRIu64
+			", submissions %" PRIu64 "\n",
+		flushes[1], transfers[1], submissions[1]);
+
+	return 1;
+}
+
 /* This function tests that only YUV buffers work with *lock_ycbcr. */
 static int test_ycbcr(struct gralloctest_context *ctx)
 
@@ -633,16 +724,84 @@ static int test_async(struct gralloctest_context *ctx)
 	return 1;
 }
 
+#define CONCURRENT_LOCK_THREADS 4
+#define CONCURRENT_LOCK_ITERATIONS 5000
+
+struct concurrent_lock_args {
+	struct gralloctest_context *ctx;
+	struct grallocinfo info;
+	int success;
+};
+
+static void *concurrent_lock_thread(void *data)
+{
+	struct concurrent_lock_args *args = data;
+	int i;
+
+	args->success = 0;
+	for (i = 0; i < CONCURRENT_LOCK_ITERATIONS; i++) {
+		if (!lock(args->ctx->module, &args->info) || !args->info.vaddr)
+			return NULL;
+		if (!unlock(args->ctx->module, &args->info))
+			return NULL;
+	}
+
+	args->success = 1;
+	return NULL;
+}
+
+/*
+ * This function locks and unlocks a separate buffer on each of several threads at once and
+ * reports the throughput. Threads working on different buffers shouldn't serialize each other.
+ */
+static int test_concurrent_lock(struct gralloctest_context *ctx)
+{
+	struct concurrent_lock_args args[CONCURRENT_LOCK_THREADS];
+	pthread_t threads[CONCURRENT_LOCK_THREADS];
+	struct timespec start, end;
+	double seconds;
+	int i;
+
+	for (i = 0; i < CONCURRENT_LOCK_THREADS; i++) {
+		args[i].ctx = ctx;
+		grallocinfo_init(&args[i].info, 512, 512, HAL_PIXEL_FORMAT_BGRA_8888,
+				 GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN);
+		CHECK(allocate(ctx->device, &args[i].info));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < CONCURRENT_LOCK_THREADS; i++)
+		CHECK(pthread_create(&threads[i], NULL, concurrent_lock_thread, &args[i]) == 0);
+
+	for (i = 0; i < CONCURRENT_LOCK_THREADS; i++)
+		CHECK(pthread_join(threads[i], NULL) == 0);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%d threads: %.0f lock/unlock pairs per second\n", CONCURRENT_LOCK_THREADS,
+	       CONCURRENT_LOCK_THREADS * CONCURRENT_LOCK_ITERATIONS / seconds);
+
+	for (i = 0; i < CONCURRENT_LOCK_THREADS; i++) {
+		CHECK(args[i].success);
+		CHECK(deallocate(ctx->device, &args[i].info));
+	}
+
+	return 1;
+}
+
 static const struct gralloc_testcase tests[] = {
 	{ "alloc_varying_sizes", test_alloc_varying_sizes, 1 },
 	{ "alloc_combinations", test_alloc_combinations, 1 },
 	{ "api", test_api, 1 },
 	{ "gralloc_order", test_gralloc_order, 1 },
 	{ "mapping", test_mapping, 1 },
+	{ "partial_flush", test_partial_flush, 1 },
 	{ "perform", test_perform, 1 },
+	{ "transfer_stats", test_transfer_stats, 1 },
 	{ "ycbcr", test_ycbcr, 2 },
 	{ "yuv_info", test_yuv_info, 2 },
 	{ "async", test_async, 3 },
+	{ "concurrent_lock", test_concurrent_lock, 1 },
 };
 
 static void print_help(const char *argv0)
@@ -376,8 +376,8 @@ int32_t CrosGralloc1::importBuffer(const buffer_handle_t rawHandle, buffer_handl
 	return GRALLOC1_ERROR_NONE;
 }
 
-int32_t CrosGralloc1::allocate(struct cros_gralloc_buffer_descriptor *descriptor,
-			       buffer_handle_t *outBufferHandle)
+int32_t CrosGralloc1::allocate(struct cros_gralloc_buffer_descriptor *descriptor, uint32_t count,
+			       buffer_handle_t *outBufferHandles)
 {
 	// If this function is being called, it's because we handed out its function
 	// pointer, which only occurs when mDevice has been loaded successfully and
@@ -395,30 +395,53 @@ int32_t CrosGralloc1::allocate(struct cros_gralloc_buffer_descriptor *descriptor
 		return CROS_GRALLOC_ERROR_UNSUPPORTED;
 	}
 
-	if (driver->allocate(descriptor, outBufferHandle))
+	if (driver->allocate_batch(descriptor, count, outBufferHandles))
 		return CROS_GRALLOC_ERROR_NO_RESOURCES;
 
 	return CROS_GRALLOC_ERROR_NONE;
 }
 
+static bool isSameAllocation(const struct cros_gralloc_buffer_descriptor *a,
+			     const struct cros_gralloc_buffer_descriptor *b)
+{
+	return a->width == b->width && a->height == b->height &&
+	       a->droid_format == b->droid_format && a->drm_format == b->drm_format &&
+	       a->producer_usage == b->producer_usage && a->consumer_usage == b->consumer_usage &&
+	       a->modifier == b->modifier && a->reserved_region_size == b->reserved_region_size &&
+	       a->name == b->name;
+}
+
 int32_t CrosGralloc1::allocateBuffers(gralloc1_device_t *device, uint32_t numDescriptors,
 				      const gralloc1_buffer_descriptor_t *descriptors,
 				      buffer_handle_t *outBuffers)
 {
 	auto adapter = getAdapter(device);
 	for (uint32_t i = 0; i < numDescriptors; i++) {
-		auto descriptor = (struct cros_gralloc_buffer_descriptor *)descriptors[i];
-		if (!descriptor) {
+		if (!descriptors[i]) {
 			return CROS_GRALLOC_ERROR_BAD_DESCRIPTOR;
 		}
+	}
+
+	// Runs of identical descriptors are allocated as one batch.
+	uint32_t allocated = 0;
+	while (allocated < numDescriptors) {
+		auto descriptor = (struct cros_gralloc_buffer_descriptor *)descriptors[allocated];
+		uint32_t count = 1;
+		while (allocated + count < numDescriptors &&
+		       isSameAllocation(descriptor, (struct cros_gralloc_buffer_descriptor *)
+							descriptors[allocated + count])) {
+			count++;
+		}
 
-		buffer_handle_t bufferHandle = nullptr;
-		int32_t error = adapter->allocate(descriptor, &bufferHandle);
+		int32_t error = adapter->allocate(descriptor, count, &outBuffers[allocated]);
 		if (error != CROS_GRALLOC_ERROR_NONE) {
+			for (uint32_t i = 0; i < allocated; i++) {
+				adapter->release(outBuffers[i]);
+			}
 			return error;
 		}
 
-		outBuffers[i] = bufferHandle;
+		allocated += count;
 	}
 
 	return CROS_GRALLOC_ERROR_NONE;
@@ -246,8 +246,8 @@ class CrosGralloc1 : public gralloc1_device_t
 	}
 
 	// Buffer Management functions
-	int32_t allocate(struct cros_gralloc_buffer_descriptor *descriptor,
-			 buffer_handle_t *outBufferHandle);
+	int32_t allocate(struct cros_gralloc_buffer_descriptor *descriptor, uint32_t count,
+			 buffer_handle_t *outBufferHandles);
 	static int32_t allocateBuffers(gralloc1_device_t *device, uint32_t numDescriptors,
 				       const gralloc1_buffer_descriptor_t *descriptors,
 				       buffer_handle_t *outBuffers);
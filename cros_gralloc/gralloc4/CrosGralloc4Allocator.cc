@@ -30,14 +30,14 @@ CrosGralloc4Allocator::CrosGralloc4Allocator() : mDriver(std::make_unique<cros_g
     }
 }
 
-Error CrosGralloc4Allocator::allocate(const BufferDescriptorInfo& descriptor, uint32_t* outStride,
-                                      hidl_handle* outHandle) {
+Error CrosGralloc4Allocator::allocate(const BufferDescriptorInfo& descriptor, uint32_t count,
+                                      uint32_t* outStride, hidl_vec<hidl_handle>* outHandles) {
     if (!mDriver) {
         drv_log("Failed to allocate. Driver is uninitialized.\n");
         return Error::NO_RESOURCES;
     }
 
-    if (!outStride || !outHandle) {
+    if (!outStride || !outHandles) {
         return Error::NO_RESOURCES;
     }
 
@@ -55,19 +55,30 @@ Error CrosGralloc4Allocator::allocate(const BufferDescriptorInfo& descriptor, ui
         return Error::UNSUPPORTED;
     }
 
-    buffer_handle_t handle;
-    int ret = mDriver->allocate(&crosDescriptor, &handle);
+    // All buffers share one descriptor, so they are allocated as a single batch.
+    std::vector<buffer_handle_t> bufferHandles(count);
+    int ret = mDriver->allocate_batch(&crosDescriptor, count, bufferHandles.data());
     if (ret) {
         return Error::NO_RESOURCES;
     }
 
-    cros_gralloc_handle_t crosHandle = cros_gralloc_convert_handle(handle);
-    if (!crosHandle) {
-        return Error::NO_RESOURCES;
+    outHandles->resize(count);
+    for (uint32_t i = 0; i < count; i++) {
+        (*outHandles)[i] = bufferHandles[i];
     }
 
-    *outHandle = handle;
-    *outStride = crosHandle->pixel_stride;
+    if (count > 0) {
+        cros_gralloc_handle_t crosHandle = cros_gralloc_convert_handle(bufferHandles[0]);
+        if (!crosHandle) {
+            for (buffer_handle_t handle : bufferHandles) {
+                mDriver->release(handle);
+            }
+            outHandles->resize(0);
+            return Error::NO_RESOURCES;
+        }
+
+        *outStride = crosHandle->pixel_stride;
+    }
 
     return Error::NONE;
 }
@@ -91,19 +102,12 @@ Return<void> CrosGralloc4Allocator::allocate(const hidl_vec<uint8_t>& descriptor
         return Void();
     }
 
-    handles.resize(count);
-
     uint32_t stride = 0;
-    for (int i = 0; i < handles.size(); i++) {
-        Error err = allocate(description, &stride, &(handles[i]));
-        if (err != Error::NONE) {
-            for (int j = 0; j < i; j++) {
-                mDriver->release(handles[j].getNativeHandle());
-            }
-            handles.resize(0);
-            hidlCb(err, 0, handles);
-            return Void();
-        }
+    Error err = allocate(description, count, &stride, &handles);
+    if (err != Error::NONE) {
+        handles.resize(0);
+        hidlCb(err, 0, handles);
+        return Void();
     }
 
     hidlCb(Error::NONE, stride, handles);
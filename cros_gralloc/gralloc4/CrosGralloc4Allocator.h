@@ -20,7 +20,8 @@ class CrosGralloc4Allocator : public android::hardware::graphics::allocator::V4_
     android::hardware::graphics::mapper::V4_0::Error allocate(
             const android::hardware::graphics::mapper::V4_0::IMapper::BufferDescriptorInfo&
                     description,
-            uint32_t* outStride, android::hardware::hidl_handle* outHandle);
+            uint32_t count, uint32_t* outStride,
+            android::hardware::hidl_vec<android::hardware::hidl_handle>* outHandles);
 
     std::unique_ptr<cros_gralloc_driver> mDriver;
 };
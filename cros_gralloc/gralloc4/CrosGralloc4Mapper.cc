@@ -12,10 +12,12 @@
 #include <aidl/android/hardware/graphics/common/Rect.h>
 #include <cutils/native_handle.h>
 #include <gralloctypes/Gralloc4.h>
+#include <unistd.h>
 
 #include "cros_gralloc/gralloc4/CrosGralloc4Utils.h"
 #include "helpers.h"
 #include "cros_gralloc/cros_gralloc_helpers.h"
+#include "util.h"
 
 #ifdef USE_GRALLOC1
 #include "cros_gralloc/i915_private_android_types.h"
@@ -34,6 +36,23 @@ using android::hardware::graphics::common::V1_2::PixelFormat;
 using android::hardware::graphics::mapper::V4_0::Error;
 using android::hardware::graphics::mapper::V4_0::IMapper;
 
+/*
+ * The metadata types that SurfaceFlinger and HWC query per layer per frame. None of them can change
+ * after allocation, so they are encoded once when a buffer is imported.
+ */
+static const IMapper::MetadataType* const kCachedMetadataTypes[] = {
+        &android::gralloc4::MetadataType_PlaneLayouts,
+        &android::gralloc4::MetadataType_Crop,
+        &android::gralloc4::MetadataType_Dataspace,
+        &android::gralloc4::MetadataType_PixelFormatFourCC,
+        &android::gralloc4::MetadataType_PixelFormatModifier,
+        &android::gralloc4::MetadataType_BlendMode,
+};
+
+struct CrosGralloc4Mapper::EncodedMetadata {
+    hidl_vec<uint8_t> blobs[ARRAY_SIZE(kCachedMetadataTypes)];
+};
+
 CrosGralloc4Mapper::CrosGralloc4Mapper() : mDriver(std::make_unique<cros_gralloc_driver>()) {
     if (mDriver->init()) {
         drv_log("Failed to initialize driver.\n");
@@ -103,6 +122,8 @@ Return<void> CrosGralloc4Mapper::importBuffer(const hidl_handle& handle, importB
         return Void();
     }
 
+    cacheMetadata(cros_gralloc_convert_handle(importedBufferHandle));
+
     hidlCb(Error::NONE, importedBufferHandle);
     return Void();
 }
@@ -124,6 +145,11 @@ Return<Error> CrosGralloc4Mapper::freeBuffer(void* rawHandle) {
         return Error::BAD_BUFFER;
     }
 
+    {
+        std::lock_guard<std::mutex> lock(mMetadataCacheMutex);
+        mMetadataCache.erase(cros_gralloc_convert_handle(bufferHandle));
+    }
+
     native_handle_close(bufferHandle);
     native_handle_delete(bufferHandle);
     return Error::NONE;
@@ -326,11 +352,19 @@ Return<void> CrosGralloc4Mapper::unlock(void* rawHandle, unlock_cb hidlCb) {
     ret = convertToFenceHandle(releaseFenceFd, &releaseFenceHandle);
     if (ret) {
         drv_log("Failed to unlock. Failed to convert release fence to handle.\n");
+        if (releaseFenceFd >= 0) {
+            close(releaseFenceFd);
+        }
         hidlCb(Error::BAD_BUFFER, nullptr);
         return Void();
     }
 
     hidlCb(Error::NONE, releaseFenceHandle);
+
+    // The handle doesn't own the fence; the caller has to dup it during the callback.
+    if (releaseFenceFd >= 0) {
+        close(releaseFenceFd);
+    }
     return Void();
 }
 
@@ -360,11 +394,19 @@ Return<void> CrosGralloc4Mapper::flushLockedBuffer(void* rawHandle, flushLockedB
     ret = convertToFenceHandle(releaseFenceFd, &releaseFenceHandle);
     if (ret) {
         drv_log("Failed to flushLockedBuffer. Failed to convert release fence to handle.\n");
+        if (releaseFenceFd >= 0) {
+            close(releaseFenceFd);
+        }
         hidlCb(Error::BAD_BUFFER, nullptr);
         return Void();
     }
 
     hidlCb(Error::NONE, releaseFenceHandle);
+
+    // The handle doesn't own the fence; the caller has to dup it during the callback.
+    if (releaseFenceFd >= 0) {
+        close(releaseFenceFd);
+    }
     return Void();
 }
 
@@ -435,6 +477,24 @@ Return<void> CrosGralloc4Mapper::get(void* rawHandle, const MetadataType& metada
     return Void();
 }
 
+void CrosGralloc4Mapper::cacheMetadata(cros_gralloc_handle_t crosHandle) {
+    if (!crosHandle) {
+        return;
+    }
+
+    auto encoded = std::make_shared<EncodedMetadata>();
+    for (size_t i = 0; i < ARRAY_SIZE(kCachedMetadataTypes); i++) {
+        /* Types that fail to encode are left to get(), which reports the failure. */
+        if (encodeMetadata(crosHandle, *kCachedMetadataTypes[i], &encoded->blobs[i]) !=
+            Error::NONE) {
+            return;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mMetadataCacheMutex);
+    mMetadataCache[crosHandle] = std::move(encoded);
+}
+
 Return<void> CrosGralloc4Mapper::get(cros_gralloc_handle_t crosHandle,
                                      const MetadataType& metadataType, get_cb hidlCb) {
     hidl_vec<uint8_t> encodedMetadata;
@@ -451,6 +511,37 @@ Return<void> CrosGralloc4Mapper::get(cros_gralloc_handle_t crosHandle,
         return Void();
     }
 
+    for (size_t i = 0; i < ARRAY_SIZE(kCachedMetadataTypes); i++) {
+        if (metadataType != *kCachedMetadataTypes[i]) {
+            continue;
+        }
+
+        std::shared_ptr<const EncodedMetadata> encoded;
+        {
+            std::lock_guard<std::mutex> lock(mMetadataCacheMutex);
+            auto it = mMetadataCache.find(crosHandle);
+            if (it != mMetadataCache.end()) {
+                encoded = it->second;
+            }
+        }
+
+        if (encoded) {
+            hidlCb(Error::NONE, encoded->blobs[i]);
+            return Void();
+        }
+        break;
+    }
+
+    Error error = encodeMetadata(crosHandle, metadataType, &encodedMetadata);
+    hidlCb(error, encodedMetadata);
+    return Void();
+}
+
+Error CrosGralloc4Mapper::encodeMetadata(cros_gralloc_handle_t crosHandle,
+                                         const MetadataType& metadataType,
+                                         hidl_vec<uint8_t>* outEncodedMetadata) {
+    hidl_vec<uint8_t>& encodedMetadata = *outEncodedMetadata;
+
     android::status_t status = android::NO_ERROR;
     if (metadataType == android::gralloc4::MetadataType_BufferId) {
         status = android::gralloc4::encodeBufferId(crosHandle->id, &encodedMetadata);
@@ -525,18 +616,15 @@ Return<void> CrosGralloc4Mapper::get(cros_gralloc_handle_t crosHandle,
     } else if (metadataType == android::gralloc4::MetadataType_Smpte2094_40) {
         status = android::gralloc4::encodeSmpte2094_40(std::nullopt, &encodedMetadata);
     } else {
-        hidlCb(Error::UNSUPPORTED, encodedMetadata);
-        return Void();
+        return Error::UNSUPPORTED;
     }
 
     if (status != android::NO_ERROR) {
-        hidlCb(Error::NO_RESOURCES, encodedMetadata);
         drv_log("Failed to get. Failed to encode metadata.\n");
-        return Void();
+        return Error::NO_RESOURCES;
     }
 
-    hidlCb(Error::NONE, encodedMetadata);
-    return Void();
+    return Error::NONE;
 }
 
 Return<Error> CrosGralloc4Mapper::set(void* rawHandle, const MetadataType& metadataType,
@@ -6,6 +6,10 @@
 
 #include <android/hardware/graphics/mapper/4.0/IMapper.h>
 
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
 #include "cros_gralloc/cros_gralloc_driver.h"
 #include "cros_gralloc/cros_gralloc_handle.h"
 
@@ -68,6 +72,13 @@ class CrosGralloc4Mapper : public android::hardware::graphics::mapper::V4_0::IMa
     android::hardware::Return<void> get(cros_gralloc_handle_t crosHandle,
                                         const MetadataType& metadataType, get_cb hidlCb);
 
+    android::hardware::graphics::mapper::V4_0::Error encodeMetadata(
+            cros_gralloc_handle_t crosHandle, const MetadataType& metadataType,
+            android::hardware::hidl_vec<uint8_t>* outEncodedMetadata);
+
+    /* Encodes the metadata that get() serves from mMetadataCache for an imported handle. */
+    void cacheMetadata(cros_gralloc_handle_t crosHandle);
+
     android::hardware::Return<void> dumpBuffer(cros_gralloc_handle_t crosHandle,
                                                dumpBuffer_cb hidlCb);
 
@@ -75,6 +86,12 @@ class CrosGralloc4Mapper : public android::hardware::graphics::mapper::V4_0::IMa
                              uint64_t bufferUsage, uint32_t* outDrmFormat);
 
     std::unique_ptr<cros_gralloc_driver> mDriver;
+
+    struct EncodedMetadata;
+    /* Pre-encoded immutable metadata of imported handles, dropped when they are freed. */
+    std::mutex mMetadataCacheMutex;
+    std::unordered_map<cros_gralloc_handle_t, std::shared_ptr<const EncodedMetadata>>
+            mMetadataCache;
 };
 
 extern "C" android::hardware::graphics::mapper::V4_0::IMapper* HIDL_FETCH_IMapper(const char* name);
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Measures IMapper::get() calls per second for the metadata types SurfaceFlinger and HWC query
+ * every frame. "cached" queries an imported buffer, which get() serves from the blobs encoded at
+ * import. "encoded" queries a handle the mapper never imported, which takes the encoder path that
+ * every get() took before the cache.
+ */
+
+#include <benchmark/benchmark.h>
+#include <gralloctypes/Gralloc4.h>
+
+#include <string>
+
+#include "cros_gralloc/gralloc4/CrosGralloc4TestBuffer.h"
+
+using android::sp;
+using android::hardware::hidl_vec;
+using android::hardware::graphics::allocator::V4_0::IAllocator;
+using android::hardware::graphics::common::V1_2::PixelFormat;
+using android::hardware::graphics::mapper::V4_0::Error;
+using android::hardware::graphics::mapper::V4_0::IMapper;
+
+static const IMapper::MetadataType* const kMetadataTypes[] = {
+        &android::gralloc4::MetadataType_PlaneLayouts,
+        &android::gralloc4::MetadataType_Crop,
+        &android::gralloc4::MetadataType_Dataspace,
+        &android::gralloc4::MetadataType_PixelFormatFourCC,
+};
+
+static void BM_Get(benchmark::State& state, bool cached) {
+    sp<IAllocator> allocator = IAllocator::getService();
+    sp<IMapper> mapper = IMapper::getService();
+    if (!allocator || !mapper) {
+        state.SkipWithError("gralloc4 services are unavailable");
+        return;
+    }
+
+    /* YV12 has three planes, so PlaneLayouts is as costly to encode as it gets. */
+    CrosGralloc4TestBuffer buffer(allocator, mapper, PixelFormat::YV12, 1920, 1080);
+    if (!buffer.valid()) {
+        state.SkipWithError("failed to allocate and import a buffer");
+        return;
+    }
+
+    const IMapper::MetadataType& metadataType = *kMetadataTypes[state.range(0)];
+    void* handle = cached ? buffer.imported() : buffer.raw();
+    for (auto _ : state) {
+        mapper->get(handle, metadataType, [&](Error error, const hidl_vec<uint8_t>& metadata) {
+            if (error != Error::NONE) {
+                state.SkipWithError("get failed");
+            }
+            benchmark::DoNotOptimize(metadata.data());
+        });
+    }
+
+    state.SetLabel("standard metadata type " + std::to_string(metadataType.value));
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_CAPTURE(BM_Get, encoded, false)->DenseRange(0, 3);
+BENCHMARK_CAPTURE(BM_Get, cached, true)->DenseRange(0, 3);
+
+BENCHMARK_MAIN();
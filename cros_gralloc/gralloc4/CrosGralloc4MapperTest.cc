@@ -0,0 +1,69 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <gralloctypes/Gralloc4.h>
+#include <gtest/gtest.h>
+
+#include "cros_gralloc/gralloc4/CrosGralloc4TestBuffer.h"
+
+using android::sp;
+using android::hardware::hidl_vec;
+using android::hardware::graphics::allocator::V4_0::IAllocator;
+using android::hardware::graphics::common::V1_2::PixelFormat;
+using android::hardware::graphics::mapper::V4_0::Error;
+using android::hardware::graphics::mapper::V4_0::IMapper;
+
+class CrosGralloc4MapperTest : public ::testing::TestWithParam<PixelFormat> {
+  protected:
+    void SetUp() override {
+        mAllocator = IAllocator::getService();
+        mMapper = IMapper::getService();
+        ASSERT_NE(mAllocator, nullptr);
+        ASSERT_NE(mMapper, nullptr);
+    }
+
+    Error get(void* buffer, const IMapper::MetadataType& metadataType,
+              hidl_vec<uint8_t>* outEncodedMetadata) {
+        Error result = Error::UNSUPPORTED;
+        mMapper->get(buffer, metadataType, [&](Error error, const hidl_vec<uint8_t>& metadata) {
+            result = error;
+            *outEncodedMetadata = metadata;
+        });
+        return result;
+    }
+
+    sp<IAllocator> mAllocator;
+    sp<IMapper> mMapper;
+};
+
+/* The blobs importBuffer() caches must be byte for byte what the encoder produces. */
+TEST_P(CrosGralloc4MapperTest, CachedMetadataMatchesEncoder) {
+    static const IMapper::MetadataType* const kMetadataTypes[] = {
+            &android::gralloc4::MetadataType_PlaneLayouts,
+            &android::gralloc4::MetadataType_Crop,
+            &android::gralloc4::MetadataType_Dataspace,
+            &android::gralloc4::MetadataType_PixelFormatFourCC,
+    };
+
+    /* Not a multiple of any stride alignment, so strides and plane sizes carry padding. */
+    CrosGralloc4TestBuffer buffer(mAllocator, mMapper, GetParam(), 318, 130);
+    ASSERT_TRUE(buffer.valid());
+
+    for (const IMapper::MetadataType* metadataType : kMetadataTypes) {
+        SCOPED_TRACE(::testing::Message() << "standard metadata type " << metadataType->value);
+
+        hidl_vec<uint8_t> cached;
+        hidl_vec<uint8_t> encoded;
+        ASSERT_EQ(get(buffer.imported(), *metadataType, &cached), Error::NONE);
+        ASSERT_EQ(get(buffer.raw(), *metadataType, &encoded), Error::NONE);
+        ASSERT_GT(cached.size(), 0u);
+        EXPECT_EQ(cached, encoded);
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(Formats, CrosGralloc4MapperTest,
+                         ::testing::Values(PixelFormat::RGBA_8888, PixelFormat::RGB_565,
+                                           PixelFormat::YCBCR_420_888, PixelFormat::YV12));
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <android/hardware/graphics/allocator/4.0/IAllocator.h>
+#include <android/hardware/graphics/mapper/4.0/IMapper.h>
+#include <cutils/native_handle.h>
+
+/*
+ * A buffer allocated through the gralloc4 allocator service for the mapper test and benchmark.
+ * |imported| comes from IMapper::importBuffer(), so get() serves it from the mapper's metadata
+ * cache. |raw| is a plain copy of the allocated handle that the mapper has never imported, so
+ * get() encodes its metadata on every call, as it did before the cache.
+ */
+class CrosGralloc4TestBuffer {
+  public:
+    CrosGralloc4TestBuffer(
+            const android::sp<android::hardware::graphics::allocator::V4_0::IAllocator>& allocator,
+            const android::sp<android::hardware::graphics::mapper::V4_0::IMapper>& mapper,
+            android::hardware::graphics::common::V1_2::PixelFormat format, uint32_t width,
+            uint32_t height)
+        : mMapper(mapper) {
+        using android::hardware::hidl_handle;
+        using android::hardware::hidl_vec;
+        using android::hardware::graphics::common::V1_2::BufferUsage;
+        using android::hardware::graphics::mapper::V4_0::Error;
+        using android::hardware::graphics::mapper::V4_0::IMapper;
+
+        IMapper::BufferDescriptorInfo info;
+        info.name = "CrosGralloc4TestBuffer";
+        info.width = width;
+        info.height = height;
+        info.layerCount = 1;
+        info.format = format;
+        info.usage = static_cast<uint64_t>(BufferUsage::CPU_READ_OFTEN |
+                                           BufferUsage::CPU_WRITE_OFTEN |
+                                           BufferUsage::GPU_TEXTURE);
+
+        hidl_vec<uint8_t> descriptor;
+        mapper->createDescriptor(info, [&](Error error, const hidl_vec<uint8_t>& d) {
+            if (error == Error::NONE) {
+                descriptor = d;
+            }
+        });
+        if (descriptor.size() == 0) {
+            return;
+        }
+
+        allocator->allocate(descriptor, 1,
+                            [&](Error error, uint32_t, const hidl_vec<hidl_handle>& buffers) {
+                                if (error == Error::NONE && buffers.size() == 1) {
+                                    mRaw = native_handle_clone(buffers[0].getNativeHandle());
+                                }
+                            });
+        if (!mRaw) {
+            return;
+        }
+
+        mapper->importBuffer(mRaw, [&](Error error, void* buffer) {
+            if (error == Error::NONE) {
+                mImported = buffer;
+            }
+        });
+    }
+
+    ~CrosGralloc4TestBuffer() {
+        if (mImported) {
+            mMapper->freeBuffer(mImported);
+        }
+        if (mRaw) {
+            native_handle_close(mRaw);
+            native_handle_delete(mRaw);
+        }
+    }
+
+    CrosGralloc4TestBuffer(const CrosGralloc4TestBuffer&) = delete;
+    CrosGralloc4TestBuffer& operator=(const CrosGralloc4TestBuffer&) = delete;
+
+    bool valid() const { return mRaw && mImported; }
+    void* imported() const { return mImported; }
+    void* raw() const { return mRaw; }
+
+  private:
+    android::sp<android::hardware::graphics::mapper::V4_0::IMapper> mMapper;
+    native_handle_t* mRaw = nullptr;
+    void* mImported = nullptr;
+};
@@ -12,7 +12,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 
@@ -149,6 +151,1179 @@ static const struct backend *drv_get_backend(int fd)
 	return NULL;
 }
 
+/*
+ * Bounded LRU cache of layouts computed by backend->bo_compute_metadata(), keyed by the full
+ * allocation request. Requests with more modifiers than fit in the key bypass the cache.
+ */
+#define LAYOUT_CACHE_ENTRIES 64
+#define LAYOUT_CACHE_MAX_MODIFIERS 8
+
+struct layout_key {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint32_t count;
+	uint64_t use_flags;
+	uint64_t modifiers[LAYOUT_CACHE_MAX_MODIFIERS];
+};
+
+struct layout_entry {
+	struct layout_key key;
+	struct bo_metadata meta;
+	struct layout_entry *prev;
+	struct layout_entry *next;
+};
+
+struct layout_cache {
+	pthread_mutex_t lock;
+	struct drv_array *entries;
+	struct drv_hash *index;
+	/* Most recently used first. */
+	struct layout_entry *head;
+	struct layout_entry *tail;
+	uint64_t hits;
+	uint64_t misses;
+};
+
+static struct layout_cache *drv_layout_cache_create(void)
+{
+	struct layout_cache *cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	if (pthread_mutex_init(&cache->lock, NULL))
+		goto free_cache;
+
+	cache->entries = drv_array_init(sizeof(struct layout_entry));
+	if (!cache->entries)
+		goto free_lock;
+
+	cache->index = drv_hash_init(sizeof(struct layout_key));
+	if (!cache->index)
+		goto free_entries;
+
+	return cache;
+
+free_entries:
+	drv_array_destroy(cache->entries);
+free_lock:
+	pthread_mutex_destroy(&cache->lock);
+free_cache:
+	free(cache);
+	return NULL;
+}
+
+static void drv_layout_cache_destroy(struct layout_cache *cache)
+{
+	drv_hash_destroy(cache->index);
+	drv_array_destroy(cache->entries);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+static void drv_layout_cache_unlink(struct layout_cache *cache, struct layout_entry *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		cache->head = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		cache->tail = entry->prev;
+
+	entry->prev = entry->next = NULL;
+}
+
+static void drv_layout_cache_push(struct layout_cache *cache, struct layout_entry *entry)
+{
+	entry->prev = NULL;
+	entry->next = cache->head;
+	if (cache->head)
+		cache->head->prev = entry;
+	else
+		cache->tail = entry;
+	cache->head = entry;
+}
+
+static int drv_bo_compute_metadata(struct bo *bo, uint32_t width, uint32_t height,
+				   uint32_t format, uint64_t use_flags, const uint64_t *modifiers,
+				   uint32_t count)
+{
+	int ret;
+	void *value;
+	struct layout_key key;
+	struct layout_entry *entry;
+	struct layout_cache *cache = bo->drv->layout_cache;
+
+	if (count > LAYOUT_CACHE_MAX_MODIFIERS)
+		return bo->drv->backend->bo_compute_metadata(bo, width, height, format, use_flags,
+							     modifiers, count);
+
+	memset(&key, 0, sizeof(key));
+	key.width = width;
+	key.height = height;
+	key.format = format;
+	key.use_flags = use_flags;
+	if (modifiers) {
+		key.count = count;
+		memcpy(key.modifiers, modifiers, count * sizeof(*modifiers));
+	} else {
+		/* A NULL list and an empty list are passed to the backend differently. */
+		key.count = UINT32_MAX;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	if (!drv_hash_lookup(cache->index, &key, &value)) {
+		entry = (struct layout_entry *)value;
+		drv_layout_cache_unlink(cache, entry);
+		drv_layout_cache_push(cache, entry);
+		bo->meta = entry->meta;
+		cache->hits++;
+		pthread_mutex_unlock(&cache->lock);
+		return 0;
+	}
+
+	cache->misses++;
+	pthread_mutex_unlock(&cache->lock);
+
+	ret = bo->drv->backend->bo_compute_metadata(bo, width, height, format, use_flags,
+						    modifiers, count);
+	if (ret)
+		return ret;
+
+	pthread_mutex_lock(&cache->lock);
+	if (drv_hash_lookup(cache->index, &key, &value)) {
+		if (drv_array_size(cache->entries) < LAYOUT_CACHE_ENTRIES) {
+			struct layout_entry new_entry;
+			memset(&new_entry, 0, sizeof(new_entry));
+			entry = drv_array_append(cache->entries, &new_entry);
+		} else {
+			/* Recycle the least recently used entry. */
+			entry = cache->tail;
+			drv_layout_cache_unlink(cache, entry);
+			drv_hash_remove(cache->index, &entry->key);
+		}
+
+		if (entry) {
+			entry->key = key;
+			entry->meta = bo->meta;
+			if (drv_hash_insert(cache->index, &key, entry))
+				drv_array_remove_item(cache->entries, entry);
+			else
+				drv_layout_cache_push(cache, entry);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+}
+
+void drv_get_layout_cache_stats(struct driver *drv, uint64_t *hits, uint64_t *misses)
+{
+	pthread_mutex_lock(&drv->layout_cache->lock);
+	*hits = drv->layout_cache->hits;
+	*misses = drv->layout_cache->misses;
+	pthread_mutex_unlock(&drv->layout_cache->lock);
+}
+
+/*
+ * Opt-in pool of destroyed buffers whose backing objects can be handed out again. Only buffers
+ * that never left this process qualify: once a buffer is exported or imported, another client
+ * may still hold the object. Pooled objects are marked purgeable, so the kernel may reclaim
+ * their pages under memory pressure, in which case they are dropped when taken.
+ *
+ * For backends that create objects from precomputed metadata the kernel object is described by
+ * its size, tiling mode and tiling stride. Backends may also place buffers in different memory
+ * domains depending on the format and use flags, so those are part of the bucket key too.
+ */
+struct bo_pool_key {
+	uint64_t total_size;
+	uint64_t use_flags;
+	uint32_t format;
+	uint32_t tiling;
+	uint32_t stride;
+};
+
+struct bo_pool_entry {
+	struct bo *bo;
+	struct bo_pool_key key;
+	uint64_t release_time_ns;
+	/* Most recently released first, per bucket and across the pool. */
+	struct bo_pool_entry *bucket_prev;
+	struct bo_pool_entry *bucket_next;
+	struct bo_pool_entry *prev;
+	struct bo_pool_entry *next;
+};
+
+struct bo_pool {
+	pthread_mutex_t lock;
+	struct drv_array *entries;
+	struct drv_hash *buckets;
+	struct bo_pool_entry *head;
+	struct bo_pool_entry *tail;
+	uint64_t size;
+	uint64_t budget;
+	uint64_t max_idle_ns;
+};
+
+#define BO_POOL_EXCLUDED_USE_FLAGS (BO_USE_SCANOUT | BO_USE_CURSOR | BO_USE_PROTECTED)
+
+static uint64_t drv_monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct bo_pool *drv_bo_pool_create(void)
+{
+	struct bo_pool *pool;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	if (pthread_mutex_init(&pool->lock, NULL))
+		goto free_pool;
+
+	pool->entries = drv_array_init(sizeof(struct bo_pool_entry));
+	if (!pool->entries)
+		goto free_lock;
+
+	pool->buckets = drv_hash_init(sizeof(struct bo_pool_key));
+	if (!pool->buckets)
+		goto free_entries;
+
+	return pool;
+
+free_entries:
+	drv_array_destroy(pool->entries);
+free_lock:
+	pthread_mutex_destroy(&pool->lock);
+free_pool:
+	free(pool);
+	return NULL;
+}
+
+static void drv_bo_pool_destroy(struct bo_pool *pool)
+{
+	assert(!pool->head);
+	drv_hash_destroy(pool->buckets);
+	drv_array_destroy(pool->entries);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+static void drv_bo_pool_key(struct bo *bo, struct bo_pool_key *key)
+{
+	memset(key, 0, sizeof(*key));
+	key->total_size = bo->meta.total_size;
+	key->use_flags = bo->meta.use_flags;
+	key->format = bo->meta.format;
+	key->tiling = bo->meta.tiling;
+	key->stride = bo->meta.strides[0];
+}
+
+/* Unlinks the entry and returns its buffer. Must be called with the pool lock held. */
+static struct bo *drv_bo_pool_remove(struct bo_pool *pool, struct bo_pool_entry *entry)
+{
+	struct bo *bo = entry->bo;
+
+	if (entry->bucket_next)
+		entry->bucket_next->bucket_prev = entry->bucket_prev;
+
+	if (entry->bucket_prev)
+		entry->bucket_prev->bucket_next = entry->bucket_next;
+	else if (entry->bucket_next)
+		drv_hash_insert(pool->buckets, &entry->key, entry->bucket_next);
+	else
+		drv_hash_remove(pool->buckets, &entry->key);
+
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		pool->head = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		pool->tail = entry->prev;
+
+	pool->size -= bo->meta.total_size;
+	drv_array_remove_item(pool->entries, entry);
+	return bo;
+}
+
+/*
+ * Moves buffers that are over budget or have been idle for at least max_idle_ns onto the evicted
+ * list, oldest first. Must be called with the pool lock held.
+ */
+static void drv_bo_pool_evict(struct bo_pool *pool, uint64_t max_idle_ns, struct bo **evicted,
+			      uint32_t *num_evicted, uint32_t max_evicted)
+{
+	uint64_t now = drv_monotonic_ns();
+
+	while (pool->tail && *num_evicted < max_evicted) {
+		if (pool->size <= pool->budget && now - pool->tail->release_time_ns < max_idle_ns)
+			break;
+
+		evicted[(*num_evicted)++] = drv_bo_pool_remove(pool, pool->tail);
+	}
+}
+
+static void drv_bo_pool_release(struct driver *drv, struct bo **bos, uint32_t num_bos)
+{
+	uint32_t i;
+
+	for (i = 0; i < num_bos; i++) {
+		drv->backend->bo_destroy(bos[i]);
+		free(bos[i]);
+	}
+}
+
+/* Releases pooled buffers until the pool is within budget and none is older than max_idle_ns. */
+static void drv_bo_pool_trim_ns(struct driver *drv, uint64_t max_idle_ns)
+{
+	struct bo_pool *pool = drv->bo_pool;
+	struct bo *evicted[16];
+	uint32_t num_evicted;
+
+	do {
+		num_evicted = 0;
+		pthread_mutex_lock(&pool->lock);
+		drv_bo_pool_evict(pool, max_idle_ns, evicted, &num_evicted, ARRAY_SIZE(evicted));
+		pthread_mutex_unlock(&pool->lock);
+
+		drv_bo_pool_release(drv, evicted, num_evicted);
+	} while (num_evicted == ARRAY_SIZE(evicted));
+}
+
+/*
+ * Returns the monotonic time at which the oldest pooled buffer has been idle for the configured
+ * *max_idle_ns, or 0 if the pool is empty.
+ */
+static uint64_t drv_bo_pool_next_trim_ns(struct bo_pool *pool, uint64_t *max_idle_ns)
+{
+	uint64_t trim_ns = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	*max_idle_ns = pool->max_idle_ns;
+	if (pool->tail)
+		trim_ns = pool->tail->release_time_ns + pool->max_idle_ns;
+	pthread_mutex_unlock(&pool->lock);
+
+	return trim_ns;
+}
+
+static void drv_bo_reaper_wake(struct bo_reaper *reaper);
+
+/* Hands the buffer to the pool. Returns false if the caller should destroy it instead. */
+static bool drv_bo_pool_put(struct bo *bo)
+{
+	struct driver *drv = bo->drv;
+	struct bo_pool *pool = drv->bo_pool;
+	struct bo_pool_entry new_entry, *entry;
+	uint64_t max_idle_ns;
+	bool was_empty;
+	void *value;
+
+	if (!drv->backend->bo_create_from_metadata || bo->is_exported || bo->priv ||
+	    (bo->meta.use_flags & BO_POOL_EXCLUDED_USE_FLAGS) || drv_num_buffers_per_bo(bo) != 1)
+		return false;
+
+	pthread_mutex_lock(&pool->lock);
+	if (bo->meta.total_size > pool->budget) {
+		pthread_mutex_unlock(&pool->lock);
+		return false;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (drv->backend->bo_set_purgeable && drv->backend->bo_set_purgeable(bo, true) < 0)
+		return false;
+
+	memset(&new_entry, 0, sizeof(new_entry));
+	new_entry.bo = bo;
+	new_entry.release_time_ns = drv_monotonic_ns();
+	drv_bo_pool_key(bo, &new_entry.key);
+
+	pthread_mutex_lock(&pool->lock);
+	entry = drv_array_append(pool->entries, &new_entry);
+	if (!entry)
+		goto fail;
+
+	/* The bucket is keyed to its most recently released entry. */
+	if (!drv_hash_lookup(pool->buckets, &entry->key, &value)) {
+		entry->bucket_next = (struct bo_pool_entry *)value;
+		entry->bucket_next->bucket_prev = entry;
+	}
+
+	if (drv_hash_insert(pool->buckets, &entry->key, entry)) {
+		if (entry->bucket_next)
+			entry->bucket_next->bucket_prev = NULL;
+		drv_array_remove_item(pool->entries, entry);
+		goto fail;
+	}
+
+	was_empty = !pool->head;
+	entry->next = pool->head;
+	if (pool->head)
+		pool->head->prev = entry;
+	else
+		pool->tail = entry;
+	pool->head = entry;
+	pool->size += bo->meta.total_size;
+	max_idle_ns = pool->max_idle_ns;
+	pthread_mutex_unlock(&pool->lock);
+
+	drv_bo_pool_trim_ns(drv, max_idle_ns);
+
+	/* An idle reaper has no trim deadline while the pool is empty. */
+	if (was_empty)
+		drv_bo_reaper_wake(drv->reaper);
+
+	return true;
+
+fail:
+	pthread_mutex_unlock(&pool->lock);
+	if (drv->backend->bo_set_purgeable)
+		drv->backend->bo_set_purgeable(bo, false);
+	return false;
+}
+
+/*
+ * Gives the buffer, whose metadata must already be computed, the backing object of a pooled
+ * buffer with the same layout. Returns false if there is none.
+ */
+static bool drv_bo_pool_take(struct bo *bo)
+{
+	struct driver *drv = bo->drv;
+	struct bo_pool *pool = drv->bo_pool;
+	struct bo_pool_key key;
+	struct bo *pooled = NULL;
+	size_t plane;
+	void *value;
+	int ret;
+
+	drv_bo_pool_key(bo, &key);
+
+	while (true) {
+		pthread_mutex_lock(&pool->lock);
+		if (!pool->head || drv_hash_lookup(pool->buckets, &key, &value)) {
+			pthread_mutex_unlock(&pool->lock);
+			return false;
+		}
+
+		pooled = drv_bo_pool_remove(pool, (struct bo_pool_entry *)value);
+		pthread_mutex_unlock(&pool->lock);
+
+		if (!drv->backend->bo_set_purgeable)
+			break;
+
+		/* The kernel may have reclaimed the pages while the buffer sat in the pool. */
+		ret = drv->backend->bo_set_purgeable(pooled, false);
+		if (ret > 0)
+			break;
+
+		drv_bo_pool_release(drv, &pooled, 1);
+	}
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++)
+		bo->handles[plane] = pooled->handles[0];
+
+	free(pooled);
+	return true;
+}
+
+void drv_bo_pool_configure(struct driver *drv, uint64_t budget, uint32_t max_idle_ms)
+{
+	pthread_mutex_lock(&drv->bo_pool->lock);
+	drv->bo_pool->budget = budget;
+	drv->bo_pool->max_idle_ns = (uint64_t)max_idle_ms * 1000000ull;
+	pthread_mutex_unlock(&drv->bo_pool->lock);
+
+	drv_bo_pool_trim(drv, max_idle_ms);
+}
+
+void drv_bo_pool_trim(struct driver *drv, uint32_t max_idle_ms)
+{
+	drv_bo_pool_trim_ns(drv, (uint64_t)max_idle_ms * 1000000ull);
+}
+
+/*
+ * Opt-in deferred destruction. Buffers handed to drv_bo_destroy() are queued and torn down by a
+ * background thread, so callers don't pay for munmap and GEM_CLOSE. The whole destroy is
+ * deferred, reference counting included, so a handle that is re-imported while its old buffer is
+ * still queued keeps a reference and isn't closed underneath the new buffer. When the queue is
+ * full, buffers are destroyed synchronously.
+ *
+ * While it is running, the thread also releases pooled buffers once they have been idle for the
+ * configured time, so an idle process doesn't keep them until its next release.
+ */
+struct bo_reaper {
+	struct driver *drv;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t idle;
+	pthread_t thread;
+	bool running;
+	bool stop;
+	struct bo **queue;
+	uint32_t capacity;
+	uint32_t head;
+	uint32_t count;
+	uint32_t in_flight;
+};
+
+static void drv_bo_destroy_now(struct bo *bo);
+
+static struct bo_reaper *drv_bo_reaper_create(struct driver *drv)
+{
+	struct bo_reaper *reaper;
+	pthread_condattr_t attr;
+	int ret;
+
+	reaper = calloc(1, sizeof(*reaper));
+	if (!reaper)
+		return NULL;
+
+	reaper->drv = drv;
+	if (pthread_mutex_init(&reaper->lock, NULL))
+		goto free_reaper;
+
+	/* Pool trim deadlines are in CLOCK_MONOTONIC time. */
+	if (pthread_condattr_init(&attr))
+		goto free_lock;
+
+	ret = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) ||
+	      pthread_cond_init(&reaper->work, &attr);
+	pthread_condattr_destroy(&attr);
+	if (ret)
+		goto free_lock;
+
+	if (pthread_cond_init(&reaper->idle, NULL))
+		goto free_work;
+
+	return reaper;
+
+free_work:
+	pthread_cond_destroy(&reaper->work);
+free_lock:
+	pthread_mutex_destroy(&reaper->lock);
+free_reaper:
+	free(reaper);
+	return NULL;
+}
+
+static void drv_bo_reaper_destroy(struct bo_reaper *reaper)
+{
+	pthread_cond_destroy(&reaper->idle);
+	pthread_cond_destroy(&reaper->work);
+	pthread_mutex_destroy(&reaper->lock);
+	free(reaper);
+}
+
+static void *drv_bo_reaper_main(void *data)
+{
+	struct bo_reaper *reaper = data;
+	struct timespec deadline;
+	uint64_t trim_ns, max_idle_ns;
+	struct bo *bo;
+	int ret;
+
+	pthread_mutex_lock(&reaper->lock);
+	while (true) {
+		while (!reaper->count && !reaper->stop) {
+			trim_ns = drv_bo_pool_next_trim_ns(reaper->drv->bo_pool, &max_idle_ns);
+			if (!trim_ns) {
+				pthread_cond_wait(&reaper->work, &reaper->lock);
+				continue;
+			}
+
+			if (trim_ns > drv_monotonic_ns()) {
+				deadline.tv_sec = trim_ns / 1000000000ull;
+				deadline.tv_nsec = trim_ns % 1000000000ull;
+				ret = pthread_cond_timedwait(&reaper->work, &reaper->lock,
+							     &deadline);
+				if (ret != ETIMEDOUT)
+					continue;
+			}
+
+			pthread_mutex_unlock(&reaper->lock);
+			drv_bo_pool_trim_ns(reaper->drv, max_idle_ns);
+			pthread_mutex_lock(&reaper->lock);
+		}
+
+		/* Whatever is still queued when stopping is destroyed first. */
+		if (!reaper->count)
+			break;
+
+		bo = reaper->queue[reaper->head];
+		reaper->head = (reaper->head + 1) % reaper->capacity;
+		reaper->count--;
+		reaper->in_flight++;
+		pthread_mutex_unlock(&reaper->lock);
+
+		drv_bo_destroy_now(bo);
+
+		pthread_mutex_lock(&reaper->lock);
+		reaper->in_flight--;
+		if (!reaper->count && !reaper->in_flight)
+			pthread_cond_broadcast(&reaper->idle);
+	}
+	pthread_mutex_unlock(&reaper->lock);
+
+	return NULL;
+}
+
+/* Returns false if the buffer has to be destroyed by the caller. */
+static bool drv_bo_reaper_queue(struct bo *bo)
+{
+	struct bo_reaper *reaper = bo->drv->reaper;
+
+	pthread_mutex_lock(&reaper->lock);
+	if (!reaper->running || reaper->stop || reaper->count == reaper->capacity) {
+		pthread_mutex_unlock(&reaper->lock);
+		return false;
+	}
+
+	reaper->queue[(reaper->head + reaper->count) % reaper->capacity] = bo;
+	reaper->count++;
+	pthread_cond_signal(&reaper->work);
+	pthread_mutex_unlock(&reaper->lock);
+
+	return true;
+}
+
+static void drv_bo_reaper_wake(struct bo_reaper *reaper)
+{
+	pthread_mutex_lock(&reaper->lock);
+	pthread_cond_signal(&reaper->work);
+	pthread_mutex_unlock(&reaper->lock);
+}
+
+static void drv_bo_reaper_stop(struct bo_reaper *reaper)
+{
+	pthread_mutex_lock(&reaper->lock);
+	if (!reaper->running) {
+		pthread_mutex_unlock(&reaper->lock);
+		return;
+	}
+
+	reaper->stop = true;
+	pthread_cond_signal(&reaper->work);
+	pthread_mutex_unlock(&reaper->lock);
+
+	pthread_join(reaper->thread, NULL);
+
+	pthread_mutex_lock(&reaper->lock);
+	free(reaper->queue);
+	reaper->queue = NULL;
+	reaper->capacity = 0;
+	reaper->head = 0;
+	reaper->running = false;
+	reaper->stop = false;
+	pthread_cond_broadcast(&reaper->idle);
+	pthread_mutex_unlock(&reaper->lock);
+}
+
+int drv_bo_reaper_configure(struct driver *drv, uint32_t queue_size)
+{
+	struct bo_reaper *reaper = drv->reaper;
+	int ret;
+
+	drv_bo_reaper_stop(reaper);
+
+	if (!queue_size)
+		return 0;
+
+	pthread_mutex_lock(&reaper->lock);
+	reaper->queue = calloc(queue_size, sizeof(*reaper->queue));
+	if (!reaper->queue) {
+		pthread_mutex_unlock(&reaper->lock);
+		return -ENOMEM;
+	}
+
+	reaper->capacity = queue_size;
+	ret = pthread_create(&reaper->thread, NULL, drv_bo_reaper_main, reaper);
+	if (ret) {
+		free(reaper->queue);
+		reaper->queue = NULL;
+		reaper->capacity = 0;
+		pthread_mutex_unlock(&reaper->lock);
+		drv_log("Failed to start the buffer reaper: %s\n", strerror(ret));
+		return -ret;
+	}
+
+	reaper->running = true;
+	pthread_mutex_unlock(&reaper->lock);
+
+	return 0;
+}
+
+void drv_bo_reaper_flush(struct driver *drv)
+{
+	struct bo_reaper *reaper = drv->reaper;
+
+	pthread_mutex_lock(&reaper->lock);
+	while (reaper->count || reaper->in_flight)
+		pthread_cond_wait(&reaper->idle, &reaper->lock);
+	pthread_mutex_unlock(&reaper->lock);
+}
+
+/*
+ * Cache of completed imports keyed by the dma-buf they came from, so that re-importing a buffer
+ * this process already holds needs no ioctls. An entry lives exactly as long as its GEM handle is
+ * referenced. The handle keeps the dma-buf alive, so its inode can't be reused in the meantime.
+ *
+ * Kernels before 5.3 share one anonymous inode between all dma-bufs and report a size of 0, so
+ * only fds with a non-zero size are cached. The size is part of the key as an extra check.
+ */
+struct import_key {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+};
+
+struct import_entry {
+	struct import_key key;
+	/* The import request with fds cleared, which a hit has to match exactly. */
+	struct drv_import_fd_data data;
+	struct bo_metadata meta;
+	union bo_handle handles[DRV_MAX_PLANES];
+};
+
+struct import_cache {
+	pthread_mutex_t lock;
+	struct drv_array *entries;
+	struct drv_hash *index;
+	/* GEM handle to entry, for dropping the entry when the handle is closed. */
+	struct drv_hash *handles;
+};
+
+static struct import_cache *drv_import_cache_create(void)
+{
+	struct import_cache *cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	if (pthread_mutex_init(&cache->lock, NULL))
+		goto free_cache;
+
+	cache->entries = drv_array_init(sizeof(struct import_entry));
+	if (!cache->entries)
+		goto free_lock;
+
+	cache->index = drv_hash_init(sizeof(struct import_key));
+	if (!cache->index)
+		goto free_entries;
+
+	cache->handles = drv_hash_init(sizeof(uint32_t));
+	if (!cache->handles)
+		goto free_index;
+
+	return cache;
+
+free_index:
+	drv_hash_destroy(cache->index);
+free_entries:
+	drv_array_destroy(cache->entries);
+free_lock:
+	pthread_mutex_destroy(&cache->lock);
+free_cache:
+	free(cache);
+	return NULL;
+}
+
+static void drv_import_cache_destroy(struct import_cache *cache)
+{
+	drv_hash_destroy(cache->handles);
+	drv_hash_destroy(cache->index);
+	drv_array_destroy(cache->entries);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+static int drv_import_key_from_fd(int fd, struct import_key *key)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) || st.st_size <= 0)
+		return -1;
+
+	memset(key, 0, sizeof(*key));
+	key->dev = st.st_dev;
+	key->ino = st.st_ino;
+	key->size = st.st_size;
+	return 0;
+}
+
+/* Only imports whose planes all live in one dma-buf are cached. */
+static int drv_import_key(const struct drv_import_fd_data *data, size_t num_planes,
+			  struct import_key *key)
+{
+	struct import_key plane_key;
+	size_t plane;
+
+	if (drv_import_key_from_fd(data->fds[0], key))
+		return -1;
+
+	for (plane = 1; plane < num_planes; plane++) {
+		if (data->fds[plane] == data->fds[0])
+			continue;
+
+		if (drv_import_key_from_fd(data->fds[plane], &plane_key) ||
+		    memcmp(&plane_key, key, sizeof(*key)))
+			return -1;
+	}
+
+	return 0;
+}
+
+static void drv_import_data_normalize(const struct drv_import_fd_data *data,
+				      struct drv_import_fd_data *out)
+{
+	/* Clears the padding too, so that requests can be compared with memcmp. */
+	memset(out, 0, sizeof(*out));
+	memcpy(out->strides, data->strides, sizeof(out->strides));
+	memcpy(out->offsets, data->offsets, sizeof(out->offsets));
+	memcpy(out->format_modifiers, data->format_modifiers, sizeof(out->format_modifiers));
+	out->width = data->width;
+	out->height = data->height;
+	out->format = data->format;
+	out->use_flags = data->use_flags;
+}
+
+/* Completes the import from the cache. Returns false on a miss. */
+static bool drv_import_cache_take(struct bo *bo, const struct import_key *key,
+				  const struct drv_import_fd_data *data)
+{
+	struct driver *drv = bo->drv;
+	struct import_cache *cache = drv->import_cache;
+	struct import_entry *entry;
+	struct drv_import_fd_data normalized;
+	struct bo_metadata meta = bo->meta;
+	size_t plane;
+	void *value;
+
+	drv_import_data_normalize(data, &normalized);
+
+	pthread_mutex_lock(&cache->lock);
+	if (drv_hash_lookup(cache->index, key, &value))
+		goto miss;
+
+	entry = (struct import_entry *)value;
+	if (memcmp(&entry->data, &normalized, sizeof(normalized)))
+		goto miss;
+
+	bo->meta = entry->meta;
+	memcpy(bo->handles, entry->handles, sizeof(bo->handles));
+
+	/* The last reference may be going away concurrently, in which case import normally. */
+	if (!drv_increment_live_reference_count(drv, bo, 0)) {
+		bo->meta = meta;
+		memset(bo->handles, 0, sizeof(bo->handles));
+		goto miss;
+	}
+
+	for (plane = 1; plane < bo->meta.num_planes; plane++)
+		drv_increment_reference_count(drv, bo, plane);
+
+	pthread_mutex_unlock(&cache->lock);
+	return true;
+
+miss:
+	pthread_mutex_unlock(&cache->lock);
+	return false;
+}
+
+static void drv_import_cache_put(struct bo *bo, const struct import_key *key,
+				 const struct drv_import_fd_data *data)
+{
+	struct import_cache *cache = bo->drv->import_cache;
+	struct import_entry new_entry, *entry;
+	size_t plane;
+	void *value;
+
+	/* Backend state can't be shared between bos. */
+	if (bo->priv)
+		return;
+
+	for (plane = 1; plane < bo->meta.num_planes; plane++)
+		if (bo->handles[plane].u32 != bo->handles[0].u32)
+			return;
+
+	memset(&new_entry, 0, sizeof(new_entry));
+	new_entry.key = *key;
+	drv_import_data_normalize(data, &new_entry.data);
+	new_entry.meta = bo->meta;
+	memcpy(new_entry.handles, bo->handles, sizeof(new_entry.handles));
+
+	pthread_mutex_lock(&cache->lock);
+	if (!drv_hash_lookup(cache->index, key, &value)) {
+		/* Re-imported with a different layout; the latest one wins. */
+		entry = (struct import_entry *)value;
+		*entry = new_entry;
+	} else {
+		entry = drv_array_append(cache->entries, &new_entry);
+		if (!entry)
+			goto out;
+
+		if (drv_hash_insert(cache->index, key, entry)) {
+			drv_array_remove_item(cache->entries, entry);
+			goto out;
+		}
+	}
+
+	if (drv_hash_insert(cache->handles, &entry->handles[0].u32, entry)) {
+		drv_hash_remove(cache->index, key);
+		drv_array_remove_item(cache->entries, entry);
+	}
+
+out:
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Called once the last reference to the bo's handle is gone. */
+static void drv_import_cache_forget(struct bo *bo)
+{
+	struct import_cache *cache = bo->drv->import_cache;
+	struct import_entry *entry;
+	void *value;
+
+	pthread_mutex_lock(&cache->lock);
+	if (!drv_hash_lookup(cache->handles, &bo->handles[0].u32, &value)) {
+		entry = (struct import_entry *)value;
+		drv_hash_remove(cache->handles, &bo->handles[0].u32);
+		drv_hash_remove(cache->index, &entry->key);
+		drv_array_remove_item(cache->entries, entry);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Every GEM handle has a list of its VMAs, and every VMA a list of its mappings, so that mapping
+ * and destroying a buffer only ever look at that buffer's own mappings. The lists hang off the
+ * handle rather than the bo because several bos can share a handle, and whichever of them is
+ * destroyed last has to tear down the mappings made through any of them. Everything here is
+ * protected by drv->driver_lock.
+ */
+struct mapping_node {
+	/* First, so that the mapping handed out can be converted back. */
+	struct mapping mapping;
+	struct mapping_node *next;
+};
+
+struct vma_node {
+	/* First, so that the vma referenced by a mapping can be converted back. */
+	struct vma vma;
+	struct vma_node *next;
+	struct mapping_node *mappings;
+	/* Links in the idle VMA cache while the refcount is 0, most recently used first. */
+	struct vma_node *lru_prev;
+	struct vma_node *lru_next;
+};
+
+static struct vma_node *drv_vma_node(struct vma *vma)
+{
+	return (struct vma_node *)vma;
+}
+
+static struct vma_node *drv_vma_find(struct vma_node *list, uint32_t map_flags)
+{
+	while (list && list->vma.map_flags != map_flags)
+		list = list->next;
+
+	return list;
+}
+
+static void drv_vma_unlink(struct vma_node **list, struct vma_node *node)
+{
+	while (*list != node)
+		list = &(*list)->next;
+
+	*list = node->next;
+	node->next = NULL;
+}
+
+static struct mapping_node *drv_mapping_find(struct vma_node *node, const struct rectangle *rect)
+{
+	struct mapping_node *mapping = node->mappings;
+
+	while (mapping && memcmp(&mapping->mapping.rect, rect, sizeof(*rect)))
+		mapping = mapping->next;
+
+	return mapping;
+}
+
+static void drv_mapping_unlink(struct vma_node *node, struct mapping_node *mapping)
+{
+	struct mapping_node **link = &node->mappings;
+
+	while (*link != mapping)
+		link = &(*link)->next;
+
+	*link = mapping->next;
+	mapping->next = NULL;
+}
+
+/*
+ * Cache of CPU mappings whose last user is gone, so that buffers locked every frame don't pay for
+ * a fresh mmap and its page faults each time. An idle VMA stays on its handle's list with a
+ * refcount of 0 and is brought back by drv_bo_map().
+ *
+ * Only VMAs without backend private state are kept. Those are plain mmaps that can be torn down
+ * without the bo they came from, and they can't go stale the way a detiled shadow copy can.
+ */
+struct vma_cache {
+	struct vma_node *head;
+	struct vma_node *tail;
+	uint32_t count;
+	uint64_t bytes;
+	uint32_t max_count;
+	uint64_t max_bytes;
+	uint64_t hits;
+	uint64_t misses;
+};
+
+#define VMA_CACHE_USE_FLAGS (BO_USE_SW_READ_OFTEN | BO_USE_SW_WRITE_OFTEN)
+
+static void drv_vma_cache_unlink(struct vma_cache *cache, struct vma_node *node)
+{
+	if (node->lru_prev)
+		node->lru_prev->lru_next = node->lru_next;
+	else
+		cache->head = node->lru_next;
+
+	if (node->lru_next)
+		node->lru_next->lru_prev = node->lru_prev;
+	else
+		cache->tail = node->lru_prev;
+
+	node->lru_prev = node->lru_next = NULL;
+	cache->count--;
+	cache->bytes -= node->vma.length;
+}
+
+static void drv_vma_cache_push(struct vma_cache *cache, struct vma_node *node)
+{
+	node->lru_prev = NULL;
+	node->lru_next = cache->head;
+	if (cache->head)
+		cache->head->lru_prev = node;
+	else
+		cache->tail = node;
+	cache->head = node;
+	cache->count++;
+	cache->bytes += node->vma.length;
+}
+
+/* Drops least recently used VMAs until the cache fits into its budget. */
+static void drv_vma_cache_evict(struct driver *drv)
+{
+	struct vma_cache *cache = drv->vma_cache;
+	struct vma_node *node;
+
+	while (cache->tail && (cache->count > cache->max_count || cache->bytes > cache->max_bytes)) {
+		node = cache->tail;
+		drv_vma_cache_unlink(cache, node);
+		drv_vma_unlink(drv_get_vma_list(drv, node->vma.handle), node);
+
+		if (munmap(node->vma.addr, node->vma.length))
+			drv_log("munmap failed\n");
+
+		free(node);
+	}
+}
+
+/* Keeps a VMA whose refcount just dropped to 0 mapped. Returns false if it must be unmapped. */
+static bool drv_vma_cache_put(struct bo *bo, struct vma_node *node)
+{
+	struct vma_cache *cache = bo->drv->vma_cache;
+
+	if (!cache->max_count || node->vma.priv || node->vma.length > cache->max_bytes ||
+	    !(bo->meta.use_flags & VMA_CACHE_USE_FLAGS))
+		return false;
+
+	drv_vma_cache_push(cache, node);
+	drv_vma_cache_evict(bo->drv);
+	return true;
+}
+
+void drv_bo_map_cache_configure(struct driver *drv, uint32_t max_count, uint64_t max_bytes)
+{
+	pthread_mutex_lock(&drv->driver_lock);
+	drv->vma_cache->max_count = max_count;
+	drv->vma_cache->max_bytes = max_bytes;
+	drv_vma_cache_evict(drv);
+	pthread_mutex_unlock(&drv->driver_lock);
+}
+
+void drv_get_map_cache_stats(struct driver *drv, uint64_t *hits, uint64_t *misses)
+{
+	pthread_mutex_lock(&drv->driver_lock);
+	*hits = drv->vma_cache->hits;
+	*misses = drv->vma_cache->misses;
+	pthread_mutex_unlock(&drv->driver_lock);
+}
+
+void drv_get_transfer_stats(struct driver *drv, uint64_t *flushes, uint64_t *transfers,
+			    uint64_t *submissions)
+{
+	*flushes = 0;
+	*transfers = 0;
+	*submissions = 0;
+
+	if (drv->backend->get_transfer_stats)
+		drv->backend->get_transfer_stats(drv, flushes, transfers, submissions);
+}
+
+/*
+ * Called right before the buffer's handles are closed, with drv->driver_lock held. Frees every
+ * mapping of the buffer, including idle cached ones.
+ */
+static int drv_mapping_destroy(struct bo *bo)
+{
+	int ret = 0;
+	size_t plane;
+	struct vma_node **list, *node;
+	struct mapping_node *mapping;
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		list = drv_get_vma_list(bo->drv, bo->handles[plane].u32);
+		if (!list)
+			continue;
+
+		/* Planes sharing a handle find the list already empty. */
+		while ((node = *list)) {
+			*list = node->next;
+
+			if (!node->vma.refcount)
+				drv_vma_cache_unlink(bo->drv->vma_cache, node);
+
+			while ((mapping = node->mappings)) {
+				node->mappings = mapping->next;
+				drv_array_remove_item(bo->drv->mappings, mapping);
+			}
+
+			if (bo->drv->backend->bo_unmap(bo, &node->vma)) {
+				drv_log("munmap failed\n");
+				ret = -EINVAL;
+			}
+
+			free(node);
+		}
+	}
+
+	return ret;
+}
+
 struct driver *drv_create(int fd)
 {
 	struct driver *drv;
@@ -168,11 +1343,11 @@ struct driver *drv_create(int fd)
 	if (pthread_mutex_init(&drv->driver_lock, NULL))
 		goto free_driver;
 
-	drv->buffer_table = drmHashCreate();
+	drv->buffer_table = drv_handle_table_create();
 	if (!drv->buffer_table)
 		goto free_lock;
 
-	drv->mappings = drv_array_init(sizeof(struct mapping));
+	drv->mappings = drv_array_init(sizeof(struct mapping_node));
 	if (!drv->mappings)
 		goto free_buffer_table;
 
@@ -180,12 +1355,42 @@ struct driver *drv_create(int fd)
 	if (!drv->combos)
 		goto free_mappings;
 
+	drv->layout_cache = drv_layout_cache_create();
+	if (!drv->layout_cache)
+		goto free_combos;
+
+	drv->bo_pool = drv_bo_pool_create();
+	if (!drv->bo_pool)
+		goto free_layout_cache;
+
+	drv->reaper = drv_bo_reaper_create(drv);
+	if (!drv->reaper)
+		goto free_bo_pool;
+
+	drv->import_cache = drv_import_cache_create();
+	if (!drv->import_cache)
+		goto free_reaper;
+
+	drv->vma_cache = calloc(1, sizeof(*drv->vma_cache));
+	if (!drv->vma_cache)
+		goto free_import_cache;
+
 	return drv;
 
+free_import_cache:
+	drv_import_cache_destroy(drv->import_cache);
+free_reaper:
+	drv_bo_reaper_destroy(drv->reaper);
+free_bo_pool:
+	drv_bo_pool_destroy(drv->bo_pool);
+free_layout_cache:
+	drv_layout_cache_destroy(drv->layout_cache);
+free_combos:
+	drv_array_destroy(drv->combos);
 free_mappings:
 	drv_array_destroy(drv->mappings);
 free_buffer_table:
-	drmHashDestroy(drv->buffer_table);
+	drv_handle_table_destroy(drv->buffer_table);
 free_lock:
 	pthread_mutex_destroy(&drv->driver_lock);
 free_driver:
@@ -193,6 +1398,85 @@ free_driver:
 	return NULL;
 }
 
+/*
+ * Per-format list of indices into drv->combos, sorted by descending priority. Combinations of
+ * equal priority keep their registration order, matching the old linear scan.
+ */
+struct combination_bucket {
+	uint32_t num_combos;
+	uint32_t combos[];
+};
+
+static int drv_build_combination_index(struct driver *drv)
+{
+	uint32_t i, j, k, count, num_combos = drv_array_size(drv->combos);
+	struct combination *combo, *curr;
+	struct combination_bucket *bucket;
+	void *value;
+
+	drv->combo_index = drv_hash_init(sizeof(uint32_t));
+	if (!drv->combo_index)
+		return -ENOMEM;
+
+	for (i = 0; i < num_combos; i++) {
+		combo = drv_array_at_idx(drv->combos, i);
+		if (!drv_hash_lookup(drv->combo_index, &combo->format, &value))
+			continue;
+
+		count = 0;
+		for (j = i; j < num_combos; j++) {
+			curr = drv_array_at_idx(drv->combos, j);
+			count += (curr->format == combo->format);
+		}
+
+		bucket = calloc(1, sizeof(*bucket) + count * sizeof(bucket->combos[0]));
+		if (!bucket)
+			return -ENOMEM;
+
+		/* Insertion sort, so equal priorities stay in registration order. */
+		for (j = i; j < num_combos; j++) {
+			curr = drv_array_at_idx(drv->combos, j);
+			if (curr->format != combo->format)
+				continue;
+
+			for (k = bucket->num_combos; k > 0; k--) {
+				struct combination *prev =
+				    drv_array_at_idx(drv->combos, bucket->combos[k - 1]);
+				if (prev->metadata.priority >= curr->metadata.priority)
+					break;
+				bucket->combos[k] = bucket->combos[k - 1];
+			}
+
+			bucket->combos[k] = j;
+			bucket->num_combos++;
+		}
+
+		if (drv_hash_insert(drv->combo_index, &combo->format, bucket)) {
+			free(bucket);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static int drv_free_combination_bucket(const void *key, void *value, void *data)
+{
+	free(value);
+	return 0;
+}
+
+static void drv_destroy_combination_index(struct driver *drv)
+{
+	if (!drv->combo_index)
+		return;
+
+	drv_hash_for_each(drv->combo_index, drv_free_combination_bucket, NULL);
+	drv_hash_destroy(drv->combo_index);
+	drv->combo_index = NULL;
+	memset(drv->combo_cache, 0, sizeof(drv->combo_cache));
+}
+
 int drv_init(struct driver * drv, uint32_t grp_type)
 {
 	int ret = 0;
@@ -204,19 +1488,42 @@ int drv_init(struct driver * drv, uint32_t grp_type)
 	if (drv->backend->init) {
 		ret = drv->backend->init(drv);
 	}
+
+	/* The combinations are final once the backend is initialized. */
+	if (!ret) {
+		drv_destroy_combination_index(drv);
+		ret = drv_build_combination_index(drv);
+		if (ret)
+			drv_destroy_combination_index(drv);
+	}
+
 	return ret;
 }
 
 void drv_destroy(struct driver *drv)
 {
+	/* Queued buffers are destroyed first, which may still add to the pool. */
+	drv_bo_reaper_stop(drv->reaper);
+	drv_bo_pool_trim(drv, 0);
+
 	pthread_mutex_lock(&drv->driver_lock);
 
+	/* Only buffers that were never destroyed can still have idle VMAs. */
+	drv->vma_cache->max_count = 0;
+	drv_vma_cache_evict(drv);
+	free(drv->vma_cache);
+
 	if (drv->backend->close)
 		drv->backend->close(drv);
 
-	drmHashDestroy(drv->buffer_table);
+	drv_handle_table_destroy(drv->buffer_table);
 	drv_array_destroy(drv->mappings);
+	drv_destroy_combination_index(drv);
 	drv_array_destroy(drv->combos);
+	drv_layout_cache_destroy(drv->layout_cache);
+	drv_bo_pool_destroy(drv->bo_pool);
+	drv_bo_reaper_destroy(drv->reaper);
+	drv_import_cache_destroy(drv->import_cache);
 
 	pthread_mutex_unlock(&drv->driver_lock);
 	pthread_mutex_destroy(&drv->driver_lock);
@@ -234,22 +1541,74 @@ const char *drv_get_name(struct driver *drv)
 	return drv->backend->name;
 }
 
+/*
+ * A cache entry packs the format, the use flags and the index of the best combination plus one
+ * (zero if unsupported) into one word, so it can be read and written without a lock.
+ */
+#define COMBO_CACHE_FLAGS_BITS 20
+#define COMBO_CACHE_INDEX_BITS 12
+
+static uint64_t drv_combo_cache_tag(uint32_t format, uint64_t use_flags)
+{
+	return ((uint64_t)format << 32) | (use_flags << COMBO_CACHE_INDEX_BITS);
+}
+
+static uint32_t drv_combo_cache_slot(uint32_t format, uint64_t use_flags)
+{
+	uint64_t h = (format ^ (use_flags << 7)) * 0x9e3779b97f4a7c15ull;
+	return h >> (64 - 8);
+}
+
 struct combination *drv_get_combination(struct driver *drv, uint32_t format, uint64_t use_flags)
 {
 	struct combination *curr, *best;
+	struct combination_bucket *bucket;
+	uint64_t *entry, tag, cached;
+	uint32_t i, best_idx = 0;
+	void *value;
 
 	if (format == DRM_FORMAT_NONE || use_flags == BO_USE_NONE)
 		return 0;
 
 	best = NULL;
-	uint32_t i;
-	for (i = 0; i < drv_array_size(drv->combos); i++) {
-		curr = drv_array_at_idx(drv->combos, i);
-		if ((format == curr->format) && use_flags == (curr->use_flags & use_flags))
-			if (!best || best->metadata.priority < curr->metadata.priority)
+	if (!drv->combo_index) {
+		/* Only reached while the backend is still registering combinations. */
+		for (i = 0; i < drv_array_size(drv->combos); i++) {
+			curr = drv_array_at_idx(drv->combos, i);
+			if ((format == curr->format) && use_flags == (curr->use_flags & use_flags))
+				if (!best || best->metadata.priority < curr->metadata.priority)
+					best = curr;
+		}
+
+		return best;
+	}
+
+	entry = NULL;
+	tag = drv_combo_cache_tag(format, use_flags);
+	if (!(use_flags >> COMBO_CACHE_FLAGS_BITS)) {
+		entry = &drv->combo_cache[drv_combo_cache_slot(format, use_flags)];
+		cached = __atomic_load_n(entry, __ATOMIC_RELAXED);
+		if (cached && (cached & ~((1ull << COMBO_CACHE_INDEX_BITS) - 1)) == tag) {
+			best_idx = cached & ((1ull << COMBO_CACHE_INDEX_BITS) - 1);
+			return best_idx ? drv_array_at_idx(drv->combos, best_idx - 1) : NULL;
+		}
+	}
+
+	if (!drv_hash_lookup(drv->combo_index, &format, &value)) {
+		bucket = (struct combination_bucket *)value;
+		for (i = 0; i < bucket->num_combos; i++) {
+			curr = drv_array_at_idx(drv->combos, bucket->combos[i]);
+			if (!(use_flags & ~curr->use_flags)) {
 				best = curr;
+				best_idx = bucket->combos[i] + 1;
+				break;
+			}
+		}
 	}
 
+	if (entry && best_idx < (1u << COMBO_CACHE_INDEX_BITS))
+		__atomic_store_n(entry, tag | best_idx, __ATOMIC_RELAXED);
+
 	return best;
 }
 
@@ -257,6 +1616,7 @@ struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint3
 		      uint64_t use_flags, bool is_test_buffer)
 {
 
+	size_t plane;
 	struct bo *bo;
 	bo = (struct bo *)calloc(1, sizeof(*bo));
 
@@ -270,6 +1630,8 @@ struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint3
 	bo->meta.use_flags = use_flags;
 	bo->meta.num_planes = drv_num_planes_from_format(format);
 	bo->is_test_buffer = is_test_buffer;
+	for (plane = 0; plane < DRV_MAX_PLANES; plane++)
+		bo->export_fds[plane] = -1;
 
 	if (!bo->meta.num_planes) {
 		free(bo);
@@ -297,9 +1659,8 @@ struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, ui
 
 	ret = -EINVAL;
 	if (drv->backend->bo_compute_metadata) {
-		ret = drv->backend->bo_compute_metadata(bo, width, height, format, use_flags, NULL,
-							0);
-		if (!is_test_alloc && ret == 0)
+		ret = drv_bo_compute_metadata(bo, width, height, format, use_flags, NULL, 0);
+		if (!is_test_alloc && ret == 0 && !drv_bo_pool_take(bo))
 			ret = drv->backend->bo_create_from_metadata(bo);
 	} else if (!is_test_alloc) {
 		ret = drv->backend->bo_create(bo, width, height, format, use_flags);
@@ -310,8 +1671,6 @@ struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, ui
 		return NULL;
 	}
 
-	pthread_mutex_lock(&drv->driver_lock);
-
 	for (plane = 0; plane < bo->meta.num_planes; plane++) {
 		if (plane > 0)
 			assert(bo->meta.offsets[plane] >= bo->meta.offsets[plane - 1]);
@@ -319,8 +1678,6 @@ struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, ui
 		drv_increment_reference_count(drv, bo, plane);
 	}
 
-	pthread_mutex_unlock(&drv->driver_lock);
-
 	return bo;
 }
 
@@ -343,9 +1700,9 @@ struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint
 
 	ret = -EINVAL;
 	if (drv->backend->bo_compute_metadata) {
-		ret = drv->backend->bo_compute_metadata(bo, width, height, format, BO_USE_NONE,
-							modifiers, count);
-		if (ret == 0)
+		ret = drv_bo_compute_metadata(bo, width, height, format, BO_USE_NONE, modifiers,
+					      count);
+		if (ret == 0 && !drv_bo_pool_take(bo))
 			ret = drv->backend->bo_create_from_metadata(bo);
 	} else {
 		ret = drv->backend->bo_create_with_modifiers(bo, width, height, format, modifiers,
@@ -357,8 +1714,6 @@ struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint
 		return NULL;
 	}
 
-	pthread_mutex_lock(&drv->driver_lock);
-
 	for (plane = 0; plane < bo->meta.num_planes; plane++) {
 		if (plane > 0)
 			assert(bo->meta.offsets[plane] >= bo->meta.offsets[plane - 1]);
@@ -366,32 +1721,137 @@ struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint
 		drv_increment_reference_count(drv, bo, plane);
 	}
 
-	pthread_mutex_unlock(&drv->driver_lock);
-
 	return bo;
 }
 
-void drv_bo_destroy(struct bo *bo)
+int drv_bo_create_batch(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			uint64_t use_flags, const uint64_t *modifiers, uint32_t modifier_count,
+			uint32_t count, struct bo **bos)
+{
+	int ret = 0;
+	uint32_t i, created = 0;
+	size_t plane;
+	bool is_test_alloc;
+
+	if (!count)
+		return 0;
+
+	if (modifiers && !drv->backend->bo_create_with_modifiers &&
+	    !drv->backend->bo_compute_metadata)
+		return -ENOENT;
+
+	/* Match drv_bo_create_with_modifiers(), which ignores the use flags. */
+	if (modifiers)
+		use_flags = BO_USE_NONE;
+
+	is_test_alloc = use_flags & BO_USE_TEST_ALLOC;
+	use_flags &= ~BO_USE_TEST_ALLOC;
+
+	memset(bos, 0, count * sizeof(*bos));
+	for (i = 0; i < count; i++) {
+		bos[i] = drv_bo_new(drv, width, height, format, use_flags, is_test_alloc);
+		if (!bos[i]) {
+			ret = -ENOMEM;
+			goto free_bos;
+		}
+	}
+
+	if (drv->backend->bo_compute_metadata) {
+		/* All buffers share one layout, so it only has to be computed once. */
+		ret = drv_bo_compute_metadata(bos[0], width, height, format, use_flags, modifiers,
+					      modifier_count);
+		if (ret)
+			goto free_bos;
+
+		for (i = 1; i < count; i++)
+			bos[i]->meta = bos[0]->meta;
+
+		if (!is_test_alloc) {
+			for (created = 0; created < count; created++) {
+				if (drv_bo_pool_take(bos[created]))
+					continue;
+
+				ret = drv->backend->bo_create_from_metadata(bos[created]);
+				if (ret)
+					goto destroy_bos;
+			}
+		}
+	} else if (!is_test_alloc) {
+		for (created = 0; created < count; created++) {
+			if (modifiers)
+				ret = drv->backend->bo_create_with_modifiers(
+				    bos[created], width, height, format, modifiers, modifier_count);
+			else
+				ret = drv->backend->bo_create(bos[created], width, height, format,
+							      use_flags);
+			if (ret)
+				goto destroy_bos;
+		}
+	} else {
+		ret = -EINVAL;
+		goto free_bos;
+	}
+
+	/*
+	 * Reference counts are only taken once every buffer exists, so a failure above never has
+	 * to undo them.
+	 */
+	for (i = 0; i < count; i++) {
+		for (plane = 0; plane < bos[i]->meta.num_planes; plane++) {
+			if (plane > 0)
+				assert(bos[i]->meta.offsets[plane] >=
+				       bos[i]->meta.offsets[plane - 1]);
+
+			drv_increment_reference_count(drv, bos[i], plane);
+		}
+	}
+
+	return 0;
+
+destroy_bos:
+	/* Freshly created buffers can't share handles with anything, so destroy them directly. */
+	for (i = 0; i < created; i++)
+		drv->backend->bo_destroy(bos[i]);
+free_bos:
+	for (i = 0; i < count; i++) {
+		free(bos[i]);
+		bos[i] = NULL;
+	}
+
+	return ret;
+}
+
+static void drv_bo_destroy_now(struct bo *bo)
 {
 	int ret;
 	size_t plane;
 	uintptr_t total = 0;
 	struct driver *drv = bo->drv;
 
-	if (!bo->is_test_buffer) {
-		pthread_mutex_lock(&drv->driver_lock);
+	/* Only the first plane of each handle holds a cached fd, so each is closed once. */
+	for (plane = 0; plane < bo->meta.num_planes; plane++)
+		if (bo->export_fds[plane] >= 0)
+			close(bo->export_fds[plane]);
 
+	if (!bo->is_test_buffer) {
 		for (plane = 0; plane < bo->meta.num_planes; plane++)
 			drv_decrement_reference_count(drv, bo, plane);
 
 		for (plane = 0; plane < bo->meta.num_planes; plane++)
 			total += drv_get_reference_count(drv, bo, plane);
 
-		pthread_mutex_unlock(&drv->driver_lock);
-
 		if (total == 0) {
+			drv_import_cache_forget(bo);
+
+			pthread_mutex_lock(&drv->driver_lock);
 			ret = drv_mapping_destroy(bo);
+			pthread_mutex_unlock(&drv->driver_lock);
 			assert(ret == 0);
+
+			/* The pool takes ownership of the buffer. */
+			if (drv_bo_pool_put(bo))
+				return;
+
 			bo->drv->backend->bo_destroy(bo);
 		}
 	}
@@ -399,29 +1859,43 @@ void drv_bo_destroy(struct bo *bo)
 	free(bo);
 }
 
+void drv_bo_destroy(struct bo *bo)
+{
+	if (!bo->is_test_buffer && drv_bo_reaper_queue(bo))
+		return;
+
+	drv_bo_destroy_now(bo);
+}
+
 struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
 {
 	int ret;
 	size_t plane;
 	struct bo *bo;
 	off_t seek_end;
+	struct import_key key;
+	bool cacheable;
 
 	bo = drv_bo_new(drv, data->width, data->height, data->format, data->use_flags, false);
 
 	if (!bo)
 		return NULL;
 
+	/* Imported objects are shared with other clients. */
+	bo->is_exported = true;
+
+	cacheable = !drv_import_key(data, bo->meta.num_planes, &key);
+	if (cacheable && drv_import_cache_take(bo, &key, data))
+		return bo;
+
 	ret = drv->backend->bo_import(bo, data);
 	if (ret) {
 		free(bo);
 		return NULL;
 	}
 
-	for (plane = 0; plane < bo->meta.num_planes; plane++) {
-		pthread_mutex_lock(&bo->drv->driver_lock);
+	for (plane = 0; plane < bo->meta.num_planes; plane++)
 		drv_increment_reference_count(bo->drv, bo, plane);
-		pthread_mutex_unlock(&bo->drv->driver_lock);
-	}
 
 	for (plane = 0; plane < bo->meta.num_planes; plane++) {
 		bo->meta.strides[plane] = data->strides[plane];
@@ -448,6 +1922,9 @@ struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
 		bo->meta.total_size += bo->meta.sizes[plane];
 	}
 
+	if (cacheable)
+		drv_import_cache_put(bo, &key, data);
+
 	return bo;
 
 destroy_bo:
@@ -458,10 +1935,12 @@ destroy_bo:
 void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
 		 struct mapping **map_data, size_t plane)
 {
-	uint32_t i;
 	uint8_t *addr;
-	struct mapping mapping;
+	struct vma_node **list, *node;
+	struct mapping_node mapping, *prior;
+	bool invalidate = !(map_flags & BO_MAP_NO_INVALIDATE);
 
+	map_flags &= ~BO_MAP_NO_INVALIDATE;
 	assert(rect->width >= 0);
 	assert(rect->height >= 0);
 	assert(rect->x + rect->width <= drv_bo_get_width(bo));
@@ -475,82 +1954,99 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 	}
 
 	memset(&mapping, 0, sizeof(mapping));
-	mapping.rect = *rect;
-	mapping.refcount = 1;
+	mapping.mapping.rect = *rect;
+	mapping.mapping.refcount = 1;
 
 	pthread_mutex_lock(&bo->drv->driver_lock);
 
-	for (i = 0; i < drv_array_size(bo->drv->mappings); i++) {
-		struct mapping *prior = (struct mapping *)drv_array_at_idx(bo->drv->mappings, i);
-		if (prior->vma->handle != bo->handles[plane].u32 ||
-		    prior->vma->map_flags != map_flags)
-			continue;
-
-		if (rect->x != prior->rect.x || rect->y != prior->rect.y ||
-		    rect->width != prior->rect.width || rect->height != prior->rect.height)
-			continue;
-
-		prior->refcount++;
-		*map_data = prior;
-		goto exact_match;
-	}
+	list = drv_get_vma_list(bo->drv, bo->handles[plane].u32);
+	if (!list)
+		goto fail;
+
+	node = drv_vma_find(*list, map_flags);
+	if (node) {
+		prior = drv_mapping_find(node, rect);
+		if (prior) {
+			prior->mapping.refcount++;
+			*map_data = &prior->mapping;
+			goto exact_match;
+		}
 
-	for (i = 0; i < drv_array_size(bo->drv->mappings); i++) {
-		struct mapping *prior = (struct mapping *)drv_array_at_idx(bo->drv->mappings, i);
-		if (prior->vma->handle != bo->handles[plane].u32 ||
-		    prior->vma->map_flags != map_flags)
-			continue;
+		if (!node->vma.refcount) {
+			drv_vma_cache_unlink(bo->drv->vma_cache, node);
+			bo->drv->vma_cache->hits++;
+		}
 
-		prior->vma->refcount++;
-		mapping.vma = prior->vma;
+		node->vma.refcount++;
 		goto success;
 	}
 
-	mapping.vma = calloc(1, sizeof(*mapping.vma));
-	memcpy(mapping.vma->map_strides, bo->meta.strides, sizeof(mapping.vma->map_strides));
-	addr = bo->drv->backend->bo_map(bo, mapping.vma, plane, map_flags);
+	node = calloc(1, sizeof(*node));
+	if (!node)
+		goto fail;
+
+	memcpy(node->vma.map_strides, bo->meta.strides, sizeof(node->vma.map_strides));
+	addr = bo->drv->backend->bo_map(bo, &node->vma, plane, map_flags);
 	if (addr == MAP_FAILED) {
-		*map_data = NULL;
-		free(mapping.vma);
-		pthread_mutex_unlock(&bo->drv->driver_lock);
-		return MAP_FAILED;
+		free(node);
+		goto fail;
 	}
 
-	mapping.vma->refcount = 1;
-	mapping.vma->addr = addr;
-	mapping.vma->handle = bo->handles[plane].u32;
-	mapping.vma->map_flags = map_flags;
+	node->vma.refcount = 1;
+	node->vma.addr = addr;
+	node->vma.handle = bo->handles[plane].u32;
+	node->vma.map_flags = map_flags;
+	node->next = *list;
+	*list = node;
+	bo->drv->vma_cache->misses++;
 
 success:
-	*map_data = drv_array_append(bo->drv->mappings, &mapping);
+	mapping.mapping.vma = &node->vma;
+	prior = drv_array_append(bo->drv->mappings, &mapping);
+	if (!prior)
+		goto unmap_vma;
+
+	prior->next = node->mappings;
+	node->mappings = prior;
+	*map_data = &prior->mapping;
+
 exact_match:
-	drv_bo_invalidate(bo, *map_data);
+	if (invalidate)
+		drv_bo_invalidate(bo, *map_data);
 	addr = (uint8_t *)((*map_data)->vma->addr);
 	addr += drv_bo_get_plane_offset(bo, plane);
 	pthread_mutex_unlock(&bo->drv->driver_lock);
 	return (void *)addr;
+
+unmap_vma:
+	if (!--node->vma.refcount) {
+		drv_vma_unlink(list, node);
+		bo->drv->backend->bo_unmap(bo, &node->vma);
+		free(node);
+	}
+fail:
+	*map_data = NULL;
+	pthread_mutex_unlock(&bo->drv->driver_lock);
+	return MAP_FAILED;
 }
 
 int drv_bo_unmap(struct bo *bo, struct mapping *mapping)
 {
-	uint32_t i;
 	int ret = 0;
+	struct vma_node *node = drv_vma_node(mapping->vma);
 
 	pthread_mutex_lock(&bo->drv->driver_lock);
 
 	if (--mapping->refcount)
 		goto out;
 
-	if (!--mapping->vma->refcount) {
-		ret = bo->drv->backend->bo_unmap(bo, mapping->vma);
-		free(mapping->vma);
-	}
+	drv_mapping_unlink(node, (struct mapping_node *)mapping);
+	drv_array_remove_item(bo->drv->mappings, mapping);
 
-	for (i = 0; i < drv_array_size(bo->drv->mappings); i++) {
-		if (mapping == (struct mapping *)drv_array_at_idx(bo->drv->mappings, i)) {
-			drv_array_remove(bo->drv->mappings, i);
-			break;
-		}
+	if (!--node->vma.refcount && !drv_vma_cache_put(bo, node)) {
+		drv_vma_unlink(drv_get_vma_list(bo->drv, node->vma.handle), node);
+		ret = bo->drv->backend->bo_unmap(bo, &node->vma);
+		free(node);
 	}
 
 out:
@@ -585,9 +2081,37 @@ int drv_bo_flush(struct bo *bo, struct mapping *mapping)
 	if (bo->drv->backend->bo_flush)
 		ret = bo->drv->backend->bo_flush(bo, mapping);
 
+	if (!ret)
+		memset(&mapping->damage, 0, sizeof(mapping->damage));
+
+	return ret;
+}
+
+int drv_bo_flush_fence(struct bo *bo, struct mapping *mapping, int *fence)
+{
+	int ret;
+
+	assert(mapping);
+	assert(mapping->vma);
+	assert(mapping->refcount > 0);
+	assert(mapping->vma->refcount > 0);
+
+	*fence = -1;
+	if (!bo->drv->backend->bo_flush_fence)
+		return drv_bo_flush(bo, mapping);
+
+	ret = bo->drv->backend->bo_flush_fence(bo, mapping, fence);
+	if (!ret)
+		memset(&mapping->damage, 0, sizeof(mapping->damage));
+
 	return ret;
 }
 
+bool drv_has_flush_fences(struct driver *drv)
+{
+	return drv->backend->bo_flush_fence != NULL;
+}
+
 int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping)
 {
 	int ret = 0;
@@ -598,14 +2122,60 @@ int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping)
 	assert(mapping->vma->refcount > 0);
 	assert(!(bo->meta.use_flags & BO_USE_PROTECTED));
 
-	if (bo->drv->backend->bo_flush)
-		ret = bo->drv->backend->bo_flush(bo, mapping);
-	else
-		ret = drv_bo_unmap(bo, mapping);
+	if (!bo->drv->backend->bo_flush)
+		return drv_bo_unmap(bo, mapping);
+
+	ret = bo->drv->backend->bo_flush(bo, mapping);
+	if (!ret)
+		memset(&mapping->damage, 0, sizeof(mapping->damage));
 
 	return ret;
 }
 
+/* Grows dst to the bounding box of dst and rect. An empty dst is replaced by rect. */
+static void drv_rect_union(struct rectangle *dst, const struct rectangle *rect)
+{
+	uint32_t x1, y1;
+
+	if (!dst->width || !dst->height) {
+		*dst = *rect;
+		return;
+	}
+
+	x1 = MAX(dst->x + dst->width, rect->x + rect->width);
+	y1 = MAX(dst->y + dst->height, rect->y + rect->height);
+	dst->x = MIN(dst->x, rect->x);
+	dst->y = MIN(dst->y, rect->y);
+	dst->width = x1 - dst->x;
+	dst->height = y1 - dst->y;
+}
+
+void drv_bo_add_damage(struct bo *bo, struct mapping *mapping, const struct rectangle *rect)
+{
+	assert(rect->x + rect->width <= drv_bo_get_width(bo));
+	assert(rect->y + rect->height <= drv_bo_get_height(bo));
+
+	if (!rect->width || !rect->height)
+		return;
+
+	drv_rect_union(&mapping->damage, rect);
+}
+
+void drv_bo_extend_mapping(struct bo *bo, struct mapping *mapping, const struct rectangle *rect)
+{
+	assert(rect->x + rect->width <= drv_bo_get_width(bo));
+	assert(rect->y + rect->height <= drv_bo_get_height(bo));
+
+	/* An empty mapping rectangle already covers the whole buffer. */
+	if (!rect->width || !rect->height || !mapping->rect.width || !mapping->rect.height)
+		return;
+
+	/* Mappings are looked up by their rectangle under the driver lock. */
+	pthread_mutex_lock(&bo->drv->driver_lock);
+	drv_rect_union(&mapping->rect, rect);
+	pthread_mutex_unlock(&bo->drv->driver_lock);
+}
+
 uint32_t drv_bo_get_width(struct bo *bo)
 {
 	return bo->meta.width;
@@ -630,23 +2200,62 @@ union bo_handle drv_bo_get_plane_handle(struct bo *bo, size_t plane)
 #define DRM_RDWR O_RDWR
 #endif
 
-int drv_bo_get_plane_fd(struct bo *bo, size_t plane)
+/* Planes that share a GEM handle share one exported fd, cached at the first such plane. */
+static size_t drv_bo_export_plane(struct bo *bo, size_t plane)
 {
+	size_t first;
+
+	for (first = 0; first < plane; first++)
+		if (bo->handles[first].u32 == bo->handles[plane].u32)
+			break;
+
+	return first;
+}
 
-	int ret, fd;
+int drv_bo_borrow_plane_fd(struct bo *bo, size_t plane)
+{
+	int ret, fd, cached = -1;
 	assert(plane < bo->meta.num_planes);
 
 	if (bo->is_test_buffer) {
 		return -EINVAL;
 	}
 
+	bo->is_exported = true;
+
+	plane = drv_bo_export_plane(bo, plane);
+	fd = __atomic_load_n(&bo->export_fds[plane], __ATOMIC_ACQUIRE);
+	if (fd >= 0)
+		return fd;
+
 	ret = drmPrimeHandleToFD(bo->drv->fd, bo->handles[plane].u32, DRM_CLOEXEC | DRM_RDWR, &fd);
 
 	// Older DRM implementations blocked DRM_RDWR, but gave a read/write mapping anyways
 	if (ret)
 		ret = drmPrimeHandleToFD(bo->drv->fd, bo->handles[plane].u32, DRM_CLOEXEC, &fd);
 
-	return (ret) ? ret : fd;
+	if (ret)
+		return ret;
+
+	/* Another thread may have exported the same plane in the meantime. */
+	if (!__atomic_compare_exchange_n(&bo->export_fds[plane], &cached, fd, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		close(fd);
+		fd = cached;
+	}
+
+	return fd;
+}
+
+int drv_bo_get_plane_fd(struct bo *bo, size_t plane)
+{
+	int fd = drv_bo_borrow_plane_fd(bo, plane);
+
+	if (fd < 0)
+		return fd;
+
+	fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	return (fd < 0) ? -errno : fd;
 }
 
 uint32_t drv_bo_get_plane_offset(struct bo *bo, size_t plane)
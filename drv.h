@@ -48,6 +48,11 @@ extern "C" {
 #define BO_MAP_READ (1 << 0)
 #define BO_MAP_WRITE (1 << 1)
 #define BO_MAP_READ_WRITE (BO_MAP_READ | BO_MAP_WRITE)
+/*
+ * Leaves the new mapping for the caller to drv_bo_invalidate(), e.g. once an acquire fence has
+ * signaled. Not part of the mapping's flags.
+ */
+#define BO_MAP_NO_INVALIDATE (1 << 2)
 
 /* This is our extension to <drm_fourcc.h>.  We need to make sure we don't step
  * on the namespace of already defined formats, which can be done by using invalid
@@ -113,6 +118,8 @@ struct mapping {
 	struct vma *vma;
 	struct rectangle rect;
 	uint32_t refcount;
+	/* Bounding box of the regions written since the last flush, empty if unknown. */
+	struct rectangle damage;
 };
 
 struct driver *drv_create(int fd);
@@ -136,6 +143,16 @@ struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, ui
 struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint32_t height,
 					uint32_t format, const uint64_t *modifiers, uint32_t count);
 
+/*
+ * Creates count buffers with the same parameters into bos. With a modifier list the buffers are
+ * created like drv_bo_create_with_modifiers() and use_flags is ignored, otherwise like
+ * drv_bo_create(). Either every buffer is created and 0 is returned, or none is and a negative
+ * errno is returned.
+ */
+int drv_bo_create_batch(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			uint64_t use_flags, const uint64_t *modifiers, uint32_t modifier_count,
+			uint32_t count, struct bo **bos);
+
 void drv_bo_destroy(struct bo *bo);
 
 struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data);
@@ -151,6 +168,28 @@ int drv_bo_flush(struct bo *bo, struct mapping *mapping);
 
 int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping);
 
+/*
+ * Like drv_bo_flush(), but may return a sync_file fd in *fence instead of waiting for the flush to
+ * reach the device. The caller owns the fd. *fence is -1 when nothing is left pending, which is
+ * always the case unless drv_has_flush_fences() is true.
+ */
+int drv_bo_flush_fence(struct bo *bo, struct mapping *mapping, int *fence);
+
+bool drv_has_flush_fences(struct driver *drv);
+
+/*
+ * Reports that rect was written through mapping, so that the next flush only has to cover the
+ * rows of the reported rectangles instead of the whole buffer. The damage is reset by the flush.
+ * Like flushes, calls must be serialized with other users of the mapping.
+ */
+void drv_bo_add_damage(struct bo *bo, struct mapping *mapping, const struct rectangle *rect);
+
+/*
+ * Grows the rectangle of mapping to also cover rect, so that the next drv_bo_invalidate() and
+ * flushes without damage include it. Used when a mapping is reused for another region.
+ */
+void drv_bo_extend_mapping(struct bo *bo, struct mapping *mapping, const struct rectangle *rect);
+
 uint32_t drv_bo_get_width(struct bo *bo);
 
 uint32_t drv_bo_get_height(struct bo *bo);
@@ -159,8 +198,15 @@ size_t drv_bo_get_num_planes(struct bo *bo);
 
 union bo_handle drv_bo_get_plane_handle(struct bo *bo, size_t plane);
 
+/* Returns a new dma-buf fd for the plane, which the caller must close. */
 int drv_bo_get_plane_fd(struct bo *bo, size_t plane);
 
+/*
+ * Returns the dma-buf fd cached for the plane. It stays owned by the bo and is closed when the bo
+ * is destroyed, so the caller must neither close it nor use it afterwards.
+ */
+int drv_bo_borrow_plane_fd(struct bo *bo, size_t plane);
+
 uint32_t drv_bo_get_plane_offset(struct bo *bo, size_t plane);
 
 uint32_t drv_bo_get_plane_size(struct bo *bo, size_t plane);
@@ -186,6 +232,49 @@ uint32_t drv_num_buffers_per_bo(struct bo *bo);
 int drv_resource_info(struct bo *bo, uint32_t strides[DRV_MAX_PLANES],
 		      uint32_t offsets[DRV_MAX_PLANES]);
 
+void drv_get_layout_cache_stats(struct driver *drv, uint64_t *hits, uint64_t *misses);
+
+/*
+ * Keeps up to budget bytes of destroyed, never exported buffers around for reuse, each for at
+ * most max_idle_ms. A budget of 0, the default, disables the pool. Idle buffers are released by the
+ * reaper thread when it is running, and otherwise on the next release or drv_bo_pool_trim().
+ * cros_gralloc exports every buffer it allocates, so only callers that keep their buffers to
+ * themselves benefit.
+ */
+void drv_bo_pool_configure(struct driver *drv, uint64_t budget, uint32_t max_idle_ms);
+
+/* Releases pooled buffers that have been idle for max_idle_ms or longer, or all of them for 0. */
+void drv_bo_pool_trim(struct driver *drv, uint32_t max_idle_ms);
+
+/*
+ * Moves buffer destruction onto a background thread with a queue of up to queue_size buffers.
+ * A queue_size of 0, the default, destroys buffers synchronously again. Must not be called
+ * concurrently with itself.
+ */
+int drv_bo_reaper_configure(struct driver *drv, uint32_t queue_size);
+
+/* Waits until every buffer queued for destruction so far has been destroyed. */
+void drv_bo_reaper_flush(struct driver *drv);
+
+/*
+ * Keeps up to max_count CPU mappings of SW_READ_OFTEN or SW_WRITE_OFTEN buffers, totalling at
+ * most max_bytes, mapped after their last drv_bo_unmap() so the next drv_bo_map() can reuse them.
+ * Least recently used mappings are dropped first, and all of a buffer's are dropped when it is
+ * destroyed. A max_count of 0, the default, disables the cache.
+ */
+void drv_bo_map_cache_configure(struct driver *drv, uint32_t max_count, uint64_t max_bytes);
+
+/* Hits are maps served by a cached mapping, misses are maps that had to create a new one. */
+void drv_get_map_cache_stats(struct driver *drv, uint64_t *hits, uint64_t *misses);
+
+/*
+ * Flushes are mappings whose flush copied data to the device, transfers the regions they copied,
+ * and submissions the requests the transfers took, each a round trip to the host on virtualized
+ * devices. All are zero on drivers that flush without transfers.
+ */
+void drv_get_transfer_stats(struct driver *drv, uint64_t *flushes, uint64_t *transfers,
+			    uint64_t *submissions);
+
 #ifdef USE_GRALLOC1
 uint32_t drv_bo_get_stride_or_tiling(struct bo *bo);
 #endif
@@ -33,7 +33,11 @@ struct bo {
 	struct driver *drv;
 	struct bo_metadata meta;
 	bool is_test_buffer;
+	/* Set once the buffer has been shared with, or imported from, another client. */
+	bool is_exported;
 	union bo_handle handles[DRV_MAX_PLANES];
+	/* Exported dma-buf fds owned by the bo, or -1; see drv_bo_borrow_plane_fd(). */
+	int export_fds[DRV_MAX_PLANES];
 	void *priv;
 };
 
@@ -61,10 +65,18 @@ struct driver {
 	int fd;
 	const struct backend *backend;
 	void *priv;
-	void *buffer_table;
+	struct drv_handle_table *buffer_table;
 	uint32_t gpu_grp_type;  	// enum CIV_GPU_TYPE
 	struct drv_array *mappings;
 	struct drv_array *combos;
+	/* Built from combos once backend->init returns; see drv_get_combination(). */
+	struct drv_hash *combo_index;
+	uint64_t combo_cache[256];
+	struct layout_cache *layout_cache;
+	struct bo_pool *bo_pool;
+	struct bo_reaper *reaper;
+	struct import_cache *import_cache;
+	struct vma_cache *vma_cache;
 	pthread_mutex_t driver_lock;
 };
 
@@ -87,10 +99,18 @@ struct backend {
 	int (*bo_unmap)(struct bo *bo, struct vma *vma);
 	int (*bo_invalidate)(struct bo *bo, struct mapping *mapping);
 	int (*bo_flush)(struct bo *bo, struct mapping *mapping);
+	// Optional. Like bo_flush, but instead of waiting for a transfer to complete it may return
+	// a sync_file fd in *fence that signals once it has. *fence is -1 otherwise.
+	int (*bo_flush_fence)(struct bo *bo, struct mapping *mapping, int *fence);
 	uint32_t (*resolve_format)(struct driver *drv, uint32_t format, uint64_t use_flags);
 	size_t (*num_planes_from_modifier)(struct driver *drv, uint32_t format, uint64_t modifier);
 	int (*resource_info)(struct bo *bo, uint32_t strides[DRV_MAX_PLANES],
 			     uint32_t offsets[DRV_MAX_PLANES]);
+	// Optional. Returns 1 if the backing storage is still retained, 0 if the kernel purged it.
+	int (*bo_set_purgeable)(struct bo *bo, bool purgeable);
+	// Optional. Reports the counters behind drv_get_transfer_stats().
+	void (*get_transfer_stats)(struct driver *drv, uint64_t *flushes, uint64_t *transfers,
+				   uint64_t *submissions);
 };
 
 // clang-format off
@@ -423,6 +423,9 @@ PUBLIC void *gbm_bo_map2(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t wid
 	if (addr == MAP_FAILED)
 		return MAP_FAILED;
 
+	if (map_flags & BO_MAP_WRITE)
+		drv_bo_add_damage(bo->bo, (struct mapping *)*map_data, &rect);
+
 	*stride = ((struct mapping *)*map_data)->vma->map_strides[plane];
 
 	offset = *stride * rect.y;
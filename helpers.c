@@ -6,6 +6,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,6 +15,11 @@
 #include <unistd.h>
 #include <xf86drm.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 #include "drv_priv.h"
 #include "helpers.h"
 #include "util.h"
@@ -89,7 +95,7 @@ static const struct planar_layout biplanar_yuv_p010_layout = {
 
 // clang-format on
 
-static const struct planar_layout *layout_from_format(uint32_t format)
+static const struct planar_layout *lookup_layout(uint32_t format)
 {
 	switch (format) {
 	case DRM_FORMAT_BGR233:
@@ -169,11 +175,20 @@ static const struct planar_layout *layout_from_format(uint32_t format)
 		return &packed_8bpp_layout;
 
 	default:
-		drv_log("UNKNOWN FORMAT %d\n", format);
 		return NULL;
 	}
 }
 
+static const struct planar_layout *layout_from_format(uint32_t format)
+{
+	const struct planar_layout *layout = lookup_layout(format);
+
+	if (!layout)
+		drv_log("UNKNOWN FORMAT %d\n", format);
+
+	return layout;
+}
+
 size_t drv_num_planes_from_format(uint32_t format)
 {
 	const struct planar_layout *layout = layout_from_format(format);
@@ -494,43 +509,49 @@ int drv_bo_munmap(struct bo *bo, struct vma *vma)
 	return munmap(vma->addr, vma->length);
 }
 
-int drv_mapping_destroy(struct bo *bo)
+void drv_bo_get_rect_rows(struct bo *bo, const struct rectangle *rect, size_t plane,
+			  uint32_t *first, uint32_t *count)
 {
-	int ret;
-	size_t plane;
-	struct mapping *mapping;
-	uint32_t idx;
+	const struct planar_layout *layout = lookup_layout(bo->meta.format);
+	uint32_t rows, last;
 
-	/*
-	 * This function is called right before the buffer is destroyed. It will free any mappings
-	 * associated with the buffer.
-	 */
+	rows = bo->meta.strides[plane] ? bo->meta.sizes[plane] / bo->meta.strides[plane] : 0;
+	*first = 0;
+	*count = rows;
 
-	idx = 0;
-	for (plane = 0; plane < bo->meta.num_planes; plane++) {
-		while (idx < drv_array_size(bo->drv->mappings)) {
-			mapping = (struct mapping *)drv_array_at_idx(bo->drv->mappings, idx);
-			if (mapping->vma->handle != bo->handles[plane].u32) {
-				idx++;
-				continue;
-			}
+	/* Planes the layout doesn't describe, like compression metadata, are always whole. */
+	if (!rect->width || !rect->height || !layout || plane >= layout->num_planes)
+		return;
 
-			if (!--mapping->vma->refcount) {
-				ret = bo->drv->backend->bo_unmap(bo, mapping->vma);
-				if (ret) {
-					drv_log("munmap failed\n");
-					return ret;
-				}
+	*first = rect->y / layout->vertical_subsampling[plane];
+	last = DIV_ROUND_UP(rect->y + rect->height, layout->vertical_subsampling[plane]);
+	*first = MIN(*first, rows);
+	*count = MIN(last, rows) - *first;
+}
 
-				free(mapping->vma);
-			}
+void drv_bo_get_rect_bytes(struct bo *bo, const struct rectangle *rect, size_t plane,
+			   uint32_t *offset, uint32_t *size)
+{
+	const struct planar_layout *layout = lookup_layout(bo->meta.format);
+	uint32_t stride = bo->meta.strides[plane], first, last;
 
-			/* This shrinks and shifts the array, so don't increment idx. */
-			drv_array_remove(bo->drv->mappings, idx);
-		}
-	}
+	*offset = 0;
+	*size = stride;
 
-	return 0;
+	if (!rect->width || !rect->height || !layout || plane >= layout->num_planes)
+		return;
+
+	first = rect->x / layout->horizontal_subsampling[plane] * layout->bytes_per_pixel[plane];
+	last = DIV_ROUND_UP(rect->x + rect->width, layout->horizontal_subsampling[plane]) *
+	       layout->bytes_per_pixel[plane];
+	*offset = MIN(first, stride);
+	*size = MIN(last, stride) - *offset;
+}
+
+void drv_bo_get_damaged_rows(struct bo *bo, struct mapping *mapping, size_t plane,
+			     uint32_t *first, uint32_t *count)
+{
+	drv_bo_get_rect_rows(bo, &mapping->damage, plane, first, count);
 }
 
 int drv_get_prot(uint32_t map_flags)
@@ -538,34 +559,319 @@ int drv_get_prot(uint32_t map_flags)
 	return (BO_MAP_WRITE & map_flags) ? PROT_WRITE | PROT_READ : PROT_READ;
 }
 
+/*
+ * Copies to and from write-combined memory. Plain loads from WC memory are uncached and fetch
+ * one word at a time, and plain stores to it can be split up by cache line fills of the
+ * destination. On x86 streaming loads (SSE4.1 MOVNTDQA) fill a whole line per access, and
+ * non-temporal stores write full lines without reading them first. Elsewhere, including on ARM
+ * where WC reads have no streaming counterpart, the libc memcpy is used.
+ */
+typedef void (*drv_copy_fn)(uint8_t *dst, const uint8_t *src, size_t size);
+
+/* Below this size the setup isn't worth it. */
+#define DRV_WC_COPY_MIN_SIZE 256
+
+static drv_copy_fn copy_from_wc_fn;
+static drv_copy_fn copy_to_wc_fn;
+static pthread_once_t copy_once = PTHREAD_ONCE_INIT;
+
+static void drv_memcpy(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	memcpy(dst, src, size);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.1"))) static void drv_copy_from_wc_sse41(uint8_t *dst,
+								     const uint8_t *src,
+								     size_t size)
+{
+	size_t head = MIN(-(uintptr_t)src & 15, size);
+	__m128i *s, a, b, c, d;
+
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	size -= head;
+
+	/* Streaming loads are weakly ordered against earlier stores. */
+	_mm_mfence();
+	for (s = (__m128i *)(uintptr_t)src; size >= 64; size -= 64, s += 4, dst += 64) {
+		a = _mm_stream_load_si128(s);
+		b = _mm_stream_load_si128(s + 1);
+		c = _mm_stream_load_si128(s + 2);
+		d = _mm_stream_load_si128(s + 3);
+		_mm_storeu_si128((__m128i *)dst, a);
+		_mm_storeu_si128((__m128i *)dst + 1, b);
+		_mm_storeu_si128((__m128i *)dst + 2, c);
+		_mm_storeu_si128((__m128i *)dst + 3, d);
+	}
+
+	memcpy(dst, s, size);
+}
+
+__attribute__((target("sse2"))) static void drv_copy_to_wc_sse2(uint8_t *dst, const uint8_t *src,
+								 size_t size)
+{
+	size_t head = MIN(-(uintptr_t)dst & 15, size);
+	const __m128i *s;
+	__m128i *d;
+
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	size -= head;
+
+	for (d = (__m128i *)dst, s = (const __m128i *)src; size >= 64; size -= 64, d += 4, s += 4) {
+		_mm_stream_si128(d, _mm_loadu_si128(s));
+		_mm_stream_si128(d + 1, _mm_loadu_si128(s + 1));
+		_mm_stream_si128(d + 2, _mm_loadu_si128(s + 2));
+		_mm_stream_si128(d + 3, _mm_loadu_si128(s + 3));
+	}
+
+	/* Non-temporal stores are weakly ordered, make them visible before returning. */
+	_mm_sfence();
+	memcpy(d, s, size);
+}
+#endif
+
+static void drv_copy_init(void)
+{
+	copy_from_wc_fn = drv_memcpy;
+	copy_to_wc_fn = drv_memcpy;
+
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		if (ecx & bit_SSE4_1)
+			copy_from_wc_fn = drv_copy_from_wc_sse41;
+		if (edx & bit_SSE2)
+			copy_to_wc_fn = drv_copy_to_wc_sse2;
+	}
+#endif
+}
+
+static void drv_copy_2d(drv_copy_fn copy, void *dst, uint32_t dst_stride, const void *src,
+			uint32_t src_stride, uint32_t row_size, uint32_t rows)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	uint32_t y;
+
+	if (dst_stride == row_size && src_stride == row_size) {
+		row_size *= rows;
+		rows = 1;
+	}
+
+	/* Each row is a separate call, so the threshold applies per row. */
+	if (row_size < DRV_WC_COPY_MIN_SIZE)
+		copy = drv_memcpy;
+
+	for (y = 0; y < rows; y++, d += dst_stride, s += src_stride)
+		copy(d, s, row_size);
+}
+
+void drv_copy_from_wc(void *dst, const void *src, size_t size)
+{
+	pthread_once(&copy_once, drv_copy_init);
+	(size < DRV_WC_COPY_MIN_SIZE ? drv_memcpy : copy_from_wc_fn)(dst, src, size);
+}
+
+void drv_copy_to_wc(void *dst, const void *src, size_t size)
+{
+	pthread_once(&copy_once, drv_copy_init);
+	(size < DRV_WC_COPY_MIN_SIZE ? drv_memcpy : copy_to_wc_fn)(dst, src, size);
+}
+
+void drv_copy_from_wc_2d(void *dst, uint32_t dst_stride, const void *src, uint32_t src_stride,
+			 uint32_t row_size, uint32_t rows)
+{
+	pthread_once(&copy_once, drv_copy_init);
+	drv_copy_2d(copy_from_wc_fn, dst, dst_stride, src, src_stride, row_size, rows);
+}
+
+void drv_copy_to_wc_2d(void *dst, uint32_t dst_stride, const void *src, uint32_t src_stride,
+		       uint32_t row_size, uint32_t rows)
+{
+	pthread_once(&copy_once, drv_copy_init);
+	drv_copy_2d(copy_to_wc_fn, dst, dst_stride, src, src_stride, row_size, rows);
+}
+
+/*
+ * GEM handle reference counts live in a table split into shards by handle. Lookups and count
+ * updates are lock-free: entries are only ever pushed onto the head of a bucket chain, and an
+ * entry whose count drops to zero stays in place so the kernel can hand the same handle out
+ * again later. Only inserting a handle that was never seen before takes its shard's lock, so
+ * create/import/destroy on different handles don't serialize on a driver-wide lock.
+ */
+#define HANDLE_TABLE_SHARDS 64
+#define HANDLE_TABLE_BUCKETS 64
+
+struct handle_table_entry {
+	struct handle_table_entry *next;
+	uint32_t handle;
+	uintptr_t refcount;
+	/* The handle's CPU mappings, owned by drv.c and protected by drv->driver_lock. */
+	struct vma_node *vmas;
+};
+
+struct handle_table_shard {
+	pthread_mutex_t lock;
+	struct handle_table_entry *buckets[HANDLE_TABLE_BUCKETS];
+} __attribute__((aligned(64)));
+
+struct drv_handle_table {
+	struct handle_table_shard shards[HANDLE_TABLE_SHARDS];
+};
+
+struct drv_handle_table *drv_handle_table_create(void)
+{
+	uint32_t i;
+	struct drv_handle_table *table;
+
+	if (posix_memalign((void **)&table, 64, sizeof(*table)))
+		return NULL;
+
+	memset(table, 0, sizeof(*table));
+	for (i = 0; i < HANDLE_TABLE_SHARDS; i++)
+		pthread_mutex_init(&table->shards[i].lock, NULL);
+
+	return table;
+}
+
+void drv_handle_table_destroy(struct drv_handle_table *table)
+{
+	uint32_t i, j;
+
+	for (i = 0; i < HANDLE_TABLE_SHARDS; i++) {
+		for (j = 0; j < HANDLE_TABLE_BUCKETS; j++) {
+			struct handle_table_entry *entry = table->shards[i].buckets[j];
+			while (entry) {
+				struct handle_table_entry *next = entry->next;
+				free(entry);
+				entry = next;
+			}
+		}
+
+		pthread_mutex_destroy(&table->shards[i].lock);
+	}
+
+	free(table);
+}
+
+static struct handle_table_entry **drv_handle_table_bucket(struct drv_handle_table *table,
+							    uint32_t handle)
+{
+	/* GEM handles are small, densely allocated integers. */
+	struct handle_table_shard *shard = &table->shards[handle % HANDLE_TABLE_SHARDS];
+	return &shard->buckets[(handle / HANDLE_TABLE_SHARDS) % HANDLE_TABLE_BUCKETS];
+}
+
+static struct handle_table_entry *drv_handle_table_find(struct drv_handle_table *table,
+							uint32_t handle)
+{
+	struct handle_table_entry *entry;
+
+	entry = __atomic_load_n(drv_handle_table_bucket(table, handle), __ATOMIC_ACQUIRE);
+	while (entry && entry->handle != handle)
+		entry = entry->next;
+
+	return entry;
+}
+
+static struct handle_table_entry *drv_handle_table_get(struct drv_handle_table *table,
+						       uint32_t handle)
+{
+	struct handle_table_shard *shard = &table->shards[handle % HANDLE_TABLE_SHARDS];
+	struct handle_table_entry **bucket = drv_handle_table_bucket(table, handle);
+	struct handle_table_entry *entry = drv_handle_table_find(table, handle);
+
+	if (entry)
+		return entry;
+
+	pthread_mutex_lock(&shard->lock);
+
+	/* Somebody else may have inserted the handle while we were waiting. */
+	entry = drv_handle_table_find(table, handle);
+	if (!entry) {
+		entry = calloc(1, sizeof(*entry));
+		if (entry) {
+			entry->handle = handle;
+			entry->next = *bucket;
+			__atomic_store_n(bucket, entry, __ATOMIC_RELEASE);
+		}
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+	return entry;
+}
+
 uintptr_t drv_get_reference_count(struct driver *drv, struct bo *bo, size_t plane)
 {
-	void *count;
-	uintptr_t num = 0;
+	struct handle_table_entry *entry;
 
-	if (!drmHashLookup(drv->buffer_table, bo->handles[plane].u32, &count))
-		num = (uintptr_t)(count);
+	entry = drv_handle_table_find(drv->buffer_table, bo->handles[plane].u32);
+	return entry ? __atomic_load_n(&entry->refcount, __ATOMIC_ACQUIRE) : 0;
+}
+
+struct vma_node **drv_get_vma_list(struct driver *drv, uint32_t handle)
+{
+	struct handle_table_entry *entry;
 
-	return num;
+	entry = drv_handle_table_find(drv->buffer_table, handle);
+	return entry ? &entry->vmas : NULL;
 }
 
-void drv_increment_reference_count(struct driver *drv, struct bo *bo, size_t plane)
+uintptr_t drv_increment_reference_count(struct driver *drv, struct bo *bo, size_t plane)
 {
-	uintptr_t num = drv_get_reference_count(drv, bo, plane);
+	struct handle_table_entry *entry;
+
+	entry = drv_handle_table_get(drv->buffer_table, bo->handles[plane].u32);
+	if (!entry) {
+		drv_log("Failed to track reference count of handle %u\n", bo->handles[plane].u32);
+		return 0;
+	}
 
-	/* If a value isn't in the table, drmHashDelete is a no-op */
-	drmHashDelete(drv->buffer_table, bo->handles[plane].u32);
-	drmHashInsert(drv->buffer_table, bo->handles[plane].u32, (void *)(num + 1));
+	return __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL);
 }
 
-void drv_decrement_reference_count(struct driver *drv, struct bo *bo, size_t plane)
+uintptr_t drv_increment_live_reference_count(struct driver *drv, struct bo *bo, size_t plane)
 {
-	uintptr_t num = drv_get_reference_count(drv, bo, plane);
+	struct handle_table_entry *entry;
+	uintptr_t num;
+
+	entry = drv_handle_table_find(drv->buffer_table, bo->handles[plane].u32);
+	if (!entry)
+		return 0;
+
+	/* A count of zero means the handle is being, or has been, closed. */
+	num = __atomic_load_n(&entry->refcount, __ATOMIC_ACQUIRE);
+	do {
+		if (num == 0)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&entry->refcount, &num, num + 1, true,
+					      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	return num + 1;
+}
+
+uintptr_t drv_decrement_reference_count(struct driver *drv, struct bo *bo, size_t plane)
+{
+	struct handle_table_entry *entry;
+	uintptr_t num;
+
+	entry = drv_handle_table_find(drv->buffer_table, bo->handles[plane].u32);
+	if (!entry)
+		return 0;
 
-	drmHashDelete(drv->buffer_table, bo->handles[plane].u32);
+	num = __atomic_load_n(&entry->refcount, __ATOMIC_ACQUIRE);
+	do {
+		if (num == 0)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&entry->refcount, &num, num - 1, true,
+					      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
 
-	if (num > 0)
-		drmHashInsert(drv->buffer_table, bo->handles[plane].u32, (void *)(num - 1));
+	return num - 1;
 }
 
 void drv_add_combination(struct driver *drv, const uint32_t format,
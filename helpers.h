@@ -11,6 +11,7 @@
 
 #include "drv.h"
 #include "helpers_array.h"
+#include "helpers_hash.h"
 
 uint32_t drv_height_from_format(uint32_t format, uint32_t height, size_t plane);
 uint32_t drv_vertical_subsampling_from_format(uint32_t format, size_t plane);
@@ -27,11 +28,43 @@ int drv_gem_bo_destroy(struct bo *bo);
 int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data);
 void *drv_dumb_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags);
 int drv_bo_munmap(struct bo *bo, struct vma *vma);
-int drv_mapping_destroy(struct bo *bo);
+/*
+ * Returns the rows of plane that hold rect, or every row of the plane for an empty rect.
+ */
+void drv_bo_get_rect_rows(struct bo *bo, const struct rectangle *rect, size_t plane,
+			  uint32_t *first, uint32_t *count);
+/*
+ * Returns the byte range within a row of plane that holds rect, or the whole row for an empty
+ * rect.
+ */
+void drv_bo_get_rect_bytes(struct bo *bo, const struct rectangle *rect, size_t plane,
+			   uint32_t *offset, uint32_t *size);
+/*
+ * Returns the rows of plane written through mapping since its last flush, as reported with
+ * drv_bo_add_damage(). Without a report, every row of the plane is returned.
+ */
+void drv_bo_get_damaged_rows(struct bo *bo, struct mapping *mapping, size_t plane,
+			     uint32_t *first, uint32_t *count);
 int drv_get_prot(uint32_t map_flags);
+/*
+ * Copy size bytes out of or into write-combined memory, using streaming loads or non-temporal
+ * stores where the CPU has them. The 2D variants copy rows of row_size bytes.
+ */
+void drv_copy_from_wc(void *dst, const void *src, size_t size);
+void drv_copy_to_wc(void *dst, const void *src, size_t size);
+void drv_copy_from_wc_2d(void *dst, uint32_t dst_stride, const void *src, uint32_t src_stride,
+			 uint32_t row_size, uint32_t rows);
+void drv_copy_to_wc_2d(void *dst, uint32_t dst_stride, const void *src, uint32_t src_stride,
+		       uint32_t row_size, uint32_t rows);
+struct drv_handle_table *drv_handle_table_create(void);
+void drv_handle_table_destroy(struct drv_handle_table *table);
 uintptr_t drv_get_reference_count(struct driver *drv, struct bo *bo, size_t plane);
-void drv_increment_reference_count(struct driver *drv, struct bo *bo, size_t plane);
-void drv_decrement_reference_count(struct driver *drv, struct bo *bo, size_t plane);
+/* Head of the handle's VMA list, or NULL if the handle was never referenced. */
+struct vma_node **drv_get_vma_list(struct driver *drv, uint32_t handle);
+uintptr_t drv_increment_reference_count(struct driver *drv, struct bo *bo, size_t plane);
+/* Like drv_increment_reference_count(), but leaves a count of zero alone and returns 0. */
+uintptr_t drv_increment_live_reference_count(struct driver *drv, struct bo *bo, size_t plane);
+uintptr_t drv_decrement_reference_count(struct driver *drv, struct bo *bo, size_t plane);
 void drv_add_combination(struct driver *drv, uint32_t format, struct format_metadata *metadata,
 			 uint64_t usage);
 void drv_add_combinations(struct driver *drv, const uint32_t *formats, uint32_t num_formats,
@@ -11,29 +11,158 @@
 
 #include "util.h"
 
+/*
+ * Items live in slots carved out of chunks that are never moved, so item addresses stay stable.
+ * Each slot is preceded by a header that records its chunk and, while it holds an item, the
+ * slot's current index, which makes removal by address O(1). Free slots are chained per chunk and
+ * reused by later appends. A chunk is freed once all of its slots are free again, except for one
+ * spare, so that an array whose size hovers around a chunk boundary doesn't allocate and free a
+ * chunk on every append and remove.
+ */
+struct drv_array_chunk;
+
+struct drv_array_slot {
+	struct drv_array_chunk *chunk;
+	union {
+		/* The index of the item in the slot, while it holds one. */
+		uint32_t idx;
+		/* The next free slot of the chunk, while it is free. */
+		struct drv_array_slot *next_free;
+	} u;
+} __attribute__((aligned(16)));
+
+struct drv_array_chunk {
+	/* Every chunk of the array. */
+	struct drv_array_chunk *prev;
+	struct drv_array_chunk *next;
+	/* The chunks with free slots. */
+	struct drv_array_chunk *free_prev;
+	struct drv_array_chunk *free_next;
+	struct drv_array_slot *free_slots;
+	uint32_t num_slots;
+	uint32_t num_used;
+} __attribute__((aligned(16)));
+
 struct drv_array {
 	void **items;
 	uint32_t size;
 	uint32_t item_size;
 	uint32_t allocations;
+
+	uint32_t slot_size;
+	uint32_t num_slots;
+	struct drv_array_chunk *chunks;
+	struct drv_array_chunk *free_chunks;
+	/* The chunk without items that is kept instead of freed, if any. */
+	struct drv_array_chunk *spare;
 };
 
+#define DRV_ARRAY_MIN_ALLOCATIONS 8
+
+static struct drv_array_slot *drv_array_slot(void *item)
+{
+	return (struct drv_array_slot *)((uint8_t *)item - sizeof(struct drv_array_slot));
+}
+
+static void *drv_array_slot_item(struct drv_array_slot *slot)
+{
+	return (uint8_t *)slot + sizeof(*slot);
+}
+
+static void drv_array_link_free_chunk(struct drv_array *array, struct drv_array_chunk *chunk)
+{
+	chunk->free_prev = NULL;
+	chunk->free_next = array->free_chunks;
+	if (array->free_chunks)
+		array->free_chunks->free_prev = chunk;
+	array->free_chunks = chunk;
+}
+
+static void drv_array_unlink_free_chunk(struct drv_array *array, struct drv_array_chunk *chunk)
+{
+	if (chunk->free_prev)
+		chunk->free_prev->free_next = chunk->free_next;
+	else
+		array->free_chunks = chunk->free_next;
+
+	if (chunk->free_next)
+		chunk->free_next->free_prev = chunk->free_prev;
+}
+
+static int drv_array_add_chunk(struct drv_array *array)
+{
+	uint32_t i, count;
+	uint8_t *slots;
+	struct drv_array_chunk *chunk;
+
+	/* Chunks double in size, so the number of allocations is logarithmic in the size. */
+	count = MAX(array->num_slots, DRV_ARRAY_MIN_ALLOCATIONS);
+	chunk = calloc(1, sizeof(*chunk) + (size_t)count * array->slot_size);
+	if (!chunk)
+		return -1;
+
+	chunk->num_slots = count;
+	slots = (uint8_t *)(chunk + 1);
+	for (i = count; i > 0; i--) {
+		struct drv_array_slot *slot =
+		    (struct drv_array_slot *)(slots + (size_t)(i - 1) * array->slot_size);
+		slot->chunk = chunk;
+		slot->u.next_free = chunk->free_slots;
+		chunk->free_slots = slot;
+	}
+
+	chunk->next = array->chunks;
+	if (array->chunks)
+		array->chunks->prev = chunk;
+	array->chunks = chunk;
+	drv_array_link_free_chunk(array, chunk);
+	array->num_slots += count;
+	return 0;
+}
+
+static void drv_array_free_chunk(struct drv_array *array, struct drv_array_chunk *chunk)
+{
+	drv_array_unlink_free_chunk(array, chunk);
+
+	if (chunk->prev)
+		chunk->prev->next = chunk->next;
+	else
+		array->chunks = chunk->next;
+
+	if (chunk->next)
+		chunk->next->prev = chunk->prev;
+
+	array->num_slots -= chunk->num_slots;
+	free(chunk);
+}
+
 struct drv_array *drv_array_init(uint32_t item_size)
 {
 	struct drv_array *array;
 
 	array = calloc(1, sizeof(*array));
+	if (!array)
+		return NULL;
 
 	/* Start with a power of 2 number of allocations. */
-	array->allocations = 2;
+	array->allocations = DRV_ARRAY_MIN_ALLOCATIONS;
 	array->items = calloc(array->allocations, sizeof(*array->items));
 	array->item_size = item_size;
+	array->slot_size = ALIGN(sizeof(struct drv_array_slot) + item_size,
+				 sizeof(struct drv_array_slot));
+	if (!array->items) {
+		free(array);
+		return NULL;
+	}
+
 	return array;
 }
 
 void *drv_array_append(struct drv_array *array, void *data)
 {
 	void *item;
+	struct drv_array_slot *slot;
+	struct drv_array_chunk *chunk;
 
 	if (array->size >= array->allocations) {
 		void **new_items = NULL;
@@ -43,7 +172,24 @@ void *drv_array_append(struct drv_array *array, void *data)
 		array->items = new_items;
 	}
 
-	item = calloc(1, array->item_size);
+	if (!array->free_chunks && drv_array_add_chunk(array))
+		return NULL;
+
+	/* Leave the spare alone while other chunks have room, so that it can stay empty. */
+	chunk = array->free_chunks;
+	if (chunk == array->spare && chunk->free_next)
+		chunk = chunk->free_next;
+	else if (chunk == array->spare)
+		array->spare = NULL;
+
+	slot = chunk->free_slots;
+	chunk->free_slots = slot->u.next_free;
+	if (!chunk->free_slots)
+		drv_array_unlink_free_chunk(array, chunk);
+	chunk->num_used++;
+	slot->u.idx = array->size;
+
+	item = drv_array_slot_item(slot);
 	memcpy(item, data, array->item_size);
 	array->items[array->size] = item;
 	array->size++;
@@ -52,27 +198,61 @@ void *drv_array_append(struct drv_array *array, void *data)
 
 void drv_array_remove(struct drv_array *array, uint32_t idx)
 {
-	uint32_t i;
+	struct drv_array_slot *slot;
+	struct drv_array_chunk *chunk;
 
 	assert(array);
 	assert(idx < array->size);
 
-	free(array->items[idx]);
-	array->items[idx] = NULL;
+	slot = drv_array_slot(array->items[idx]);
+	chunk = slot->chunk;
+	if (!chunk->free_slots)
+		drv_array_link_free_chunk(array, chunk);
+	slot->u.next_free = chunk->free_slots;
+	chunk->free_slots = slot;
 
-	for (i = idx + 1; i < array->size; i++)
-		array->items[i - 1] = array->items[i];
+	/* Of two empty chunks, the larger one is kept as the spare. */
+	if (--chunk->num_used == 0) {
+		if (!array->spare) {
+			array->spare = chunk;
+		} else if (array->spare->num_slots < chunk->num_slots) {
+			drv_array_free_chunk(array, array->spare);
+			array->spare = chunk;
+		} else {
+			drv_array_free_chunk(array, chunk);
+		}
+	}
 
+	/* Move the last item into the hole instead of shifting everything down. */
 	array->size--;
-	if ((DIV_ROUND_UP(array->allocations, 2) > array->size) && array->allocations > 2) {
+	if (idx != array->size) {
+		array->items[idx] = array->items[array->size];
+		drv_array_slot(array->items[idx])->u.idx = idx;
+	}
+	array->items[array->size] = NULL;
+
+	/*
+	 * Only shrink once the array is a quarter full, so that a workload that keeps adding and
+	 * removing around a power of 2 doesn't realloc every time.
+	 */
+	if (array->size < array->allocations / 4 &&
+	    array->allocations > DRV_ARRAY_MIN_ALLOCATIONS) {
 		void **new_items = NULL;
-		array->allocations = DIV_ROUND_UP(array->allocations, 2);
+		array->allocations /= 2;
 		new_items = realloc(array->items, array->allocations * sizeof(*array->items));
 		assert(new_items);
 		array->items = new_items;
 	}
 }
 
+void drv_array_remove_item(struct drv_array *array, void *item)
+{
+	uint32_t idx = drv_array_slot(item)->u.idx;
+
+	assert(idx < array->size && array->items[idx] == item);
+	drv_array_remove(array, idx);
+}
+
 void *drv_array_at_idx(struct drv_array *array, uint32_t idx)
 {
 	assert(idx < array->size);
@@ -86,10 +266,12 @@ uint32_t drv_array_size(struct drv_array *array)
 
 void drv_array_destroy(struct drv_array *array)
 {
-	uint32_t i;
+	struct drv_array_chunk *chunk, *next;
 
-	for (i = 0; i < array->size; i++)
-		free(array->items[i]);
+	for (chunk = array->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
 
 	free(array->items);
 	free(array);
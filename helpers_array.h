@@ -11,9 +11,15 @@ struct drv_array *drv_array_init(uint32_t item_size);
 /* The data will be copied and appended to the array. */
 void *drv_array_append(struct drv_array *array, void *data);
 
-/* The data at the specified index will be freed -- the array will shrink. */
+/*
+ * The data at the specified index will be freed -- the last item takes its place, so the order of
+ * the remaining items is not preserved. Addresses of the remaining items do not change.
+ */
 void drv_array_remove(struct drv_array *array, uint32_t idx);
 
+/* Same as drv_array_remove(), for an item previously returned by this array. */
+void drv_array_remove_item(struct drv_array *array, void *item);
+
 void *drv_array_at_idx(struct drv_array *array, uint32_t idx);
 
 uint32_t drv_array_size(struct drv_array *array);
@@ -0,0 +1,196 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "helpers_hash.h"
+
+struct drv_hash_node {
+	struct drv_hash_node *next;
+	uint64_t hash;
+	void *value;
+	uint8_t key[];
+};
+
+struct drv_hash {
+	struct drv_hash_node **buckets;
+	uint32_t num_buckets;
+	uint32_t size;
+	uint32_t key_size;
+};
+
+/* FNV-1a is plenty for the short, fixed-size keys used in minigbm. */
+static uint64_t drv_hash_key(const void *key, uint32_t key_size)
+{
+	const uint8_t *bytes = key;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	uint32_t i;
+
+	for (i = 0; i < key_size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+static struct drv_hash_node **drv_hash_find(struct drv_hash *hash, const void *key, uint64_t h)
+{
+	struct drv_hash_node **node = &hash->buckets[h & (hash->num_buckets - 1)];
+
+	while (*node) {
+		if ((*node)->hash == h && !memcmp((*node)->key, key, hash->key_size))
+			break;
+		node = &(*node)->next;
+	}
+
+	return node;
+}
+
+static int drv_hash_grow(struct drv_hash *hash)
+{
+	uint32_t i, num_buckets = hash->num_buckets * 2;
+	struct drv_hash_node **buckets;
+
+	buckets = calloc(num_buckets, sizeof(*buckets));
+	if (!buckets)
+		return -1;
+
+	for (i = 0; i < hash->num_buckets; i++) {
+		struct drv_hash_node *node = hash->buckets[i];
+		while (node) {
+			struct drv_hash_node *next = node->next;
+			uint32_t idx = node->hash & (num_buckets - 1);
+			node->next = buckets[idx];
+			buckets[idx] = node;
+			node = next;
+		}
+	}
+
+	free(hash->buckets);
+	hash->buckets = buckets;
+	hash->num_buckets = num_buckets;
+	return 0;
+}
+
+struct drv_hash *drv_hash_init(uint32_t key_size)
+{
+	struct drv_hash *hash;
+
+	hash = calloc(1, sizeof(*hash));
+	if (!hash)
+		return NULL;
+
+	/* Start with a power of 2 number of buckets. */
+	hash->num_buckets = 16;
+	hash->key_size = key_size;
+	hash->buckets = calloc(hash->num_buckets, sizeof(*hash->buckets));
+	if (!hash->buckets) {
+		free(hash);
+		return NULL;
+	}
+
+	return hash;
+}
+
+int drv_hash_lookup(struct drv_hash *hash, const void *key, void **value)
+{
+	struct drv_hash_node *node = *drv_hash_find(hash, key, drv_hash_key(key, hash->key_size));
+
+	if (!node)
+		return -1;
+
+	*value = node->value;
+	return 0;
+}
+
+int drv_hash_insert(struct drv_hash *hash, const void *key, void *value)
+{
+	uint64_t h = drv_hash_key(key, hash->key_size);
+	struct drv_hash_node **slot = drv_hash_find(hash, key, h);
+	struct drv_hash_node *node = *slot;
+
+	if (node) {
+		node->value = value;
+		return 0;
+	}
+
+	node = malloc(sizeof(*node) + hash->key_size);
+	if (!node)
+		return -1;
+
+	node->hash = h;
+	node->value = value;
+	memcpy(node->key, key, hash->key_size);
+	node->next = NULL;
+	*slot = node;
+	hash->size++;
+
+	/* Keep the load factor at or below one; a failed grow only costs longer chains. */
+	if (hash->size > hash->num_buckets)
+		drv_hash_grow(hash);
+
+	return 0;
+}
+
+int drv_hash_remove(struct drv_hash *hash, const void *key)
+{
+	struct drv_hash_node **slot = drv_hash_find(hash, key, drv_hash_key(key, hash->key_size));
+	struct drv_hash_node *node = *slot;
+
+	if (!node)
+		return -1;
+
+	*slot = node->next;
+	free(node);
+	hash->size--;
+	return 0;
+}
+
+uint32_t drv_hash_size(struct drv_hash *hash)
+{
+	return hash->size;
+}
+
+int drv_hash_for_each(struct drv_hash *hash,
+		      int (*fn)(const void *key, void *value, void *data), void *data)
+{
+	uint32_t i;
+	int ret;
+
+	for (i = 0; i < hash->num_buckets; i++) {
+		struct drv_hash_node *node = hash->buckets[i];
+		while (node) {
+			/* fn may free the current node. */
+			struct drv_hash_node *next = node->next;
+			ret = fn(node->key, node->value, data);
+			if (ret)
+				return ret;
+			node = next;
+		}
+	}
+
+	return 0;
+}
+
+void drv_hash_destroy(struct drv_hash *hash)
+{
+	uint32_t i;
+
+	for (i = 0; i < hash->num_buckets; i++) {
+		struct drv_hash_node *node = hash->buckets[i];
+		while (node) {
+			struct drv_hash_node *next = node->next;
+			free(node);
+			node = next;
+		}
+	}
+
+	free(hash->buckets);
+	free(hash);
+}
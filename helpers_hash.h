@@ -0,0 +1,38 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef HELPERS_HASH_H
+#define HELPERS_HASH_H
+
+#include <stdint.h>
+
+struct drv_hash;
+
+/* Keys are opaque blobs of key_size bytes that are hashed and compared bytewise. */
+struct drv_hash *drv_hash_init(uint32_t key_size);
+
+/* Returns 0 and stores the associated value if the key is present, -1 otherwise. */
+int drv_hash_lookup(struct drv_hash *hash, const void *key, void **value);
+
+/* The key will be copied. An existing value for the same key is replaced. */
+int drv_hash_insert(struct drv_hash *hash, const void *key, void *value);
+
+/* Returns 0 if the key was removed, -1 if it wasn't present. */
+int drv_hash_remove(struct drv_hash *hash, const void *key);
+
+uint32_t drv_hash_size(struct drv_hash *hash);
+
+/*
+ * Calls fn for every entry. The callback may remove the entry it is called for, but no other
+ * entries. Iteration stops early if fn returns non-zero, and that value is returned.
+ */
+int drv_hash_for_each(struct drv_hash *hash,
+		      int (*fn)(const void *key, void *value, void *data), void *data);
+
+/* The table is freed. Values are owned by the caller and are not touched. */
+void drv_hash_destroy(struct drv_hash *hash);
+
+#endif
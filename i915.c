@@ -10,6 +10,7 @@
 #include <cpuid.h>
 #include <errno.h>
 #include <i915_drm.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -28,6 +29,37 @@
 #define I915_CACHELINE_SIZE 64
 #define I915_CACHELINE_MASK (I915_CACHELINE_SIZE - 1)
 
+/* Ranges at least this large are flushed from two threads. */
+#define I915_FLUSH_SPLIT_SIZE (16 * 1024 * 1024)
+
+/* X tiles are 512 bytes by 8 rows, Y tiles 128 bytes by 32 rows. Both take a page. */
+#define I915_TILE_SIZE 4096
+#define I915_Y_TILE_COLUMN_WIDTH 16
+
+/* CPUID.(EAX=7, ECX=0):EBX feature bits. */
+#define I915_CPUID_CLFLUSHOPT (1 << 23)
+#define I915_CPUID_CLWB (1 << 24)
+
+typedef void (*i915_flush_lines_fn)(uint8_t *p, uint8_t *end);
+
+/*
+ * Thread that flushes the upper half of large ranges. It is started by the first such flush and
+ * takes one range at a time; jobs are numbered so that a caller waits for its own job only.
+ */
+struct i915_flush_worker {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	pthread_t thread;
+	bool started;
+	bool stop;
+	i915_flush_lines_fn flush_lines;
+	uint8_t *start;
+	uint8_t *end;
+	uint64_t submitted;
+	uint64_t completed;
+};
+
 static const uint32_t scanout_render_formats[] = { DRM_FORMAT_ABGR2101010, DRM_FORMAT_ABGR8888,
 						   DRM_FORMAT_ARGB2101010, DRM_FORMAT_ARGB8888,
 						   DRM_FORMAT_RGB565,	   DRM_FORMAT_XBGR2101010,
@@ -53,6 +85,14 @@ struct i915_device {
 #endif
 	int device_id;
 	bool is_adlp;
+	/* Cache line write-back used by flushes on non-LLC parts, picked by CPUID at init. */
+	i915_flush_lines_fn flush_lines;
+	struct i915_flush_worker flush_worker;
+	/*
+	 * Bit 6 swizzling of X and Y tiled objects. It is the same for all objects of a tiling
+	 * mode, and is taken from the first one created or imported.
+	 */
+	uint32_t swizzle_modes[I915_TILING_Y + 1];
 };
 
 static void i915_info_from_device_id(struct i915_device *i915)
@@ -295,16 +335,168 @@ static int i915_align_dimensions(struct bo *bo, uint32_t tiling, uint32_t *strid
 	return 0;
 }
 
-static void i915_clflush(void *start, size_t size)
+/*
+ * Non-LLC parts don't snoop the CPU caches, so CPU writes must reach memory before the GPU reads
+ * them. clflush is ordered against other stores but retires slowly. clflushopt and clwb are
+ * weakly ordered and need a trailing sfence, and clwb also leaves the lines cached. That is safe
+ * because CPU reads after GPU writes go through SET_DOMAIN, which has the kernel clflush the
+ * object first.
+ */
+static void i915_clflush_lines(uint8_t *p, uint8_t *end)
 {
-	void *p = (void *)(((uintptr_t)start) & ~I915_CACHELINE_MASK);
-	void *end = (void *)((uintptr_t)start + size);
-
-	__builtin_ia32_mfence();
-	while (p < end) {
+	for (; p < end; p += I915_CACHELINE_SIZE)
 		__builtin_ia32_clflush(p);
-		p = (void *)((uintptr_t)p + I915_CACHELINE_SIZE);
+}
+
+__attribute__((target("clflushopt"))) static void i915_clflushopt_lines(uint8_t *p, uint8_t *end)
+{
+	for (; p < end; p += I915_CACHELINE_SIZE)
+		__builtin_ia32_clflushopt(p);
+	__builtin_ia32_sfence();
+}
+
+__attribute__((target("clwb"))) static void i915_clwb_lines(uint8_t *p, uint8_t *end)
+{
+	for (; p < end; p += I915_CACHELINE_SIZE)
+		__builtin_ia32_clwb(p);
+	__builtin_ia32_sfence();
+}
+
+static i915_flush_lines_fn i915_select_flush_lines(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return i915_clflush_lines;
+
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	if (ebx & I915_CPUID_CLWB)
+		return i915_clwb_lines;
+	if (ebx & I915_CPUID_CLFLUSHOPT)
+		return i915_clflushopt_lines;
+
+	return i915_clflush_lines;
+}
+
+static void *i915_flush_worker_main(void *arg)
+{
+	struct i915_flush_worker *worker = arg;
+
+	pthread_mutex_lock(&worker->lock);
+	while (true) {
+		while (worker->completed == worker->submitted && !worker->stop)
+			pthread_cond_wait(&worker->work, &worker->lock);
+
+		if (worker->stop)
+			break;
+
+		pthread_mutex_unlock(&worker->lock);
+		worker->flush_lines(worker->start, worker->end);
+		pthread_mutex_lock(&worker->lock);
+
+		worker->completed++;
+		pthread_cond_broadcast(&worker->done);
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	return NULL;
+}
+
+static int i915_flush_worker_init(struct i915_flush_worker *worker, i915_flush_lines_fn flush_lines)
+{
+	if (pthread_mutex_init(&worker->lock, NULL))
+		return -ENOMEM;
+
+	if (pthread_cond_init(&worker->work, NULL))
+		goto destroy_lock;
+
+	if (pthread_cond_init(&worker->done, NULL))
+		goto destroy_work;
+
+	worker->flush_lines = flush_lines;
+	return 0;
+
+destroy_work:
+	pthread_cond_destroy(&worker->work);
+destroy_lock:
+	pthread_mutex_destroy(&worker->lock);
+	return -ENOMEM;
+}
+
+static void i915_flush_worker_fini(struct i915_flush_worker *worker)
+{
+	pthread_mutex_lock(&worker->lock);
+	worker->stop = true;
+	pthread_cond_signal(&worker->work);
+	pthread_mutex_unlock(&worker->lock);
+
+	if (worker->started)
+		pthread_join(worker->thread, NULL);
+
+	pthread_cond_destroy(&worker->done);
+	pthread_cond_destroy(&worker->work);
+	pthread_mutex_destroy(&worker->lock);
+}
+
+/*
+ * Hands [start, end) to the worker and returns the job's number, or 0 if the worker is busy with
+ * another caller's range or can't be started.
+ */
+static uint64_t i915_flush_worker_submit(struct i915_flush_worker *worker, uint8_t *start,
+					 uint8_t *end)
+{
+	uint64_t job = 0;
+
+	pthread_mutex_lock(&worker->lock);
+	if (!worker->started) {
+		if (pthread_create(&worker->thread, NULL, i915_flush_worker_main, worker))
+			goto out;
+		worker->started = true;
+	}
+
+	if (worker->completed != worker->submitted)
+		goto out;
+
+	worker->start = start;
+	worker->end = end;
+	job = ++worker->submitted;
+	pthread_cond_signal(&worker->work);
+
+out:
+	pthread_mutex_unlock(&worker->lock);
+	return job;
+}
+
+static void i915_flush_worker_wait(struct i915_flush_worker *worker, uint64_t job)
+{
+	pthread_mutex_lock(&worker->lock);
+	while (worker->completed < job)
+		pthread_cond_wait(&worker->done, &worker->lock);
+	pthread_mutex_unlock(&worker->lock);
+}
+
+static void i915_clflush(struct i915_device *i915, void *start, size_t size)
+{
+	uint8_t *p = (uint8_t *)((uintptr_t)start & ~I915_CACHELINE_MASK);
+	uint8_t *end = (uint8_t *)start + size;
+	uint8_t *middle;
+	uint64_t job;
+
+	/*
+	 * A single core can't saturate memory with write-backs, so large ranges hand their upper
+	 * half to the worker. Waiting for the job orders its flushes before our return.
+	 */
+	if (size >= I915_FLUSH_SPLIT_SIZE) {
+		middle = p + ALIGN((size_t)(end - p) / 2, I915_CACHELINE_SIZE);
+		job = i915_flush_worker_submit(&i915->flush_worker, middle, end);
+		if (job) {
+			i915->flush_lines(p, middle);
+			i915_flush_worker_wait(&i915->flush_worker, job);
+			return;
+		}
 	}
+
+	i915->flush_lines(p, end);
 }
 
 static int i915_init(struct driver *drv)
@@ -317,6 +509,9 @@ static int i915_init(struct driver *drv)
 	if (!i915)
 		return -ENOMEM;
 
+	for (size_t i = 0; i < ARRAY_SIZE(i915->swizzle_modes); i++)
+		i915->swizzle_modes[i] = I915_BIT_6_SWIZZLE_UNKNOWN;
+
 	memset(&get_param, 0, sizeof(get_param));
 	get_param.param = I915_PARAM_CHIPSET_ID;
 	get_param.value = &i915->device_id;
@@ -340,6 +535,13 @@ static int i915_init(struct driver *drv)
 		return -EINVAL;
 	}
 
+	i915->flush_lines = i915_select_flush_lines();
+	ret = i915_flush_worker_init(&i915->flush_worker, i915->flush_lines);
+	if (ret) {
+		free(i915);
+		return ret;
+	}
+
 	drv->priv = i915;
 
 #ifdef USE_GRALLOC1
@@ -476,6 +678,12 @@ static int i915_bo_compute_metadata(struct bo *bo, uint32_t width, uint32_t heig
 	return 0;
 }
 
+static void i915_set_swizzle_mode(struct i915_device *i915, uint32_t tiling, uint32_t swizzle_mode)
+{
+	if (tiling < ARRAY_SIZE(i915->swizzle_modes))
+		__atomic_store_n(&i915->swizzle_modes[tiling], swizzle_mode, __ATOMIC_RELAXED);
+}
+
 static int i915_bo_create_from_metadata(struct bo *bo)
 {
 	int ret;
@@ -511,15 +719,38 @@ static int i915_bo_create_from_metadata(struct bo *bo)
 		return -errno;
 	}
 
+	i915_set_swizzle_mode(bo->drv->priv, gem_set_tiling.tiling_mode,
+			      gem_set_tiling.swizzle_mode);
 	return 0;
 }
 
 static void i915_close(struct driver *drv)
 {
+	struct i915_device *i915 = drv->priv;
+
+	i915_flush_worker_fini(&i915->flush_worker);
 	free(drv->priv);
 	drv->priv = NULL;
 }
 
+static int i915_bo_set_purgeable(struct bo *bo, bool purgeable)
+{
+	int ret;
+	struct drm_i915_gem_madvise gem_madvise;
+
+	memset(&gem_madvise, 0, sizeof(gem_madvise));
+	gem_madvise.handle = bo->handles[0].u32;
+	gem_madvise.madv = purgeable ? I915_MADV_DONTNEED : I915_MADV_WILLNEED;
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_MADVISE, &gem_madvise);
+	if (ret) {
+		drv_log("DRM_IOCTL_I915_GEM_MADVISE failed with %d\n", errno);
+		return -errno;
+	}
+
+	return gem_madvise.retained ? 1 : 0;
+}
+
 static int i915_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 {
 	int ret;
@@ -541,9 +772,168 @@ static int i915_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 	}
 
 	bo->meta.tiling = gem_get_tiling.tiling_mode;
+	i915_set_swizzle_mode(bo->drv->priv, gem_get_tiling.tiling_mode,
+			      gem_get_tiling.swizzle_mode);
 	return 0;
 }
 
+/*
+ * X and Y tiled buffers without bit 6 swizzling can be mapped through a linear shadow copy instead
+ * of the GTT. The shadow has the buffer's strides and offsets. Invalidation detiles the rows of the
+ * mapping's rectangle into it, and flushes retile the damaged rows, or the mapping's rows when no
+ * damage was reported.
+ */
+struct i915_shadow {
+	/* Cached CPU mapping of the tiled object. */
+	uint8_t *tiled;
+	/*
+	 * Rows [first, end) of each plane hold detiled data. All mappings of the vma share the
+	 * shadow, so the range grows with each invalidation, and flushes never retile rows outside
+	 * of it.
+	 */
+	uint32_t first[DRV_MAX_PLANES];
+	uint32_t end[DRV_MAX_PLANES];
+};
+
+static bool i915_bo_can_shadow(struct bo *bo)
+{
+	struct i915_device *i915 = bo->drv->priv;
+
+	if (bo->meta.tiling != I915_TILING_X && bo->meta.tiling != I915_TILING_Y)
+		return false;
+
+	/* With bit 6 swizzling the layout depends on physical addresses, only the GTT hides it. */
+	return __atomic_load_n(&i915->swizzle_modes[bo->meta.tiling], __ATOMIC_RELAXED) ==
+	       I915_BIT_6_SWIZZLE_NONE;
+}
+
+static inline void i915_tile_copy(uint8_t *tiled, uint8_t *linear, size_t size, bool detile)
+{
+	if (detile)
+		memcpy(linear, tiled, size);
+	else
+		memcpy(tiled, linear, size);
+}
+
+/* Copies rows [first, first + count) of plane between the tiled object and the shadow. */
+static void i915_transfer_tiled_rows(struct bo *bo, size_t plane, uint8_t *tiled, uint8_t *linear,
+				     uint32_t first, uint32_t count, bool detile)
+{
+	uint32_t y, tx, c, tile_width, tile_height, tiles_x;
+	uint32_t stride = bo->meta.strides[plane];
+	uint8_t *tile_row, *row;
+
+	tile_width = bo->meta.tiling == I915_TILING_X ? 512 : 128;
+	tile_height = I915_TILE_SIZE / tile_width;
+	tiles_x = stride / tile_width;
+
+	tiled += bo->meta.offsets[plane];
+	linear += bo->meta.offsets[plane];
+
+	/*
+	 * An X tile row is contiguous. A Y tile row is spread over eight 16 byte columns, each of
+	 * which holds that column of all 32 rows. The constant sizes let the compiler use vector
+	 * loads and stores.
+	 */
+	for (y = first; y < first + count; y++) {
+		row = linear + (size_t)y * stride;
+		tile_row = tiled + (size_t)(y / tile_height) * tiles_x * I915_TILE_SIZE;
+
+		if (bo->meta.tiling == I915_TILING_X) {
+			tile_row += (y % tile_height) * tile_width;
+			for (tx = 0; tx < tiles_x; tx++)
+				i915_tile_copy(tile_row + (size_t)tx * I915_TILE_SIZE,
+					       row + tx * 512, 512, detile);
+			continue;
+		}
+
+		tile_row += (y % tile_height) * I915_Y_TILE_COLUMN_WIDTH;
+		for (tx = 0; tx < tiles_x; tx++)
+			for (c = 0; c < 128 / I915_Y_TILE_COLUMN_WIDTH; c++)
+				i915_tile_copy(tile_row + (size_t)tx * I915_TILE_SIZE +
+						   c * tile_height * I915_Y_TILE_COLUMN_WIDTH,
+					       row + tx * 128 + c * I915_Y_TILE_COLUMN_WIDTH,
+					       I915_Y_TILE_COLUMN_WIDTH, detile);
+	}
+}
+
+/* Detiles rows [first, end) of plane, along with any gap to the rows detiled before. */
+static void i915_shadow_detile(struct bo *bo, struct vma *vma, size_t plane, uint32_t first,
+			       uint32_t end)
+{
+	struct i915_shadow *shadow = vma->priv;
+
+	if (first == end)
+		return;
+
+	if (shadow->first[plane] != shadow->end[plane]) {
+		end = MAX(end, shadow->first[plane]);
+		first = MIN(first, shadow->end[plane]);
+	}
+
+	i915_transfer_tiled_rows(bo, plane, shadow->tiled, vma->addr, first, end - first, true);
+
+	if (shadow->first[plane] == shadow->end[plane]) {
+		shadow->first[plane] = first;
+		shadow->end[plane] = end;
+	} else {
+		shadow->first[plane] = MIN(first, shadow->first[plane]);
+		shadow->end[plane] = MAX(end, shadow->end[plane]);
+	}
+}
+
+static void *i915_bo_map_shadow(struct bo *bo, struct vma *vma)
+{
+	int ret;
+	void *linear;
+	struct i915_shadow *shadow;
+	struct drm_i915_gem_mmap gem_map;
+
+	/* Software only ever touches the shadow, so the object itself is always mapped writable. */
+	memset(&gem_map, 0, sizeof(gem_map));
+	gem_map.handle = bo->handles[0].u32;
+	gem_map.size = bo->meta.total_size;
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_MMAP, &gem_map);
+	if (ret) {
+		drv_log("DRM_IOCTL_I915_GEM_MMAP failed\n");
+		return MAP_FAILED;
+	}
+
+	linear = mmap(0, bo->meta.total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		      -1, 0);
+	if (linear == MAP_FAILED)
+		goto unmap_tiled;
+
+	shadow = calloc(1, sizeof(*shadow));
+	if (!shadow)
+		goto unmap_linear;
+
+	shadow->tiled = (uint8_t *)(uintptr_t)gem_map.addr_ptr;
+	vma->priv = shadow;
+	vma->length = bo->meta.total_size;
+	return linear;
+
+unmap_linear:
+	munmap(linear, bo->meta.total_size);
+unmap_tiled:
+	munmap((void *)(uintptr_t)gem_map.addr_ptr, bo->meta.total_size);
+	return MAP_FAILED;
+}
+
+static int i915_bo_unmap(struct bo *bo, struct vma *vma)
+{
+	struct i915_shadow *shadow = vma->priv;
+
+	if (shadow) {
+		munmap(shadow->tiled, vma->length);
+		free(shadow);
+		vma->priv = NULL;
+	}
+
+	return munmap(vma->addr, vma->length);
+}
+
 static void *i915_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
 	int ret;
@@ -580,6 +970,8 @@ static void *i915_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t
 		}
 
 		addr = (void *)(uintptr_t)gem_map.addr_ptr;
+	} else if (i915_bo_can_shadow(bo)) {
+		addr = i915_bo_map_shadow(bo, vma);
 	} else {
 		struct drm_i915_gem_mmap_gtt gem_map;
 		memset(&gem_map, 0, sizeof(gem_map));
@@ -628,9 +1020,13 @@ static int i915_bo_invalidate(struct bo *bo, struct mapping *mapping)
 	int ret;
 	struct drm_i915_gem_set_domain set_domain;
 
+	size_t plane;
+	uint32_t first, count;
+	struct i915_shadow *shadow = mapping->vma->priv;
+
 	memset(&set_domain, 0, sizeof(set_domain));
 	set_domain.handle = bo->handles[0].u32;
-	if (bo->meta.tiling == I915_TILING_NONE) {
+	if (bo->meta.tiling == I915_TILING_NONE || shadow) {
 		set_domain.read_domains = I915_GEM_DOMAIN_CPU;
 		if (mapping->vma->map_flags & BO_MAP_WRITE)
 			set_domain.write_domain = I915_GEM_DOMAIN_CPU;
@@ -646,14 +1042,74 @@ static int i915_bo_invalidate(struct bo *bo, struct mapping *mapping)
 		return ret;
 	}
 
+	if (shadow) {
+		for (plane = 0; plane < bo->meta.num_planes; plane++) {
+			drv_bo_get_rect_rows(bo, &mapping->rect, plane, &first, &count);
+			i915_shadow_detile(bo, mapping->vma, plane, first, first + count);
+		}
+	}
+
+	return 0;
+}
+
+static int i915_bo_flush_shadow(struct bo *bo, struct mapping *mapping)
+{
+	size_t plane;
+	uint32_t first, count, end, tile_height;
+	struct i915_device *i915 = bo->drv->priv;
+	struct i915_shadow *shadow = mapping->vma->priv;
+	const struct rectangle *rect = &mapping->rect;
+
+	if (!(mapping->vma->map_flags & BO_MAP_WRITE))
+		return 0;
+
+	if (mapping->damage.width && mapping->damage.height)
+		rect = &mapping->damage;
+
+	tile_height = bo->meta.tiling == I915_TILING_X ? 8 : 32;
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		/* Rows that were never detiled don't hold the buffer's contents. */
+		drv_bo_get_rect_rows(bo, rect, plane, &first, &count);
+		end = MIN(first + count, shadow->end[plane]);
+		first = MAX(first, shadow->first[plane]);
+		count = end > first ? end - first : 0;
+		i915_transfer_tiled_rows(bo, plane, shadow->tiled, mapping->vma->addr, first,
+					 count, false);
+		if (i915->has_llc || !count)
+			continue;
+
+		/* Whole tile rows are written back, since a tile row holds the rows interleaved. */
+		end = ALIGN(first + count, tile_height);
+		first = first / tile_height * tile_height;
+		count = end - first;
+		__builtin_ia32_mfence();
+		i915_clflush(i915, shadow->tiled + bo->meta.offsets[plane] +
+				       (size_t)first * bo->meta.strides[plane],
+			     (size_t)count * bo->meta.strides[plane]);
+	}
+
 	return 0;
 }
 
 static int i915_bo_flush(struct bo *bo, struct mapping *mapping)
 {
+	size_t plane;
+	uint32_t first, count;
+	uint8_t *addr = mapping->vma->addr;
 	struct i915_device *i915 = bo->drv->priv;
-	if (!i915->has_llc && bo->meta.tiling == I915_TILING_NONE)
-		i915_clflush(mapping->vma->addr, mapping->vma->length);
+
+	if (mapping->vma->priv)
+		return i915_bo_flush_shadow(bo, mapping);
+
+	if (i915->has_llc || bo->meta.tiling != I915_TILING_NONE)
+		return 0;
+
+	__builtin_ia32_mfence();
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		drv_bo_get_damaged_rows(bo, mapping, plane, &first, &count);
+		i915_clflush(i915, addr + bo->meta.offsets[plane] + first * bo->meta.strides[plane],
+			     count * bo->meta.strides[plane]);
+	}
 
 	return 0;
 }
@@ -698,10 +1154,11 @@ const struct backend backend_i915 = {
 	.bo_destroy = drv_gem_bo_destroy,
 	.bo_import = i915_bo_import,
 	.bo_map = i915_bo_map,
-	.bo_unmap = drv_bo_munmap,
+	.bo_unmap = i915_bo_unmap,
 	.bo_invalidate = i915_bo_invalidate,
 	.bo_flush = i915_bo_flush,
 	.resolve_format = i915_resolve_format,
+	.bo_set_purgeable = i915_bo_set_purgeable,
 };
 
 #endif
@@ -25,6 +25,9 @@
 
 #define TILE_TYPE_LINEAR 0
 
+/* How long invalidation waits for pending device access before giving up on it. */
+#define MEDIATEK_POLL_TIMEOUT_MS 1000
+
 struct mediatek_private_map_data {
 	void *cached_addr;
 	void *gem_addr;
@@ -163,6 +166,15 @@ static int mediatek_bo_create(struct bo *bo, uint32_t width, uint32_t height, ui
 						 ARRAY_SIZE(modifiers));
 }
 
+static int mediatek_bo_destroy(struct bo *bo)
+{
+	/* A shadow kept from an earlier mapping, see mediatek_bo_unmap(). */
+	free(bo->priv);
+	bo->priv = NULL;
+
+	return drv_gem_bo_destroy(bo);
+}
+
 static void *mediatek_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
 	int ret, prime_fd;
@@ -194,7 +206,12 @@ static void *mediatek_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint3
 	vma->priv = priv;
 
 	if (bo->meta.use_flags & BO_USE_RENDERSCRIPT) {
-		priv->cached_addr = calloc(1, bo->meta.total_size);
+		/*
+		 * Invalidation fills in the rows that are mapped. A new shadow is cleared anyway,
+		 * since an invalidate that times out leaves it untouched.
+		 */
+		priv->cached_addr = bo->priv ? bo->priv : calloc(1, bo->meta.total_size);
+		bo->priv = NULL;
 		priv->gem_addr = addr;
 		addr = priv->cached_addr;
 	}
@@ -209,7 +226,11 @@ static int mediatek_bo_unmap(struct bo *bo, struct vma *vma)
 
 		if (priv->cached_addr) {
 			vma->addr = priv->gem_addr;
-			free(priv->cached_addr);
+			/* RenderScript maps buffers over and over, keep one shadow for the next map. */
+			if (!bo->priv)
+				bo->priv = priv->cached_addr;
+			else
+				free(priv->cached_addr);
 		}
 
 		close(priv->prime_fd);
@@ -222,6 +243,9 @@ static int mediatek_bo_unmap(struct bo *bo, struct vma *vma)
 
 static int mediatek_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
+	int ret;
+	size_t plane;
+	uint32_t first, count, offset, size, stride;
 	struct mediatek_private_map_data *priv = mapping->vma->priv;
 
 	if (priv) {
@@ -235,12 +259,34 @@ static int mediatek_bo_invalidate(struct bo *bo, struct mapping *mapping)
 		if (mapping->vma->map_flags & BO_MAP_READ)
 			fds.events |= POLLIN;
 
-		poll(&fds, 1, -1);
-		if (fds.revents != fds.events)
+		do {
+			ret = poll(&fds, 1, MEDIATEK_POLL_TIMEOUT_MS);
+		} while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+		/* The device may still be writing, so the shadow is left as it is. */
+		if (ret == 0) {
+			drv_log("Timed out waiting for prime_fd\n");
+			return -ETIMEDOUT;
+		} else if (ret < 0) {
+			drv_log("poll prime_fd failed with %s\n", strerror(errno));
+			return -errno;
+		} else if (fds.revents != fds.events) {
 			drv_log("poll prime_fd failed\n");
+		}
 
-		if (priv->cached_addr)
-			memcpy(priv->cached_addr, priv->gem_addr, bo->meta.total_size);
+		if (!priv->cached_addr)
+			return 0;
+
+		/* Only the part the mapping covers is read back from the uncached buffer. */
+		for (plane = 0; plane < bo->meta.num_planes; plane++) {
+			drv_bo_get_rect_rows(bo, &mapping->rect, plane, &first, &count);
+			drv_bo_get_rect_bytes(bo, &mapping->rect, plane, &offset, &size);
+			stride = bo->meta.strides[plane];
+			offset += bo->meta.offsets[plane] + first * stride;
+			drv_copy_from_wc_2d((uint8_t *)priv->cached_addr + offset, stride,
+					    (uint8_t *)priv->gem_addr + offset, stride, size,
+					    count);
+		}
 	}
 
 	return 0;
@@ -248,9 +294,29 @@ static int mediatek_bo_invalidate(struct bo *bo, struct mapping *mapping)
 
 static int mediatek_bo_flush(struct bo *bo, struct mapping *mapping)
 {
+	size_t plane;
+	uint32_t first, count, offset, size, stride;
 	struct mediatek_private_map_data *priv = mapping->vma->priv;
-	if (priv && priv->cached_addr && (mapping->vma->map_flags & BO_MAP_WRITE))
-		memcpy(priv->gem_addr, priv->cached_addr, bo->meta.total_size);
+	const struct rectangle *rect = &mapping->rect;
+
+	if (!priv || !priv->cached_addr || !(mapping->vma->map_flags & BO_MAP_WRITE))
+		return 0;
+
+	/*
+	 * Rows outside the mapping were never read into the shadow, so without reported damage
+	 * only the mapping's rows are written back.
+	 */
+	if (mapping->damage.width && mapping->damage.height)
+		rect = &mapping->damage;
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		drv_bo_get_rect_rows(bo, rect, plane, &first, &count);
+		drv_bo_get_rect_bytes(bo, rect, plane, &offset, &size);
+		stride = bo->meta.strides[plane];
+		offset += bo->meta.offsets[plane] + first * stride;
+		drv_copy_to_wc_2d((uint8_t *)priv->gem_addr + offset, stride,
+				  (uint8_t *)priv->cached_addr + offset, stride, size, count);
+	}
 
 	return 0;
 }
@@ -291,7 +357,7 @@ const struct backend backend_mediatek = {
 	.init = mediatek_init,
 	.bo_create = mediatek_bo_create,
 	.bo_create_with_modifiers = mediatek_bo_create_with_modifiers,
-	.bo_destroy = drv_gem_bo_destroy,
+	.bo_destroy = mediatek_bo_destroy,
 	.bo_import = drv_prime_bo_import,
 	.bo_map = mediatek_bo_map,
 	.bo_unmap = mediatek_bo_unmap,
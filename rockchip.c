@@ -235,9 +235,21 @@ static int rockchip_bo_unmap(struct bo *bo, struct vma *vma)
 
 static int rockchip_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
-	if (mapping->vma->priv) {
-		struct rockchip_private_map_data *priv = mapping->vma->priv;
-		memcpy(priv->cached_addr, priv->gem_addr, bo->meta.total_size);
+	size_t plane;
+	uint32_t first, count, offset, size, stride;
+	struct rockchip_private_map_data *priv = mapping->vma->priv;
+
+	if (!priv)
+		return 0;
+
+	/* Only the part the mapping covers is read back from the uncached buffer. */
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		drv_bo_get_rect_rows(bo, &mapping->rect, plane, &first, &count);
+		drv_bo_get_rect_bytes(bo, &mapping->rect, plane, &offset, &size);
+		stride = bo->meta.strides[plane];
+		offset += bo->meta.offsets[plane] + first * stride;
+		drv_copy_from_wc_2d((uint8_t *)priv->cached_addr + offset, stride,
+				    (uint8_t *)priv->gem_addr + offset, stride, size, count);
 	}
 
 	return 0;
@@ -245,9 +257,26 @@ static int rockchip_bo_invalidate(struct bo *bo, struct mapping *mapping)
 
 static int rockchip_bo_flush(struct bo *bo, struct mapping *mapping)
 {
+	size_t plane;
+	uint32_t first, count, offset, size, stride;
 	struct rockchip_private_map_data *priv = mapping->vma->priv;
-	if (priv && (mapping->vma->map_flags & BO_MAP_WRITE))
-		memcpy(priv->gem_addr, priv->cached_addr, bo->meta.total_size);
+	const struct rectangle *rect = &mapping->rect;
+
+	if (!priv || !(mapping->vma->map_flags & BO_MAP_WRITE))
+		return 0;
+
+	/* Rows outside the mapping were never read into the shadow. */
+	if (mapping->damage.width && mapping->damage.height)
+		rect = &mapping->damage;
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		drv_bo_get_rect_rows(bo, rect, plane, &first, &count);
+		drv_bo_get_rect_bytes(bo, rect, plane, &offset, &size);
+		stride = bo->meta.strides[plane];
+		offset += bo->meta.offsets[plane] + first * stride;
+		drv_copy_to_wc_2d((uint8_t *)priv->gem_addr + offset, stride,
+				  (uint8_t *)priv->cached_addr + offset, stride, size, count);
+	}
 
 	return 0;
 }
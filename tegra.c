@@ -101,79 +101,114 @@ static void compute_layout_linear(int width, int height, int format, uint32_t *s
 	*size = *stride * height;
 }
 
-static void transfer_tile(struct bo *bo, uint8_t *tiled, uint8_t *untiled, enum tegra_map_type type,
-			  uint32_t bytes_per_pixel, uint32_t gob_top, uint32_t gob_left,
-			  uint32_t gob_size_pixels, uint8_t *tiled_last)
-{
-	uint8_t *tmp;
-	uint32_t x, y, k;
-	for (k = 0; k < gob_size_pixels; k++) {
-		/*
-		 * Given the kth pixel starting from the tile specified by
-		 * gob_top and gob_left, unswizzle to get the standard (x, y)
-		 * representation.
-		 */
-		x = gob_left + (((k >> 3) & 8) | ((k >> 1) & 4) | (k & 3));
-		y = gob_top + ((k >> 7 << 3) | ((k >> 3) & 6) | ((k >> 2) & 1));
-
-		if (tiled >= tiled_last)
-			return;
-
-		if (x >= bo->meta.width || y >= bo->meta.height) {
-			tiled += bytes_per_pixel;
-			continue;
-		}
+/*
+ * Each 64 byte row of a 64x8 byte GOB is stored as four 16 byte runs. Run q of GOB row r starts at
+ * gob_row_offset(r) + gob_run_offsets[q] within the GOB.
+ */
+static const uint32_t gob_run_offsets[4] = { 0, 32, 256, 288 };
 
-		tmp = untiled + y * bo->meta.strides[0] + x * bytes_per_pixel;
+static inline uint32_t gob_row_offset(uint32_t r)
+{
+	return (r & 1) * 16 + (r >> 1) * 64;
+}
 
+static inline void transfer_run(uint8_t *tiled, uint8_t *untiled, enum tegra_map_type type,
+				uint32_t size)
+{
+	/* Full runs have a constant size, so the compiler turns them into one vector load/store. */
+	if (size == 16) {
 		if (type == TEGRA_READ_TILED_BUFFER)
-			memcpy(tmp, tiled, bytes_per_pixel);
-		else if (type == TEGRA_WRITE_TILED_BUFFER)
-			memcpy(tiled, tmp, bytes_per_pixel);
+			memcpy(untiled, tiled, 16);
+		else
+			memcpy(tiled, untiled, 16);
+	} else {
+		if (type == TEGRA_READ_TILED_BUFFER)
+			memcpy(untiled, tiled, size);
+		else
+			memcpy(tiled, untiled, size);
+	}
+}
 
-		/* Move on to next pixel. */
-		tiled += bytes_per_pixel;
+/*
+ * Transfers bytes [left, right) of rows [top, bottom) of a GOB. untiled points at the pixel that
+ * corresponds to the GOB's first byte.
+ */
+static void transfer_gob(uint8_t *gob, uint8_t *untiled, uint32_t stride, enum tegra_map_type type,
+			 uint32_t left, uint32_t right, uint32_t top, uint32_t bottom)
+{
+	uint32_t r, q, start, end;
+	uint8_t *row;
+
+	if (left == 0 && right == NV_BLOCKLINEAR_GOB_WIDTH) {
+		for (r = top; r < bottom; r++) {
+			row = untiled + r * stride;
+			for (q = 0; q < 4; q++)
+				transfer_run(gob + gob_row_offset(r) + gob_run_offsets[q],
+					     row + q * 16, type, 16);
+		}
+		return;
+	}
+
+	for (r = top; r < bottom; r++) {
+		row = untiled + r * stride;
+		for (q = 0; q < 4; q++) {
+			start = MAX(left, q * 16);
+			end = MIN(right, q * 16 + 16);
+			if (start < end)
+				transfer_run(gob + gob_row_offset(r) + gob_run_offsets[q] +
+						 start - q * 16,
+					     row + start, type, end - start);
+		}
 	}
 }
 
+/* Transfers the GOBs covering rect, clipped to the buffer. */
 static void transfer_tiled_memory(struct bo *bo, uint8_t *tiled, uint8_t *untiled,
-				  enum tegra_map_type type)
+				  enum tegra_map_type type, const struct rectangle *rect)
 {
-	uint32_t gob_width, gob_height, gob_size_bytes, gob_size_pixels, gob_count_x, gob_count_y,
-	    gob_top, gob_left;
-	uint32_t i, j, offset;
-	uint8_t *tmp, *tiled_last;
+	uint32_t gob_height, block_size_bytes, block_count_x, stride;
+	uint32_t x0, x1, y0, y1, gob_y, gob_x, left, right, top, bottom;
+	uint8_t *gob, *tiled_last;
 	uint32_t bytes_per_pixel = drv_stride_from_format(bo->meta.format, 1, 0);
 
 	/*
-	 * The blocklinear format consists of 8*(2^n) x 64 byte sized tiles,
+	 * The blocklinear format consists of 8*(2^n) x 64 byte sized blocks of GOBs,
 	 * where 0 <= n <= 4.
 	 */
-	gob_width = DIV_ROUND_UP(NV_BLOCKLINEAR_GOB_WIDTH, bytes_per_pixel);
 	gob_height = NV_BLOCKLINEAR_GOB_HEIGHT * (1 << NV_DEFAULT_BLOCK_HEIGHT_LOG2);
 	/* Calculate the height from maximum possible gob height */
 	while (gob_height > NV_BLOCKLINEAR_GOB_HEIGHT && gob_height >= 2 * bo->meta.height)
 		gob_height /= 2;
 
-	gob_size_bytes = gob_height * NV_BLOCKLINEAR_GOB_WIDTH;
-	gob_size_pixels = gob_height * gob_width;
-
-	gob_count_x = DIV_ROUND_UP(bo->meta.strides[0], NV_BLOCKLINEAR_GOB_WIDTH);
-	gob_count_y = DIV_ROUND_UP(bo->meta.height, gob_height);
-
+	stride = bo->meta.strides[0];
+	block_size_bytes = gob_height * NV_BLOCKLINEAR_GOB_WIDTH;
+	block_count_x = DIV_ROUND_UP(stride, NV_BLOCKLINEAR_GOB_WIDTH);
 	tiled_last = tiled + bo->meta.total_size;
 
-	offset = 0;
-	for (j = 0; j < gob_count_y; j++) {
-		gob_top = j * gob_height;
-		for (i = 0; i < gob_count_x; i++) {
-			tmp = tiled + offset;
-			gob_left = i * gob_width;
-
-			transfer_tile(bo, tmp, untiled, type, bytes_per_pixel, gob_top, gob_left,
-				      gob_size_pixels, tiled_last);
-
-			offset += gob_size_bytes;
+	x0 = rect->x * bytes_per_pixel;
+	x1 = MIN(rect->x + rect->width, bo->meta.width) * bytes_per_pixel;
+	y0 = rect->y;
+	y1 = MIN(rect->y + rect->height, bo->meta.height);
+
+	for (gob_y = y0 / NV_BLOCKLINEAR_GOB_HEIGHT * NV_BLOCKLINEAR_GOB_HEIGHT; gob_y < y1;
+	     gob_y += NV_BLOCKLINEAR_GOB_HEIGHT) {
+		top = MAX(y0, gob_y) - gob_y;
+		bottom = MIN(y1 - gob_y, NV_BLOCKLINEAR_GOB_HEIGHT);
+
+		for (gob_x = x0 / NV_BLOCKLINEAR_GOB_WIDTH * NV_BLOCKLINEAR_GOB_WIDTH; gob_x < x1;
+		     gob_x += NV_BLOCKLINEAR_GOB_WIDTH) {
+			left = MAX(x0, gob_x) - gob_x;
+			right = MIN(x1 - gob_x, NV_BLOCKLINEAR_GOB_WIDTH);
+
+			/* GOBs are stacked vertically within a block, blocks are stored in rows. */
+			gob = tiled + (size_t)(gob_y / gob_height) * block_count_x * block_size_bytes +
+			      (size_t)(gob_x / NV_BLOCKLINEAR_GOB_WIDTH) * block_size_bytes +
+			      (gob_y % gob_height) * NV_BLOCKLINEAR_GOB_WIDTH;
+			if (gob + NV_BLOCKLINEAR_GOB_WIDTH * NV_BLOCKLINEAR_GOB_HEIGHT > tiled_last)
+				return;
+
+			transfer_gob(gob, untiled + (size_t)gob_y * stride + gob_x, stride, type,
+				     left, right, top, bottom);
 		}
 	}
 }
@@ -315,11 +350,15 @@ static void *tegra_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t
 			  gem_map.offset);
 	vma->length = bo->meta.total_size;
 	if ((bo->meta.tiling & 0xFF) == NV_MEM_KIND_C32_2CRA && addr != MAP_FAILED) {
+		/* The VMA is shared by mappings of any region, so detile all of it. */
+		struct rectangle rect = { 0, 0, bo->meta.width, bo->meta.height };
+
 		priv = calloc(1, sizeof(*priv));
 		priv->untiled = calloc(1, bo->meta.total_size);
 		priv->tiled = addr;
 		vma->priv = priv;
-		transfer_tiled_memory(bo, priv->tiled, priv->untiled, TEGRA_READ_TILED_BUFFER);
+		transfer_tiled_memory(bo, priv->tiled, priv->untiled, TEGRA_READ_TILED_BUFFER,
+				      &rect);
 		addr = priv->untiled;
 	}
 
@@ -342,9 +381,15 @@ static int tegra_bo_unmap(struct bo *bo, struct vma *vma)
 static int tegra_bo_flush(struct bo *bo, struct mapping *mapping)
 {
 	struct tegra_private_map_data *priv = mapping->vma->priv;
-
-	if (priv && (mapping->vma->map_flags & BO_MAP_WRITE))
-		transfer_tiled_memory(bo, priv->tiled, priv->untiled, TEGRA_WRITE_TILED_BUFFER);
+	struct rectangle rect = { 0, 0, bo->meta.width, bo->meta.height };
+
+	if (priv && (mapping->vma->map_flags & BO_MAP_WRITE)) {
+		/* Only the GOBs that the damage touches need to be re-tiled. */
+		if (mapping->damage.width && mapping->damage.height)
+			rect = mapping->damage;
+		transfer_tiled_memory(bo, priv->tiled, priv->untiled, TEGRA_WRITE_TILED_BUFFER,
+				      &rect);
+	}
 
 	return 0;
 }
@@ -0,0 +1,235 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Times drv_array against the implementation it replaced, which allocated every item separately
+ * and shifted the pointer array on removal. The old one is kept below as old_array. Items have
+ * the size of a struct mapping, and each workload runs at a steady array size:
+ *  - churn: append an item and remove the oldest one, as map/unmap cycles do.
+ *  - remove by address: remove a random item given its address and append a new one. The old
+ *    array had no removal by address, so its callers searched for the index first.
+ *  - scan: read every item, as lookups over drv->mappings do.
+ * The old functions are kept out of line, as they were in their own file.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "drv_priv.h"
+#include "helpers_array.h"
+#include "util.h"
+
+#define OPERATIONS (1 << 20)
+
+struct old_array {
+	void **items;
+	uint32_t size;
+	uint32_t item_size;
+	uint32_t allocations;
+};
+
+__attribute__((noinline)) static struct old_array *old_array_init(uint32_t item_size)
+{
+	struct old_array *array;
+
+	array = calloc(1, sizeof(*array));
+	array->allocations = 2;
+	array->items = calloc(array->allocations, sizeof(*array->items));
+	array->item_size = item_size;
+	return array;
+}
+
+__attribute__((noinline)) static void *old_array_append(struct old_array *array, void *data)
+{
+	void *item;
+
+	if (array->size >= array->allocations) {
+		void **new_items = NULL;
+		array->allocations *= 2;
+		new_items = realloc(array->items, array->allocations * sizeof(*array->items));
+		assert(new_items);
+		array->items = new_items;
+	}
+
+	item = calloc(1, array->item_size);
+	memcpy(item, data, array->item_size);
+	array->items[array->size] = item;
+	array->size++;
+	return item;
+}
+
+__attribute__((noinline)) static void old_array_remove(struct old_array *array, uint32_t idx)
+{
+	uint32_t i;
+
+	free(array->items[idx]);
+	array->items[idx] = NULL;
+
+	for (i = idx + 1; i < array->size; i++)
+		array->items[i - 1] = array->items[i];
+
+	array->size--;
+	if ((DIV_ROUND_UP(array->allocations, 2) > array->size) && array->allocations > 2) {
+		void **new_items = NULL;
+		array->allocations = DIV_ROUND_UP(array->allocations, 2);
+		new_items = realloc(array->items, array->allocations * sizeof(*array->items));
+		assert(new_items);
+		array->items = new_items;
+	}
+}
+
+__attribute__((noinline)) static void old_array_remove_item(struct old_array *array, void *item)
+{
+	uint32_t idx;
+
+	for (idx = 0; idx < array->size; idx++)
+		if (array->items[idx] == item)
+			break;
+
+	assert(idx < array->size);
+	old_array_remove(array, idx);
+}
+
+__attribute__((noinline)) static void *old_array_at_idx(struct old_array *array, uint32_t idx)
+{
+	assert(idx < array->size);
+	return array->items[idx];
+}
+
+__attribute__((noinline)) static void old_array_destroy(struct old_array *array)
+{
+	uint32_t i;
+
+	for (i = 0; i < array->size; i++)
+		free(array->items[i]);
+
+	free(array->items);
+	free(array);
+}
+
+enum workload {
+	WORKLOAD_CHURN,
+	WORKLOAD_REMOVE_BY_ADDRESS,
+	WORKLOAD_SCAN,
+	NUM_WORKLOADS,
+};
+
+static const char *const workload_names[] = { "churn", "remove by address", "scan" };
+
+static const uint32_t sizes[] = { 16, 256, 4096 };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Deterministic, so both implementations see the same sequence. */
+static uint32_t next_random(uint32_t *state)
+{
+	*state = *state * 1103515245 + 12345;
+	return *state >> 8;
+}
+
+static double bench_old(uint32_t size, enum workload workload)
+{
+	struct mapping data = { 0 };
+	struct old_array *array = old_array_init(sizeof(data));
+	uint32_t i, j, random = 1;
+	volatile uint32_t sum = 0;
+	double start;
+	void *item;
+
+	for (i = 0; i < size; i++)
+		old_array_append(array, &data);
+
+	start = now();
+	for (i = 0; i < OPERATIONS; i++) {
+		switch (workload) {
+		case WORKLOAD_CHURN:
+			old_array_remove(array, 0);
+			old_array_append(array, &data);
+			break;
+		case WORKLOAD_REMOVE_BY_ADDRESS:
+			item = old_array_at_idx(array, next_random(&random) % size);
+			old_array_remove_item(array, item);
+			old_array_append(array, &data);
+			break;
+		case WORKLOAD_SCAN:
+			for (j = 0; j < size; j++)
+				sum += ((struct mapping *)old_array_at_idx(array, j))->refcount;
+			i += size - 1;
+			break;
+		default:
+			break;
+		}
+	}
+
+	start = (now() - start) / OPERATIONS * 1e9;
+	assert(array->size == size);
+	old_array_destroy(array);
+	return start;
+}
+
+static double bench_new(uint32_t size, enum workload workload)
+{
+	struct mapping data = { 0 };
+	struct drv_array *array = drv_array_init(sizeof(data));
+	uint32_t i, j, random = 1;
+	volatile uint32_t sum = 0;
+	double start;
+	void *item;
+
+	for (i = 0; i < size; i++)
+		drv_array_append(array, &data);
+
+	start = now();
+	for (i = 0; i < OPERATIONS; i++) {
+		switch (workload) {
+		case WORKLOAD_CHURN:
+			drv_array_remove(array, 0);
+			drv_array_append(array, &data);
+			break;
+		case WORKLOAD_REMOVE_BY_ADDRESS:
+			item = drv_array_at_idx(array, next_random(&random) % size);
+			drv_array_remove_item(array, item);
+			drv_array_append(array, &data);
+			break;
+		case WORKLOAD_SCAN:
+			for (j = 0; j < size; j++)
+				sum += ((struct mapping *)drv_array_at_idx(array, j))->refcount;
+			i += size - 1;
+			break;
+		default:
+			break;
+		}
+	}
+
+	start = (now() - start) / OPERATIONS * 1e9;
+	assert(drv_array_size(array) == size);
+	drv_array_destroy(array);
+	return start;
+}
+
+int main(void)
+{
+	enum workload w;
+	size_t s;
+
+	printf("%-18s %6s %12s %12s\n", "ns per operation", "size", "old", "new");
+	for (w = 0; w < NUM_WORKLOADS; w++)
+		for (s = 0; s < ARRAY_SIZE(sizes); s++)
+			printf("%-18s %6u %12.1f %12.1f\n", workload_names[w], sizes[s],
+			       bench_old(sizes[s], w), bench_new(sizes[s], w));
+
+	return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Checks that drv_array keeps items intact and at stable addresses through random appends and
+ * removals, and that it frees chunks once they are empty, keeping a single spare. helpers_array.c
+ * is included directly so the chunks can be counted.
+ */
+
+#include "../helpers_array.c"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#define MAX_ITEMS 4096
+
+struct item {
+	uint32_t value;
+	/* The address the item was given when it was appended. */
+	struct item *self;
+};
+
+static uint32_t num_chunks(struct drv_array *array)
+{
+	struct drv_array_chunk *chunk;
+	uint32_t count = 0;
+
+	for (chunk = array->chunks; chunk; chunk = chunk->next)
+		count++;
+
+	return count;
+}
+
+static void append(struct drv_array *array, uint32_t value)
+{
+	struct item data = { value, NULL };
+	struct item *item;
+
+	item = drv_array_append(array, &data);
+	assert(item);
+	item->self = item;
+}
+
+/* Every item is where it was appended, and the values are exactly the live ones. */
+static void check_items(struct drv_array *array, const bool *live, uint32_t num_live)
+{
+	struct item *item;
+	uint32_t i;
+
+	assert(drv_array_size(array) == num_live);
+	for (i = 0; i < num_live; i++) {
+		item = drv_array_at_idx(array, i);
+		assert(item->self == item);
+		assert(item->value < MAX_ITEMS && live[item->value]);
+	}
+}
+
+static void test_churn(void)
+{
+	static bool live[MAX_ITEMS];
+	struct drv_array *array = drv_array_init(sizeof(struct item));
+	struct item *item;
+	uint32_t i, value, num_live = 0;
+
+	assert(array);
+	srand(1);
+	for (i = 0; i < 16 * MAX_ITEMS; i++) {
+		value = rand() % MAX_ITEMS;
+		if (live[value]) {
+			continue;
+		} else if (num_live && rand() % 2) {
+			/* Remove a random item by address. */
+			item = drv_array_at_idx(array, rand() % num_live);
+			live[item->value] = false;
+			drv_array_remove_item(array, item);
+			num_live--;
+		} else {
+			live[value] = true;
+			append(array, value);
+			num_live++;
+		}
+
+		if (i % 1024 == 0)
+			check_items(array, live, num_live);
+	}
+
+	check_items(array, live, num_live);
+	drv_array_destroy(array);
+}
+
+static void test_chunks_freed(void)
+{
+	struct drv_array *array = drv_array_init(sizeof(struct item));
+	uint32_t i;
+
+	assert(array);
+	for (i = 0; i < MAX_ITEMS; i++)
+		append(array, i);
+
+	assert(num_chunks(array) > 2);
+
+	/* All but the largest of the emptied chunks are freed. */
+	while (drv_array_size(array))
+		drv_array_remove(array, 0);
+
+	assert(num_chunks(array) == 1);
+	assert(array->spare == array->chunks);
+	assert(array->num_slots == array->spare->num_slots);
+
+	/* The spare is reused rather than a new chunk allocated. */
+	append(array, 0);
+	assert(num_chunks(array) == 1 && !array->spare);
+
+	drv_array_remove(array, 0);
+	assert(num_chunks(array) == 1 && array->spare);
+	drv_array_destroy(array);
+}
+
+int main(void)
+{
+	test_churn();
+	test_chunks_freed();
+	printf("array_test: passed\n");
+	return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Checks the write-combined copy helpers against memcpy, then times them over 1080p and 4K NV12
+ * and ARGB surfaces. Whole surfaces are copied as one block, and a centered quarter of each
+ * plane is copied with the 2D variants. The buffers are ordinary cached memory, so the numbers
+ * measure the kernels' overhead rather than the gain on a real WC mapping.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "drv_priv.h"
+#include "helpers.h"
+#include "util.h"
+
+#define ITERATIONS 20
+
+struct surface {
+	const char *name;
+	uint32_t width;
+	uint32_t height;
+	/* Bytes per pixel of the first plane, and whether an NV12 chroma plane follows. */
+	uint32_t cpp;
+	int nv12;
+};
+
+static const struct surface surfaces[] = {
+	{ "1080p NV12", 1920, 1080, 1, 1 },
+	{ "1080p ARGB", 1920, 1080, 4, 0 },
+	{ "4K NV12", 3840, 2160, 1, 1 },
+	{ "4K ARGB", 3840, 2160, 4, 0 },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check_1d(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	size_t n, d, s;
+
+	for (s = 0; s < 17; s++) {
+		for (d = 0; d < 17; d++) {
+			for (n = 0; n < 2048; n += 37) {
+				memset(dst, 0, size);
+				drv_copy_from_wc(dst + d, src + s, n);
+				assert(!memcmp(dst + d, src + s, n));
+				assert((!d || !dst[d - 1]) && !dst[d + n]);
+
+				memset(dst, 0, size);
+				drv_copy_to_wc(dst + d, src + s, n);
+				assert(!memcmp(dst + d, src + s, n));
+				assert((!d || !dst[d - 1]) && !dst[d + n]);
+			}
+		}
+	}
+}
+
+/* Narrow, misaligned rows as well as wide ones, so the per-row kernel choice is covered. */
+static void check_2d(uint8_t *dst, uint8_t *ref, const uint8_t *src, size_t size)
+{
+	static const uint32_t row_sizes[] = { 1, 5, 15, 16, 255, 256, 300, 1000 };
+	uint32_t i, y, rows = 40, dst_stride = 1024, src_stride = 1031;
+	size_t off;
+
+	for (i = 0; i < ARRAY_SIZE(row_sizes); i++) {
+		for (off = 0; off < 16; off += 3) {
+			memset(ref, 0, size);
+			for (y = 0; y < rows; y++)
+				memcpy(ref + off + y * dst_stride, src + off + y * src_stride,
+				       row_sizes[i]);
+
+			memset(dst, 0, size);
+			drv_copy_from_wc_2d(dst + off, dst_stride, src + off, src_stride,
+					    row_sizes[i], rows);
+			assert(!memcmp(dst, ref, size));
+
+			memset(dst, 0, size);
+			drv_copy_to_wc_2d(dst + off, dst_stride, src + off, src_stride,
+					  row_sizes[i], rows);
+			assert(!memcmp(dst, ref, size));
+		}
+	}
+}
+
+static void bench(const struct surface *surface)
+{
+	uint32_t stride = surface->width * surface->cpp;
+	uint32_t rows = surface->height + (surface->nv12 ? surface->height / 2 : 0);
+	size_t size = (size_t)stride * rows;
+	size_t luma = stride / 4 + (size_t)surface->height / 4 * stride;
+	size_t chroma = stride / 4 + (size_t)(surface->height + surface->height / 8) * stride;
+	uint8_t *src = malloc(size), *dst = malloc(size);
+	double t[5];
+	int i;
+
+	assert(src && dst);
+	memset(src, 1, size);
+	memset(dst, 2, size);
+
+	t[0] = now();
+	for (i = 0; i < ITERATIONS; i++)
+		memcpy(dst, src, size);
+	t[1] = now();
+	for (i = 0; i < ITERATIONS; i++)
+		drv_copy_from_wc(dst, src, size);
+	t[2] = now();
+	for (i = 0; i < ITERATIONS; i++)
+		drv_copy_to_wc(dst, src, size);
+	t[3] = now();
+	for (i = 0; i < ITERATIONS; i++) {
+		/* The middle half of each dimension, as a lock of a sub-rectangle would copy. */
+		drv_copy_to_wc_2d(dst + luma, stride, src + luma, stride, stride / 2,
+				  surface->height / 2);
+		if (surface->nv12)
+			drv_copy_to_wc_2d(dst + chroma, stride, src + chroma, stride, stride / 2,
+					  surface->height / 4);
+	}
+	t[4] = now();
+
+	printf("%-11s memcpy %6.2f GB/s  from_wc %6.2f GB/s  to_wc %6.2f GB/s  "
+	       "to_wc_2d %6.2f GB/s\n",
+	       surface->name, ITERATIONS * size / (t[1] - t[0]) / 1e9,
+	       ITERATIONS * size / (t[2] - t[1]) / 1e9, ITERATIONS * size / (t[3] - t[2]) / 1e9,
+	       ITERATIONS * (size / 4) / (t[4] - t[3]) / 1e9);
+
+	free(src);
+	free(dst);
+}
+
+int main(void)
+{
+	size_t i, size = 1 << 16;
+	uint8_t *src = malloc(size), *dst = malloc(size), *ref = malloc(size);
+
+	assert(src && dst && ref);
+	for (i = 0; i < size; i++)
+		src[i] = rand();
+
+	check_1d(dst, src, size);
+	check_2d(dst, ref, src, size);
+	free(src);
+	free(dst);
+	free(ref);
+
+	for (i = 0; i < ARRAY_SIZE(surfaces); i++)
+		bench(&surfaces[i]);
+
+	return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Checks which bytes a flush writes back with and without reported damage. The vgem backend
+ * is given a cached shadow mapping like the mediatek and rockchip backends, whose flush copies
+ * the damaged rows to the device object the same way. The shadow is filled entirely, so every
+ * byte that reaches the device object was copied by a flush, and the test compares them against
+ * the span each plane's subsampling gives the damaged rectangle.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "drv_priv.h"
+#include "fake_drm.h"
+#include "helpers.h"
+#include "util.h"
+
+#define WIDTH 64
+#define HEIGHT 32
+
+struct shadow {
+	uint8_t *device;
+	uint8_t *cached;
+};
+
+struct format_info {
+	uint32_t format;
+	uint32_t num_planes;
+	uint32_t cpp[DRV_MAX_PLANES];
+	uint32_t subsampling[DRV_MAX_PLANES];
+};
+
+static const struct format_info formats[] = {
+	{ DRM_FORMAT_XRGB8888, 1, { 4 }, { 1 } },
+	{ DRM_FORMAT_YVU420, 3, { 1, 1, 1 }, { 1, 2, 2 } },
+};
+
+static int dumb_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+			  uint64_t use_flags)
+{
+	return drv_dumb_bo_create(bo, width, height, format, use_flags);
+}
+
+static void *shadow_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+{
+	struct shadow *shadow;
+	void *addr;
+
+	addr = drv_dumb_bo_map(bo, vma, plane, map_flags);
+	if (addr == MAP_FAILED)
+		return MAP_FAILED;
+
+	shadow = calloc(1, sizeof(*shadow));
+	assert(shadow);
+	shadow->device = addr;
+	shadow->cached = calloc(1, vma->length);
+	assert(shadow->cached);
+	vma->priv = shadow;
+
+	return shadow->cached;
+}
+
+static int shadow_bo_unmap(struct bo *bo, struct vma *vma)
+{
+	struct shadow *shadow = vma->priv;
+
+	munmap(shadow->device, vma->length);
+	free(shadow->cached);
+	free(shadow);
+	vma->priv = NULL;
+
+	return 0;
+}
+
+static int shadow_bo_flush(struct bo *bo, struct mapping *mapping)
+{
+	size_t plane;
+	uint32_t first, count, offset, size, stride;
+	struct shadow *shadow = mapping->vma->priv;
+	const struct rectangle *rect = &mapping->rect;
+
+	if (mapping->damage.width && mapping->damage.height)
+		rect = &mapping->damage;
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		drv_bo_get_rect_rows(bo, rect, plane, &first, &count);
+		drv_bo_get_rect_bytes(bo, rect, plane, &offset, &size);
+		stride = bo->meta.strides[plane];
+		offset += bo->meta.offsets[plane] + first * stride;
+		drv_copy_to_wc_2d(shadow->device + offset, stride, shadow->cached + offset, stride,
+				  size, count);
+	}
+
+	return 0;
+}
+
+/* Checks that exactly the bytes of rect in each plane have been written back, then clears them. */
+static void check_written(struct bo *bo, struct mapping *mapping, const struct format_info *info,
+			  const struct rectangle *rect)
+{
+	struct shadow *shadow = mapping->vma->priv;
+	uint32_t plane, x, y, rows, row_bytes, first_row, last_row, first_byte, last_byte;
+	uint32_t s;
+	bool written;
+	uint8_t *row;
+
+	for (plane = 0; plane < info->num_planes; plane++) {
+		s = info->subsampling[plane];
+		rows = DIV_ROUND_UP(HEIGHT, s);
+		row_bytes = DIV_ROUND_UP(WIDTH, s) * info->cpp[plane];
+		first_row = rect->y / s;
+		last_row = DIV_ROUND_UP(rect->y + rect->height, s);
+		first_byte = rect->x / s * info->cpp[plane];
+		last_byte = DIV_ROUND_UP(rect->x + rect->width, s) * info->cpp[plane];
+
+		for (y = 0; y < rows; y++) {
+			row = shadow->device + bo->meta.offsets[plane] +
+			      y * bo->meta.strides[plane];
+			for (x = 0; x < row_bytes; x++) {
+				written = y >= first_row && y < last_row && x >= first_byte &&
+					  x < last_byte;
+				assert(row[x] == (written ? 0xff : 0));
+			}
+
+			memset(row, 0, bo->meta.strides[plane]);
+		}
+	}
+}
+
+static void test_format(struct driver *drv, const struct format_info *info)
+{
+	struct rectangle full = { 0, 0, WIDTH, HEIGHT };
+	struct rectangle first = { 9, 3, 7, 5 };
+	struct rectangle second = { 20, 11, 13, 6 };
+	struct rectangle both = { 9, 3, 24, 14 };
+	struct rectangle edge = { WIDTH - 1, HEIGHT - 1, 1, 1 };
+	struct mapping *mapping;
+	struct shadow *shadow;
+	struct bo *bo;
+	void *addr;
+
+	bo = drv_bo_create(drv, WIDTH, HEIGHT, info->format, BO_USE_SW_MASK);
+	assert(bo);
+	assert(bo->meta.num_planes == info->num_planes);
+
+	addr = drv_bo_map(bo, &full, BO_MAP_READ_WRITE, &mapping, 0);
+	assert(addr != MAP_FAILED);
+	shadow = mapping->vma->priv;
+	memset(shadow->cached, 0xff, mapping->vma->length);
+
+	/* The damage of several writes is flushed as their bounding box. */
+	drv_bo_add_damage(bo, mapping, &first);
+	drv_bo_add_damage(bo, mapping, &second);
+	assert(!drv_bo_flush(bo, mapping));
+	check_written(bo, mapping, info, &both);
+	assert(!mapping->damage.width && !mapping->damage.height);
+
+	/* Subsampled planes round outwards. */
+	drv_bo_add_damage(bo, mapping, &edge);
+	assert(!drv_bo_flush(bo, mapping));
+	check_written(bo, mapping, info, &edge);
+
+	/* Without damage, the flush falls back to the mapped rectangle. */
+	assert(!drv_bo_flush(bo, mapping));
+	check_written(bo, mapping, info, &full);
+
+	assert(!drv_bo_unmap(bo, mapping));
+	drv_bo_destroy(bo);
+}
+
+int main(void)
+{
+	struct driver *drv;
+	struct backend backend;
+	size_t i;
+
+	drv = drv_create(fake_drm_open(NULL));
+	assert(drv && !drv_init(drv, 0));
+
+	backend = *drv->backend;
+	backend.bo_create = dumb_bo_create;
+	backend.bo_map = shadow_bo_map;
+	backend.bo_unmap = shadow_bo_unmap;
+	backend.bo_flush = shadow_bo_flush;
+	drv->backend = &backend;
+
+	for (i = 0; i < ARRAY_SIZE(formats); i++)
+		test_format(drv, &formats[i]);
+
+	drv_destroy(drv);
+	printf("damage_test: passed\n");
+	return 0;
+}
@@ -0,0 +1,216 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+#include "fake_drm.h"
+#include "util.h"
+
+#define FAKE_DRM_MEMORY_SIZE (1ull << 31)
+#define FAKE_DRM_MAX_HANDLES 65536
+
+struct fake_handle {
+	uint64_t offset;
+	uint64_t size;
+	/* Inode of the last PRIME fd exported for the handle. */
+	ino_t ino;
+};
+
+static pthread_mutex_t fake_lock = PTHREAD_MUTEX_INITIALIZER;
+static const struct fake_drm_device *fake_device;
+static struct fake_handle fake_handles[FAKE_DRM_MAX_HANDLES];
+static uint32_t fake_next_handle = 1;
+static uint64_t fake_next_offset;
+static uint32_t fake_ioctls;
+
+int fake_drm_open(const struct fake_drm_device *device)
+{
+	int fd = memfd_create("fake-drm", MFD_CLOEXEC);
+
+	if (fd < 0 || ftruncate(fd, FAKE_DRM_MEMORY_SIZE)) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	fake_device = device;
+	return fd;
+}
+
+uint32_t fake_drm_create_handle(uint64_t size)
+{
+	uint32_t handle;
+
+	pthread_mutex_lock(&fake_lock);
+	handle = fake_next_handle;
+	fake_next_handle = fake_next_handle % (FAKE_DRM_MAX_HANDLES - 1) + 1;
+
+	/* Memory is handed out round robin, tests never keep enough alive to wrap onto it. */
+	size = ALIGN(size, 4096);
+	if (fake_next_offset + size > FAKE_DRM_MEMORY_SIZE)
+		fake_next_offset = 0;
+
+	fake_handles[handle].offset = fake_next_offset;
+	fake_handles[handle].size = size;
+	fake_handles[handle].ino = 0;
+	fake_next_offset += size;
+	pthread_mutex_unlock(&fake_lock);
+
+	return handle;
+}
+
+uint64_t fake_drm_handle_offset(uint32_t handle)
+{
+	return fake_handles[handle % FAKE_DRM_MAX_HANDLES].offset;
+}
+
+uint32_t fake_drm_ioctl_count(void)
+{
+	return __atomic_load_n(&fake_ioctls, __ATOMIC_RELAXED);
+}
+
+drmVersionPtr drmGetVersion(int fd)
+{
+	drmVersionPtr version = calloc(1, sizeof(*version));
+
+	if (!version)
+		return NULL;
+
+	version->name = strdup(fake_device ? fake_device->name : "vgem");
+	version->name_len = strlen(version->name);
+	return version;
+}
+
+void drmFreeVersion(drmVersionPtr version)
+{
+	if (!version)
+		return;
+
+	free(version->name);
+	free(version);
+}
+
+/*
+ * A PRIME fd is a memfd with the size of the buffer, which importers read with lseek(), but none
+ * of its memory. It is recognized on import by its inode.
+ */
+static int fake_prime_handle_to_fd(uint32_t handle, int *prime_fd)
+{
+	struct stat st;
+	struct fake_handle *fake_handle = &fake_handles[handle % FAKE_DRM_MAX_HANDLES];
+
+	*prime_fd = memfd_create("fake-prime", MFD_CLOEXEC);
+	if (*prime_fd < 0)
+		return -1;
+
+	if (ftruncate(*prime_fd, fake_handle->size)) {
+		close(*prime_fd);
+		return -1;
+	}
+
+	fstat(*prime_fd, &st);
+	pthread_mutex_lock(&fake_lock);
+	fake_handle->ino = st.st_ino;
+	pthread_mutex_unlock(&fake_lock);
+	return 0;
+}
+
+static int fake_prime_fd_to_handle(int prime_fd, uint32_t *handle)
+{
+	struct stat st;
+	uint32_t h;
+
+	if (fstat(prime_fd, &st))
+		return -1;
+
+	pthread_mutex_lock(&fake_lock);
+	for (h = 1; h < FAKE_DRM_MAX_HANDLES; h++) {
+		if (fake_handles[h].ino == st.st_ino) {
+			*handle = h;
+			pthread_mutex_unlock(&fake_lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&fake_lock);
+
+	errno = ENOENT;
+	return -1;
+}
+
+int drmIoctl(int fd, unsigned long request, void *arg)
+{
+	__atomic_add_fetch(&fake_ioctls, 1, __ATOMIC_RELAXED);
+
+	switch (request) {
+	case DRM_IOCTL_MODE_CREATE_DUMB: {
+		struct drm_mode_create_dumb *create = arg;
+
+		create->pitch = ALIGN(create->width * DIV_ROUND_UP(create->bpp, 8), 64);
+		create->size = (uint64_t)create->pitch * create->height;
+		create->handle = fake_drm_create_handle(create->size);
+		return 0;
+	}
+	case DRM_IOCTL_MODE_MAP_DUMB: {
+		struct drm_mode_map_dumb *map = arg;
+
+		map->offset = fake_drm_handle_offset(map->handle);
+		return 0;
+	}
+	case DRM_IOCTL_MODE_DESTROY_DUMB:
+	case DRM_IOCTL_GEM_CLOSE:
+		return 0;
+	case DRM_IOCTL_PRIME_HANDLE_TO_FD: {
+		struct drm_prime_handle *prime = arg;
+
+		return fake_prime_handle_to_fd(prime->handle, &prime->fd);
+	}
+	case DRM_IOCTL_PRIME_FD_TO_HANDLE: {
+		struct drm_prime_handle *prime = arg;
+
+		return fake_prime_fd_to_handle(prime->fd, &prime->handle);
+	}
+	}
+
+	if (fake_device && fake_device->ioctl)
+		return fake_device->ioctl(request, arg);
+
+	errno = EINVAL;
+	return -1;
+}
+
+int drmCommandWriteRead(int fd, unsigned long index, void *data, unsigned long size)
+{
+	unsigned long request =
+	    _IOC(_IOC_READ | _IOC_WRITE, DRM_IOCTL_BASE, DRM_COMMAND_BASE + index, size);
+
+	return drmIoctl(fd, request, data);
+}
+
+int drmGetCap(int fd, uint64_t capability, uint64_t *value)
+{
+	errno = EINVAL;
+	return -1;
+}
+
+
+int drmPrimeHandleToFD(int fd, uint32_t handle, uint32_t flags, int *prime_fd)
+{
+	__atomic_add_fetch(&fake_ioctls, 1, __ATOMIC_RELAXED);
+	return fake_prime_handle_to_fd(handle, prime_fd);
+}
+
+int drmPrimeFDToHandle(int fd, int prime_fd, uint32_t *handle)
+{
+	__atomic_add_fetch(&fake_ioctls, 1, __ATOMIC_RELAXED);
+	return fake_prime_fd_to_handle(prime_fd, handle);
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef FAKE_DRM_H
+#define FAKE_DRM_H
+
+#include <stdint.h>
+
+/*
+ * The tests link fake_drm.c in place of libdrm. The device fd is a memfd and every GEM handle
+ * is a range of it, so the core maps buffers the same way it maps a real device's objects.
+ * Dumb buffers, GEM_CLOSE and PRIME are handled by the fake itself; everything else goes to
+ * the device's ioctl hook.
+ */
+struct fake_drm_device {
+	/* Reported by drmGetVersion(), which selects the backend. */
+	const char *name;
+	/* Returns 0, or -1 with errno set. May be NULL. */
+	int (*ioctl)(unsigned long request, void *arg);
+};
+
+/* Opens a device. A NULL device is a "vgem" device with only dumb buffers. */
+int fake_drm_open(const struct fake_drm_device *device);
+/* Allocates a handle backed by size bytes of the device fd. */
+uint32_t fake_drm_create_handle(uint64_t size);
+/* The mmap offset of the handle on the device fd. */
+uint64_t fake_drm_handle_offset(uint32_t handle);
+/* Number of ioctls issued so far. */
+uint32_t fake_drm_ioctl_count(void);
+
+#endif
@@ -0,0 +1,238 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <xf86drm.h>
+
+#include "fake_drm.h"
+#include "fake_virtgpu.h"
+#include "util.h"
+#include "virgl_hw.h"
+#include "virtgpu_drm.h"
+
+/* Command headers and sizes in dwords, from virglrenderer's virgl_protocol.h. */
+#define FAKE_VIRGL_CMD0(cmd, len) ((cmd) | ((len) << 16))
+#define FAKE_VIRGL_PIPE_RESOURCE_CREATE FAKE_VIRGL_CMD0(48, 11)
+#define FAKE_VIRGL_PIPE_RES_CREATE_BLOB_ID 11
+#define FAKE_VIRGL_TRANSFER3D FAKE_VIRGL_CMD0(43, 13)
+#define FAKE_VIRGL_TRANSFER3D_DWORDS 14
+#define FAKE_VIRGL_TRANSFER3D_RES_HANDLE 1
+#define FAKE_VIRGL_TRANSFER3D_DIRECTION 13
+
+static pthread_mutex_t fake_virtgpu_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fake_virtgpu_config fake_virtgpu_config;
+static struct fake_virtgpu_stats fake_virtgpu_stats;
+/* The blob_mem of every handle, which RESOURCE_INFO reports like kernels since chromeos-5.10. */
+static uint32_t fake_virtgpu_blob_mem[65536];
+
+static uint32_t *fake_virtgpu_handle_blob_mem(uint32_t handle)
+{
+	return &fake_virtgpu_blob_mem[handle % ARRAY_SIZE(fake_virtgpu_blob_mem)];
+}
+
+static void fake_virtgpu_count(uint32_t *counter, uint32_t count)
+{
+	pthread_mutex_lock(&fake_virtgpu_lock);
+	*counter += count;
+	pthread_mutex_unlock(&fake_virtgpu_lock);
+}
+
+static int fake_virtgpu_getparam(struct drm_virtgpu_getparam *getparam)
+{
+	uint32_t *value = (uint32_t *)(uintptr_t)getparam->value;
+
+	switch (getparam->param) {
+	case VIRTGPU_PARAM_3D_FEATURES:
+	case VIRTGPU_PARAM_CAPSET_QUERY_FIX:
+		*value = 1;
+		return 0;
+	case VIRTGPU_PARAM_RESOURCE_BLOB:
+		*value = fake_virtgpu_config.resource_blob;
+		return 0;
+	case VIRTGPU_PARAM_HOST_VISIBLE:
+		*value = fake_virtgpu_config.host_visible;
+		return 0;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+/* A v2 capset in which every format can be rendered to, sampled from and scanned out. */
+static int fake_virtgpu_get_caps(struct drm_virtgpu_get_caps *get_caps)
+{
+	union virgl_caps *caps = (union virgl_caps *)(uintptr_t)get_caps->addr;
+
+	if (get_caps->cap_set_id != 2 || get_caps->size != sizeof(*caps)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(caps, 0, sizeof(*caps));
+	caps->max_version = 2;
+	memset(&caps->v1.render, 0xff, sizeof(caps->v1.render));
+	memset(&caps->v1.sampler, 0xff, sizeof(caps->v1.sampler));
+	memset(&caps->v2.scanout, 0xff, sizeof(caps->v2.scanout));
+	if (fake_virtgpu_config.caps_blob)
+		caps->v2.capability_bits_v2 |= VIRGL_CAP_V2_BLOB;
+	if (fake_virtgpu_config.caps_transfer)
+		caps->v2.capability_bits |= VIRGL_CAP_TRANSFER;
+
+	return 0;
+}
+
+static int fake_virtgpu_create_blob(struct drm_virtgpu_resource_create_blob *create)
+{
+	const uint32_t *cmd = (const uint32_t *)(uintptr_t)create->cmd;
+
+	if (fake_virtgpu_config.fail_blob || !fake_virtgpu_config.resource_blob) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Host blobs are backed by a resource the command creates with the blob's id. */
+	switch (create->blob_mem) {
+	case VIRTGPU_BLOB_MEM_GUEST:
+		if (create->cmd_size || create->blob_id) {
+			errno = EINVAL;
+			return -1;
+		}
+		break;
+	case VIRTGPU_BLOB_MEM_HOST3D:
+		if (!fake_virtgpu_config.host_visible || !create->blob_id ||
+		    create->cmd_size != (FAKE_VIRGL_PIPE_RES_CREATE_BLOB_ID + 1) * sizeof(*cmd) ||
+		    cmd[0] != FAKE_VIRGL_PIPE_RESOURCE_CREATE ||
+		    cmd[FAKE_VIRGL_PIPE_RES_CREATE_BLOB_ID] != create->blob_id) {
+			errno = EINVAL;
+			return -1;
+		}
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	create->bo_handle = fake_drm_create_handle(create->size);
+	create->res_handle = create->bo_handle;
+
+	pthread_mutex_lock(&fake_virtgpu_lock);
+	*fake_virtgpu_handle_blob_mem(create->bo_handle) = create->blob_mem;
+	fake_virtgpu_stats.blobs++;
+	fake_virtgpu_stats.last_blob_mem = create->blob_mem;
+	pthread_mutex_unlock(&fake_virtgpu_lock);
+	return 0;
+}
+
+/* Only transfers are accepted in command buffers, and an empty one just yields a fence. */
+static int fake_virtgpu_execbuffer(struct drm_virtgpu_execbuffer *execbuffer)
+{
+	const uint32_t *cmd = (const uint32_t *)(uintptr_t)execbuffer->command;
+	uint32_t i, num_dwords = execbuffer->size / sizeof(*cmd);
+
+	if (num_dwords % FAKE_VIRGL_TRANSFER3D_DWORDS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < num_dwords; i += FAKE_VIRGL_TRANSFER3D_DWORDS) {
+		if (cmd[i] != FAKE_VIRGL_TRANSFER3D ||
+		    !cmd[i + FAKE_VIRGL_TRANSFER3D_RES_HANDLE] ||
+		    cmd[i + FAKE_VIRGL_TRANSFER3D_DIRECTION] < 1 ||
+		    cmd[i + FAKE_VIRGL_TRANSFER3D_DIRECTION] > 2) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	execbuffer->fence_fd = -1;
+	if (execbuffer->flags & VIRTGPU_EXECBUF_FENCE_FD_OUT) {
+		/* The host is done at once, so the fence is created signaled. */
+		execbuffer->fence_fd = eventfd(1, EFD_CLOEXEC);
+		if (execbuffer->fence_fd < 0)
+			return -1;
+	}
+
+	pthread_mutex_lock(&fake_virtgpu_lock);
+	fake_virtgpu_stats.submissions++;
+	fake_virtgpu_stats.transfers += num_dwords / FAKE_VIRGL_TRANSFER3D_DWORDS;
+	pthread_mutex_unlock(&fake_virtgpu_lock);
+	return 0;
+}
+
+static int fake_virtgpu_ioctl(unsigned long request, void *arg)
+{
+	switch (request) {
+	case DRM_IOCTL_VIRTGPU_GETPARAM:
+		return fake_virtgpu_getparam(arg);
+	case DRM_IOCTL_VIRTGPU_GET_CAPS:
+		return fake_virtgpu_get_caps(arg);
+	case DRM_IOCTL_VIRTGPU_RESOURCE_CREATE: {
+		struct drm_virtgpu_resource_create *create = arg;
+
+		create->bo_handle = fake_drm_create_handle(create->size);
+		create->res_handle = create->bo_handle;
+
+		pthread_mutex_lock(&fake_virtgpu_lock);
+		*fake_virtgpu_handle_blob_mem(create->bo_handle) = 0;
+		fake_virtgpu_stats.resources++;
+		pthread_mutex_unlock(&fake_virtgpu_lock);
+		return 0;
+	}
+	case DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB:
+		return fake_virtgpu_create_blob(arg);
+	case DRM_IOCTL_VIRTGPU_RESOURCE_INFO: {
+		struct drm_virtgpu_resource_info *info = arg;
+
+		info->res_handle = info->bo_handle;
+		pthread_mutex_lock(&fake_virtgpu_lock);
+		info->blob_mem = *fake_virtgpu_handle_blob_mem(info->bo_handle);
+		pthread_mutex_unlock(&fake_virtgpu_lock);
+		return 0;
+	}
+	case DRM_IOCTL_VIRTGPU_MAP: {
+		struct drm_virtgpu_map *map = arg;
+
+		map->offset = fake_drm_handle_offset(map->handle);
+		return 0;
+	}
+	case DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST:
+	case DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST:
+		fake_virtgpu_count(&fake_virtgpu_stats.transfers, 1);
+		return 0;
+	case DRM_IOCTL_VIRTGPU_EXECBUFFER:
+		return fake_virtgpu_execbuffer(arg);
+	case DRM_IOCTL_VIRTGPU_WAIT:
+		return 0;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+static const struct fake_drm_device fake_virtgpu_device = {
+	.name = "virtio_gpu",
+	.ioctl = fake_virtgpu_ioctl,
+};
+
+int fake_virtgpu_open(const struct fake_virtgpu_config *config)
+{
+	pthread_mutex_lock(&fake_virtgpu_lock);
+	fake_virtgpu_config = *config;
+	memset(&fake_virtgpu_stats, 0, sizeof(fake_virtgpu_stats));
+	pthread_mutex_unlock(&fake_virtgpu_lock);
+
+	return fake_drm_open(&fake_virtgpu_device);
+}
+
+void fake_virtgpu_get_stats(struct fake_virtgpu_stats *stats)
+{
+	pthread_mutex_lock(&fake_virtgpu_lock);
+	*stats = fake_virtgpu_stats;
+	pthread_mutex_unlock(&fake_virtgpu_lock);
+}
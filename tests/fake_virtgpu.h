@@ -0,0 +1,48 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef FAKE_VIRTGPU_H
+#define FAKE_VIRTGPU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A virtio_gpu device on top of fake_drm.c with a 3D host that supports every format. Resources
+ * and blobs are ranges of the device fd like any other fake handle, and the host does nothing
+ * with transfers beyond counting them. Which parts of the blob path the device offers is
+ * configured when it is opened.
+ */
+struct fake_virtgpu_config {
+	/* VIRTGPU_PARAM_RESOURCE_BLOB. */
+	bool resource_blob;
+	/* VIRTGPU_PARAM_HOST_VISIBLE. */
+	bool host_visible;
+	/* VIRGL_CAP_V2_BLOB in the host capset. */
+	bool caps_blob;
+	/* VIRGL_CAP_TRANSFER in the host capset, for transfers in command buffers. */
+	bool caps_transfer;
+	/* Make DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB fail as a host without memory would. */
+	bool fail_blob;
+};
+
+struct fake_virtgpu_stats {
+	/* Resources created with DRM_IOCTL_VIRTGPU_RESOURCE_CREATE. */
+	uint32_t resources;
+	/* Blob resources created, and the blob_mem of the last one. */
+	uint32_t blobs;
+	uint32_t last_blob_mem;
+	/* Transfer ioctls plus transfers encoded in command buffers, in either direction. */
+	uint32_t transfers;
+	/* DRM_IOCTL_VIRTGPU_EXECBUFFER calls. */
+	uint32_t submissions;
+};
+
+/* Opens the device, which fake_drm_open() reports as "virtio_gpu", and clears the stats. */
+int fake_virtgpu_open(const struct fake_virtgpu_config *config);
+void fake_virtgpu_get_stats(struct fake_virtgpu_stats *stats);
+
+#endif
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Stresses the GEM handle reference table from 1 to 8 threads and reports how it scales.
+ *  - private: each thread counts references on its own handles.
+ *  - shared: all threads count references on the same handle.
+ * Both run against the table as is and with every call under one mutex, the way
+ * driver_lock serialized them before. The counts must come back to where they started.
+ * create/destroy then runs the whole drv_bo_create()/drv_bo_destroy() path on the fake vgem
+ * device, whose own ioctls are serialized.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "drv_priv.h"
+#include "fake_drm.h"
+#include "helpers.h"
+#include "util.h"
+
+#define REFERENCE_OPERATIONS 2000000
+#define BUFFER_OPERATIONS 20000
+#define MAX_THREADS 8
+#define HANDLES_PER_THREAD 64
+/* Above the handles the fake device hands out, so buffers never share them. */
+#define SHARED_HANDLE 0x100000
+#define FIRST_PRIVATE_HANDLE (SHARED_HANDLE + 1)
+
+enum workload {
+	WORKLOAD_PRIVATE,
+	WORKLOAD_SHARED,
+	WORKLOAD_CREATE_DESTROY,
+};
+
+struct worker {
+	pthread_t thread;
+	struct driver *drv;
+	enum workload workload;
+	bool locked;
+	uint32_t index;
+};
+
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t start_barrier;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void count_references(struct worker *worker)
+{
+	struct bo bo;
+	uint32_t i;
+
+	memset(&bo, 0, sizeof(bo));
+	bo.drv = worker->drv;
+	bo.meta.num_planes = 1;
+
+	for (i = 0; i < REFERENCE_OPERATIONS; i++) {
+		if (worker->workload == WORKLOAD_SHARED)
+			bo.handles[0].u32 = SHARED_HANDLE;
+		else
+			bo.handles[0].u32 = FIRST_PRIVATE_HANDLE +
+					    worker->index * HANDLES_PER_THREAD +
+					    i % HANDLES_PER_THREAD;
+
+		if (worker->locked)
+			pthread_mutex_lock(&global_lock);
+		drv_increment_reference_count(bo.drv, &bo, 0);
+		drv_decrement_reference_count(bo.drv, &bo, 0);
+		if (worker->locked)
+			pthread_mutex_unlock(&global_lock);
+	}
+}
+
+static void create_and_destroy(struct worker *worker)
+{
+	struct bo *bo;
+	uint32_t i;
+
+	for (i = 0; i < BUFFER_OPERATIONS; i++) {
+		bo = drv_bo_create(worker->drv, 64, 64, DRM_FORMAT_XRGB8888, BO_USE_TEXTURE);
+		assert(bo);
+		drv_bo_destroy(bo);
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *worker = arg;
+
+	pthread_barrier_wait(&start_barrier);
+	if (worker->workload == WORKLOAD_CREATE_DESTROY)
+		create_and_destroy(worker);
+	else
+		count_references(worker);
+
+	return NULL;
+}
+
+/* Returns millions of operations per second over all threads. */
+static double run(struct driver *drv, enum workload workload, bool locked, uint32_t num_threads)
+{
+	struct worker workers[MAX_THREADS];
+	uint32_t i, operations;
+	double start;
+
+	operations = workload == WORKLOAD_CREATE_DESTROY ? BUFFER_OPERATIONS : REFERENCE_OPERATIONS;
+	pthread_barrier_init(&start_barrier, NULL, num_threads + 1);
+	for (i = 0; i < num_threads; i++) {
+		workers[i].drv = drv;
+		workers[i].workload = workload;
+		workers[i].locked = locked;
+		workers[i].index = i;
+		assert(!pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]));
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	start = now();
+	for (i = 0; i < num_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	start = now() - start;
+	pthread_barrier_destroy(&start_barrier);
+	return (double)operations * num_threads / start / 1e6;
+}
+
+int main(void)
+{
+	static const uint32_t thread_counts[] = { 1, 2, 4, 8 };
+	struct driver *drv;
+	struct bo bo;
+	uint32_t i;
+
+	drv = drv_create(fake_drm_open(NULL));
+	assert(drv && !drv_init(drv, 0));
+
+	/* The shared handle keeps one reference, so decrements never take it to zero. */
+	memset(&bo, 0, sizeof(bo));
+	bo.meta.num_planes = 1;
+	bo.handles[0].u32 = SHARED_HANDLE;
+	drv_increment_reference_count(drv, &bo, 0);
+
+	printf("%-26s", "Mops/s, threads:");
+	for (i = 0; i < ARRAY_SIZE(thread_counts); i++)
+		printf("%10u", thread_counts[i]);
+
+	printf("\n%-26s", "private, table");
+	for (i = 0; i < ARRAY_SIZE(thread_counts); i++)
+		printf("%10.2f", run(drv, WORKLOAD_PRIVATE, false, thread_counts[i]));
+	printf("\n%-26s", "private, one lock");
+	for (i = 0; i < ARRAY_SIZE(thread_counts); i++)
+		printf("%10.2f", run(drv, WORKLOAD_PRIVATE, true, thread_counts[i]));
+	printf("\n%-26s", "shared, table");
+	for (i = 0; i < ARRAY_SIZE(thread_counts); i++)
+		printf("%10.2f", run(drv, WORKLOAD_SHARED, false, thread_counts[i]));
+	printf("\n%-26s", "shared, one lock");
+	for (i = 0; i < ARRAY_SIZE(thread_counts); i++)
+		printf("%10.2f", run(drv, WORKLOAD_SHARED, true, thread_counts[i]));
+	printf("\n%-26s", "create/destroy");
+	for (i = 0; i < ARRAY_SIZE(thread_counts); i++)
+		printf("%10.3f", run(drv, WORKLOAD_CREATE_DESTROY, false, thread_counts[i]));
+	printf("\n");
+
+	assert(drv_get_reference_count(drv, &bo, 0) == 1);
+	for (i = 0; i < MAX_THREADS * HANDLES_PER_THREAD; i++) {
+		bo.handles[0].u32 = FIRST_PRIVATE_HANDLE + i;
+		assert(drv_get_reference_count(drv, &bo, 0) == 0);
+	}
+
+	drv_destroy(drv);
+	return 0;
+}
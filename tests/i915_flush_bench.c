@@ -0,0 +1,196 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Times the cache line write-back variants that i915 flushes use on non-LLC parts, and the two
+ * threaded split of large ranges against a single thread and against spawning a thread per
+ * flush. i915.c is included directly so its static flush functions can be called on plain
+ * memory. Every range is dirtied before it is flushed, and only the flush is timed.
+ */
+
+#define DRV_I915
+#include "../i915.c"
+
+#include <stdlib.h>
+#include <time.h>
+
+#define ITERATIONS 10
+
+struct flush_variant {
+	const char *name;
+	i915_flush_lines_fn flush_lines;
+	/* CPUID.(EAX=7, ECX=0):EBX bit the variant needs, or 0. */
+	uint32_t cpuid_bit;
+};
+
+static const struct flush_variant variants[] = {
+	{ "clflush", i915_clflush_lines, 0 },
+	{ "clflushopt", i915_clflushopt_lines, I915_CPUID_CLFLUSHOPT },
+	{ "clwb", i915_clwb_lines, I915_CPUID_CLWB },
+};
+
+static const size_t sizes[] = { 256 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024,
+				64 * 1024 * 1024 };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool variant_supported(const struct flush_variant *variant)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	if (!variant->cpuid_bit)
+		return true;
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return false;
+
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return ebx & variant->cpuid_bit;
+}
+
+struct spawned_flush {
+	i915_flush_lines_fn flush_lines;
+	uint8_t *start;
+	uint8_t *end;
+};
+
+static void *spawned_flush_main(void *arg)
+{
+	struct spawned_flush *job = arg;
+
+	job->flush_lines(job->start, job->end);
+	return NULL;
+}
+
+/* The split as it was before the persistent worker: a thread is created for every flush. */
+static void spawned_clflush(i915_flush_lines_fn flush_lines, uint8_t *p, size_t size)
+{
+	struct spawned_flush job = { flush_lines, p + size / 2, p + size };
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, spawned_flush_main, &job)) {
+		flush_lines(p, p + size);
+		return;
+	}
+
+	flush_lines(p, job.start);
+	pthread_join(thread, NULL);
+}
+
+enum flush_mode {
+	FLUSH_SINGLE,
+	FLUSH_SPAWNED,
+	FLUSH_WORKER,
+};
+
+static double time_flush(struct i915_device *i915, enum flush_mode mode, uint8_t *buf,
+			 size_t size)
+{
+	double start, total = 0;
+	int i;
+
+	for (i = 0; i < ITERATIONS; i++) {
+		memset(buf, i, size);
+
+		start = now();
+		switch (mode) {
+		case FLUSH_SINGLE:
+			i915->flush_lines(buf, buf + size);
+			break;
+		case FLUSH_SPAWNED:
+			spawned_clflush(i915->flush_lines, buf, size);
+			break;
+		case FLUSH_WORKER:
+			i915_clflush(i915, buf, size);
+			break;
+		}
+		total += now() - start;
+	}
+
+	return (double)ITERATIONS * size / total / 1e9;
+}
+
+static double time_thread_spawn(void)
+{
+	struct spawned_flush job = { i915_clflush_lines, NULL, NULL };
+	pthread_t thread;
+	double start;
+	int i;
+
+	start = now();
+	for (i = 0; i < 1000; i++) {
+		if (pthread_create(&thread, NULL, spawned_flush_main, &job))
+			return 0;
+		pthread_join(thread, NULL);
+	}
+
+	return (now() - start) / 1000 * 1e6;
+}
+
+int main(void)
+{
+	struct i915_device i915;
+	uint8_t *buf;
+	size_t i, j;
+
+	buf = aligned_alloc(I915_CACHELINE_SIZE, sizes[ARRAY_SIZE(sizes) - 1]);
+	if (!buf)
+		return 1;
+
+	printf("%-12s", "GB/s");
+	for (j = 0; j < ARRAY_SIZE(sizes); j++)
+		printf("%10zu KiB", sizes[j] / 1024);
+	printf("\n");
+
+	memset(&i915, 0, sizeof(i915));
+	for (i = 0; i < ARRAY_SIZE(variants); i++) {
+		if (!variant_supported(&variants[i])) {
+			printf("%-12s unsupported\n", variants[i].name);
+			continue;
+		}
+
+		i915.flush_lines = variants[i].flush_lines;
+		printf("%-12s", variants[i].name);
+		for (j = 0; j < ARRAY_SIZE(sizes); j++)
+			printf("%14.2f", time_flush(&i915, FLUSH_SINGLE, buf, sizes[j]));
+		printf("\n");
+	}
+
+	/* The split only applies from I915_FLUSH_SPLIT_SIZE up, with the variant init picks. */
+	i915.flush_lines = i915_select_flush_lines();
+	if (i915_flush_worker_init(&i915.flush_worker, i915.flush_lines))
+		return 1;
+
+	printf("\n%-12s", "split GB/s");
+	for (j = 0; j < ARRAY_SIZE(sizes); j++)
+		if (sizes[j] >= I915_FLUSH_SPLIT_SIZE)
+			printf("%10zu KiB", sizes[j] / 1024);
+	printf("\n");
+
+	printf("%-12s", "one thread");
+	for (j = 0; j < ARRAY_SIZE(sizes); j++)
+		if (sizes[j] >= I915_FLUSH_SPLIT_SIZE)
+			printf("%14.2f", time_flush(&i915, FLUSH_SINGLE, buf, sizes[j]));
+	printf("\n%-12s", "spawned");
+	for (j = 0; j < ARRAY_SIZE(sizes); j++)
+		if (sizes[j] >= I915_FLUSH_SPLIT_SIZE)
+			printf("%14.2f", time_flush(&i915, FLUSH_SPAWNED, buf, sizes[j]));
+	printf("\n%-12s", "worker");
+	for (j = 0; j < ARRAY_SIZE(sizes); j++)
+		if (sizes[j] >= I915_FLUSH_SPLIT_SIZE)
+			printf("%14.2f", time_flush(&i915, FLUSH_WORKER, buf, sizes[j]));
+	printf("\n\nthread create and join: %.1f us\n", time_thread_spawn());
+
+	i915_flush_worker_fini(&i915.flush_worker);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Checks that the buffer pool only hands a buffer out again for the same format and use flags,
+ * that it stays within its budget when one release has to evict many buffers, and that the
+ * reaper thread releases pooled buffers once they have been idle for the configured time. The
+ * vgem backend is given metadata and purgeable hooks, so its buffers qualify for the pool.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "drv_priv.h"
+#include "fake_drm.h"
+#include "helpers.h"
+#include "util.h"
+
+#define WIDTH 64
+#define HEIGHT 64
+#define BUFFER_SIZE (WIDTH * HEIGHT * 4)
+
+static uint32_t created;
+static uint32_t destroyed;
+
+static int compute_metadata(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+			    uint64_t use_flags, const uint64_t *modifiers, uint32_t count)
+{
+	return drv_bo_from_format(bo, width * 4, height, format);
+}
+
+static int create_from_metadata(struct bo *bo)
+{
+	size_t plane;
+	uint32_t handle = fake_drm_create_handle(bo->meta.total_size);
+
+	__atomic_add_fetch(&created, 1, __ATOMIC_RELAXED);
+	for (plane = 0; plane < bo->meta.num_planes; plane++)
+		bo->handles[plane].u32 = handle;
+
+	return 0;
+}
+
+static int destroy(struct bo *bo)
+{
+	__atomic_add_fetch(&destroyed, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int set_purgeable(struct bo *bo, bool purgeable)
+{
+	/* The pages are always retained. */
+	return 1;
+}
+
+static uint32_t num_destroyed(void)
+{
+	return __atomic_load_n(&destroyed, __ATOMIC_RELAXED);
+}
+
+static uint32_t num_created(void)
+{
+	return __atomic_load_n(&created, __ATOMIC_RELAXED);
+}
+
+/* Creates a buffer of the test size, and returns whether it came from the pool. */
+static bool create_pooled(struct driver *drv, uint32_t format, uint64_t use_flags,
+			  struct bo **bo)
+{
+	uint32_t start = num_created();
+
+	*bo = drv_bo_create(drv, WIDTH, HEIGHT, format, use_flags);
+	assert(*bo);
+	return num_created() == start;
+}
+
+static void create_and_destroy(struct driver *drv, uint32_t count, uint32_t height)
+{
+	struct bo *bos[64];
+	uint32_t i;
+
+	assert(count <= ARRAY_SIZE(bos));
+	for (i = 0; i < count; i++) {
+		bos[i] = drv_bo_create(drv, WIDTH, height, DRM_FORMAT_XRGB8888, BO_USE_TEXTURE);
+		assert(bos[i]);
+	}
+
+	for (i = 0; i < count; i++)
+		drv_bo_destroy(bos[i]);
+}
+
+static void test_buckets(struct driver *drv)
+{
+	struct bo *bo, *other_format, *other_use, *same;
+
+	drv_bo_pool_configure(drv, 40 * BUFFER_SIZE, 60 * 1000);
+
+	bo = drv_bo_create(drv, WIDTH, HEIGHT, DRM_FORMAT_XRGB8888, BO_USE_TEXTURE);
+	assert(bo);
+	drv_bo_destroy(bo);
+
+	/* Same size and layout, but possibly a different memory domain. */
+	assert(!create_pooled(drv, DRM_FORMAT_ARGB8888, BO_USE_TEXTURE, &other_format));
+	assert(!create_pooled(drv, DRM_FORMAT_XRGB8888, BO_USE_TEXTURE | BO_USE_SW_READ_OFTEN,
+			      &other_use));
+	assert(create_pooled(drv, DRM_FORMAT_XRGB8888, BO_USE_TEXTURE, &same));
+
+	drv_bo_destroy(same);
+	drv_bo_destroy(other_use);
+	drv_bo_destroy(other_format);
+	drv_bo_pool_trim(drv, 0);
+	assert(num_destroyed() == 3);
+}
+
+static void test_budget(struct driver *drv)
+{
+	uint32_t start = num_destroyed();
+
+	drv_bo_pool_configure(drv, 40 * BUFFER_SIZE, 60 * 1000);
+
+	create_and_destroy(drv, 40, HEIGHT);
+	assert(num_destroyed() == start);
+
+	/* Pooling a buffer of 32 small ones has to evict more than one batch of them. */
+	create_and_destroy(drv, 1, 32 * HEIGHT);
+	assert(num_destroyed() == start + 32);
+
+	drv_bo_pool_trim(drv, 0);
+	assert(num_destroyed() == start + 41);
+}
+
+static void test_idle_trim(struct driver *drv)
+{
+	uint32_t start = num_destroyed();
+	int i;
+
+	assert(!drv_bo_reaper_configure(drv, 8));
+	drv_bo_pool_configure(drv, 40 * BUFFER_SIZE, 50);
+
+	create_and_destroy(drv, 5, HEIGHT);
+	drv_bo_reaper_flush(drv);
+	assert(num_destroyed() == start);
+
+	/* Nothing else is released, so only the reaper can trim the pool. */
+	for (i = 0; i < 100 && num_destroyed() != start + 5; i++)
+		usleep(10 * 1000);
+
+	assert(num_destroyed() == start + 5);
+	assert(!drv_bo_reaper_configure(drv, 0));
+}
+
+int main(void)
+{
+	struct driver *drv;
+	struct backend backend;
+
+	drv = drv_create(fake_drm_open(NULL));
+	assert(drv && !drv_init(drv, 0));
+
+	backend = *drv->backend;
+	backend.bo_create = NULL;
+	backend.bo_compute_metadata = compute_metadata;
+	backend.bo_create_from_metadata = create_from_metadata;
+	backend.bo_destroy = destroy;
+	backend.bo_set_purgeable = set_purgeable;
+	drv->backend = &backend;
+
+	test_buckets(drv);
+	test_budget(drv);
+	test_idle_trim(drv);
+
+	drv_destroy(drv);
+	printf("pool_test: passed\n");
+	return 0;
+}
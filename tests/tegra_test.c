@@ -0,0 +1,347 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Checks the Tegra block-linear detiler against the per-pixel path it replaced, and times both.
+ * tegra.c is included directly so its static transfer functions can be called on plain memory.
+ *
+ * Run without arguments for the correctness tests, or name a test, or "all" to include the
+ * benchmark.
+ */
+
+#define DRV_TEGRA
+#include "../tegra.c"
+
+#include <stdlib.h>
+#include <time.h>
+
+#define CHECK(cond)                                                                                \
+	do {                                                                                       \
+		if (!(cond)) {                                                                     \
+			fprintf(stderr, "[  FAILED  ] check in %s() %s:%d\n", __func__, __FILE__,  \
+				__LINE__);                                                         \
+			return 0;                                                                  \
+		}                                                                                  \
+	} while (0)
+
+#define BENCHMARK_ITERATIONS 20
+
+struct surface {
+	struct bo bo;
+	uint8_t *tiled;
+	uint8_t *untiled;
+};
+
+/*
+ * The per-pixel transfer that transfer_gob() replaced, kept as the reference. It walks the
+ * pixels of a GOB in storage order and unswizzles each one's position.
+ */
+static void scalar_transfer_tile(struct bo *bo, uint8_t *tiled, uint8_t *untiled,
+				 enum tegra_map_type type, uint32_t bytes_per_pixel,
+				 uint32_t gob_top, uint32_t gob_left, uint32_t gob_size_pixels,
+				 uint8_t *tiled_last)
+{
+	uint8_t *tmp;
+	uint32_t x, y, k;
+	for (k = 0; k < gob_size_pixels; k++) {
+		x = gob_left + (((k >> 3) & 8) | ((k >> 1) & 4) | (k & 3));
+		y = gob_top + ((k >> 7 << 3) | ((k >> 3) & 6) | ((k >> 2) & 1));
+
+		if (tiled >= tiled_last)
+			return;
+
+		if (x >= bo->meta.width || y >= bo->meta.height) {
+			tiled += bytes_per_pixel;
+			continue;
+		}
+
+		tmp = untiled + y * bo->meta.strides[0] + x * bytes_per_pixel;
+
+		if (type == TEGRA_READ_TILED_BUFFER)
+			memcpy(tmp, tiled, bytes_per_pixel);
+		else if (type == TEGRA_WRITE_TILED_BUFFER)
+			memcpy(tiled, tmp, bytes_per_pixel);
+
+		tiled += bytes_per_pixel;
+	}
+}
+
+static void scalar_transfer_tiled_memory(struct bo *bo, uint8_t *tiled, uint8_t *untiled,
+					 enum tegra_map_type type)
+{
+	uint32_t gob_width, gob_height, gob_size_bytes, gob_size_pixels, gob_count_x, gob_count_y,
+	    gob_top, gob_left;
+	uint32_t i, j, offset;
+	uint8_t *tmp, *tiled_last;
+	uint32_t bytes_per_pixel = drv_stride_from_format(bo->meta.format, 1, 0);
+
+	gob_width = DIV_ROUND_UP(NV_BLOCKLINEAR_GOB_WIDTH, bytes_per_pixel);
+	gob_height = NV_BLOCKLINEAR_GOB_HEIGHT * (1 << NV_DEFAULT_BLOCK_HEIGHT_LOG2);
+	while (gob_height > NV_BLOCKLINEAR_GOB_HEIGHT && gob_height >= 2 * bo->meta.height)
+		gob_height /= 2;
+
+	gob_size_bytes = gob_height * NV_BLOCKLINEAR_GOB_WIDTH;
+	gob_size_pixels = gob_height * gob_width;
+
+	gob_count_x = DIV_ROUND_UP(bo->meta.strides[0], NV_BLOCKLINEAR_GOB_WIDTH);
+	gob_count_y = DIV_ROUND_UP(bo->meta.height, gob_height);
+
+	tiled_last = tiled + bo->meta.total_size;
+
+	offset = 0;
+	for (j = 0; j < gob_count_y; j++) {
+		gob_top = j * gob_height;
+		for (i = 0; i < gob_count_x; i++) {
+			tmp = tiled + offset;
+			gob_left = i * gob_width;
+
+			scalar_transfer_tile(bo, tmp, untiled, type, bytes_per_pixel, gob_top,
+					     gob_left, gob_size_pixels, tiled_last);
+
+			offset += gob_size_bytes;
+		}
+	}
+}
+
+/* Lays out an ARGB surface the way tegra_bo_create() does for block-linear buffers. */
+static int surface_init(struct surface *s, uint32_t width, uint32_t height)
+{
+	enum nv_mem_kind kind;
+	uint32_t block_height_log2, size;
+
+	memset(s, 0, sizeof(*s));
+	s->bo.meta.width = width;
+	s->bo.meta.height = height;
+	s->bo.meta.format = DRM_FORMAT_ARGB8888;
+	compute_layout_blocklinear(width, height, DRM_FORMAT_ARGB8888, &kind, &block_height_log2,
+				   &s->bo.meta.strides[0], &size);
+	s->bo.meta.total_size = size;
+
+	s->tiled = calloc(1, s->bo.meta.total_size);
+	s->untiled = calloc(1, s->bo.meta.total_size);
+	return s->tiled && s->untiled;
+}
+
+static void surface_fini(struct surface *s)
+{
+	free(s->tiled);
+	free(s->untiled);
+}
+
+static uint8_t *copy_of(const uint8_t *data, size_t size)
+{
+	uint8_t *copy = malloc(size);
+
+	if (copy)
+		memcpy(copy, data, size);
+	return copy;
+}
+
+static void fill_random(uint8_t *data, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		data[i] = rand();
+}
+
+// clang-format off
+static const uint32_t test_sizes[][2] = {
+	{ 1, 1 }, { 3, 5 }, { 16, 200 }, { 17, 9 }, { 64, 64 },
+	{ 100, 37 }, { 250, 300 }, { 333, 129 }, { 1920, 1080 },
+};
+// clang-format on
+
+/* Whole surfaces must match the scalar path in both directions. */
+static int test_full_surface(void)
+{
+	struct surface s;
+	struct rectangle rect;
+	uint8_t *expected;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(test_sizes); i++) {
+		CHECK(surface_init(&s, test_sizes[i][0], test_sizes[i][1]));
+		rect = (struct rectangle){ 0, 0, s.bo.meta.width, s.bo.meta.height };
+
+		fill_random(s.tiled, s.bo.meta.total_size);
+		expected = calloc(1, s.bo.meta.total_size);
+		CHECK(expected);
+		scalar_transfer_tiled_memory(&s.bo, s.tiled, expected, TEGRA_READ_TILED_BUFFER);
+		transfer_tiled_memory(&s.bo, s.tiled, s.untiled, TEGRA_READ_TILED_BUFFER, &rect);
+		CHECK(!memcmp(expected, s.untiled, s.bo.meta.total_size));
+
+		memset(expected, 0, s.bo.meta.total_size);
+		memset(s.tiled, 0, s.bo.meta.total_size);
+		scalar_transfer_tiled_memory(&s.bo, expected, s.untiled, TEGRA_WRITE_TILED_BUFFER);
+		transfer_tiled_memory(&s.bo, s.tiled, s.untiled, TEGRA_WRITE_TILED_BUFFER, &rect);
+		CHECK(!memcmp(expected, s.tiled, s.bo.meta.total_size));
+
+		free(expected);
+		surface_fini(&s);
+	}
+
+	return 1;
+}
+
+/*
+ * Writing a sub-rectangle must leave the tiled surface as a whole-surface scalar write would,
+ * when only that rectangle changed, and reading it back must only touch the rectangle.
+ */
+static int test_sub_rectangles(void)
+{
+	struct surface s;
+	struct rectangle rect;
+	uint8_t *written, *expected, *read;
+	uint32_t x, y, stride;
+	size_t i;
+	int k;
+
+	srand(1);
+	for (i = 0; i < ARRAY_SIZE(test_sizes); i++) {
+		CHECK(surface_init(&s, test_sizes[i][0], test_sizes[i][1]));
+		stride = s.bo.meta.strides[0];
+
+		fill_random(s.untiled, s.bo.meta.total_size);
+		scalar_transfer_tiled_memory(&s.bo, s.tiled, s.untiled, TEGRA_WRITE_TILED_BUFFER);
+
+		for (k = 0; k < 100; k++) {
+			rect.x = rand() % s.bo.meta.width;
+			rect.y = rand() % s.bo.meta.height;
+			rect.width = 1 + rand() % (s.bo.meta.width - rect.x);
+			rect.height = 1 + rand() % (s.bo.meta.height - rect.y);
+
+			written = copy_of(s.untiled, s.bo.meta.total_size);
+			expected = copy_of(s.tiled, s.bo.meta.total_size);
+			read = copy_of(s.untiled, s.bo.meta.total_size);
+			CHECK(written && expected && read);
+
+			for (y = rect.y; y < rect.y + rect.height; y++)
+				for (x = rect.x * 4; x < (rect.x + rect.width) * 4; x++)
+					written[y * stride + x] ^= 0x5a;
+
+			scalar_transfer_tiled_memory(&s.bo, expected, written,
+						     TEGRA_WRITE_TILED_BUFFER);
+			transfer_tiled_memory(&s.bo, s.tiled, written, TEGRA_WRITE_TILED_BUFFER,
+					      &rect);
+			CHECK(!memcmp(expected, s.tiled, s.bo.meta.total_size));
+
+			transfer_tiled_memory(&s.bo, s.tiled, read, TEGRA_READ_TILED_BUFFER, &rect);
+			CHECK(!memcmp(written, read, s.bo.meta.total_size));
+
+			/* Keep the surfaces in step for the next rectangle. */
+			memcpy(s.untiled, written, s.bo.meta.total_size);
+			free(written);
+			free(expected);
+			free(read);
+		}
+
+		surface_fini(&s);
+	}
+
+	return 1;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Prints the throughput of both paths for whole 1080p and 4K surfaces. */
+static int test_benchmark(void)
+{
+	static const uint32_t sizes[][2] = { { 1920, 1080 }, { 3840, 2160 } };
+	static const char *const directions[] = { "detile", "tile" };
+	struct surface s;
+	struct rectangle rect;
+	double start, scalar, runs, bytes;
+	size_t i;
+	int type, k;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		CHECK(surface_init(&s, sizes[i][0], sizes[i][1]));
+		rect = (struct rectangle){ 0, 0, s.bo.meta.width, s.bo.meta.height };
+		bytes = (double)BENCHMARK_ITERATIONS * s.bo.meta.width * s.bo.meta.height * 4;
+
+		for (type = TEGRA_READ_TILED_BUFFER; type <= TEGRA_WRITE_TILED_BUFFER; type++) {
+			start = now();
+			for (k = 0; k < BENCHMARK_ITERATIONS; k++)
+				scalar_transfer_tiled_memory(&s.bo, s.tiled, s.untiled, type);
+			scalar = now() - start;
+
+			start = now();
+			for (k = 0; k < BENCHMARK_ITERATIONS; k++)
+				transfer_tiled_memory(&s.bo, s.tiled, s.untiled, type, &rect);
+			runs = now() - start;
+
+			printf("%ux%u %-6s: scalar %6.2f GB/s, runs %6.2f GB/s\n", s.bo.meta.width,
+			       s.bo.meta.height, directions[type], bytes / scalar / 1e9,
+			       bytes / runs / 1e9);
+		}
+
+		surface_fini(&s);
+	}
+
+	return 1;
+}
+
+struct tegra_testcase {
+	const char *name;
+	int (*run_test)(void);
+	/* Benchmarks only run when named, or for "all". */
+	int benchmark;
+};
+
+// clang-format off
+static const struct tegra_testcase tests[] = {
+	{ "full_surface", test_full_surface, 0 },
+	{ "sub_rectangles", test_sub_rectangles, 0 },
+	{ "benchmark", test_benchmark, 1 },
+};
+// clang-format on
+
+static void print_help(const char *argv0)
+{
+	size_t i;
+
+	printf("usage: %s [test_name]\n\n", argv0);
+	printf("A valid name test is one the following:\n");
+	for (i = 0; i < ARRAY_SIZE(tests); i++)
+		printf("%s\n", tests[i].name);
+	printf("all\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name = argc > 1 ? argv[1] : NULL;
+	int ret = 0, found = 0;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(tests); i++) {
+		if (name ? strcmp(name, "all") && strcmp(name, tests[i].name)
+			 : tests[i].benchmark)
+			continue;
+
+		found = 1;
+		printf("[ RUN      ] tegratest.%s\n", tests[i].name);
+		if (!tests[i].run_test()) {
+			fprintf(stderr, "[  FAILED  ] tegratest.%s\n", tests[i].name);
+			ret = 1;
+		} else {
+			printf("[  PASSED  ] tegratest.%s\n", tests[i].name);
+		}
+	}
+
+	if (!found) {
+		print_help(argv[0]);
+		return 1;
+	}
+
+	return ret;
+}
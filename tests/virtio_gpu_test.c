@@ -0,0 +1,232 @@
+/*
+ * Copyright 2021 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Runs the virtio_gpu backend against the stand-in device in fake_virtgpu.c, configured with and
+ * without each part of the blob path, and checks which buffers become blob resources and which
+ * of their flushes and invalidates reach the host:
+ *  - blob: buffers the CPU accesses often are host-visible blobs, CPU-only ones guest blobs.
+ *  - fallback: without the params or the capset bit, or when the host refuses a blob, they are
+ *    regular resources.
+ *  - skip-transfer: mappings of blobs and of CPU-only buffers issue no transfers, while other
+ *    buffers keep theirs. Imported buffers behave like the ones they were exported from, since
+ *    the backend learns their blob_mem from VIRTGPU_RESOURCE_INFO.
+ * virtio_gpu.c is included directly so the process-wide probe cache can be dropped between
+ * configurations; every fake device has the same st_rdev.
+ */
+
+#include "../virtio_gpu.c"
+
+#include <assert.h>
+
+#include "fake_drm.h"
+#include "fake_virtgpu.h"
+
+#define WIDTH 64
+#define HEIGHT 64
+
+enum buffer_kind {
+	/* Written and read often by the CPU, and rendered to by the host. */
+	BUFFER_GPU_OFTEN,
+	/* Only ever accessed by the CPU. */
+	BUFFER_CPU_ONLY,
+	/* Rendered to by the host and rarely accessed by the CPU. */
+	BUFFER_GPU_RARELY,
+	NUM_BUFFER_KINDS,
+};
+
+static const uint64_t buffer_use_flags[NUM_BUFFER_KINDS] = {
+	BO_USE_SW_READ_OFTEN | BO_USE_SW_WRITE_OFTEN | BO_USE_RENDERING | BO_USE_TEXTURE,
+	BO_USE_SW_READ_OFTEN | BO_USE_SW_WRITE_OFTEN,
+	BO_USE_SW_READ_RARELY | BO_USE_SW_WRITE_RARELY | BO_USE_RENDERING,
+};
+
+struct expectation {
+	/* The blob_mem of the buffer's blob, or 0 for a regular resource. */
+	uint32_t blob_mem;
+	bool transfers;
+};
+
+struct test_case {
+	const char *name;
+	struct fake_virtgpu_config config;
+	struct expectation expected[NUM_BUFFER_KINDS];
+};
+
+static const struct test_case test_cases[] = {
+	{ "blob",
+	  { .resource_blob = true, .host_visible = true, .caps_blob = true, .caps_transfer = true },
+	  { { VIRTGPU_BLOB_MEM_HOST3D, false },
+	    { VIRTGPU_BLOB_MEM_GUEST, false },
+	    { 0, true } } },
+	{ "blob, transfer ioctls",
+	  { .resource_blob = true, .host_visible = true, .caps_blob = true },
+	  { { VIRTGPU_BLOB_MEM_HOST3D, false },
+	    { VIRTGPU_BLOB_MEM_GUEST, false },
+	    { 0, true } } },
+	{ "no resource blob param",
+	  { .host_visible = true, .caps_blob = true, .caps_transfer = true },
+	  { { 0, true }, { 0, true }, { 0, true } } },
+	{ "no host visible param",
+	  { .resource_blob = true, .caps_blob = true, .caps_transfer = true },
+	  { { 0, true }, { VIRTGPU_BLOB_MEM_GUEST, false }, { 0, true } } },
+	{ "no blob capset bit",
+	  { .resource_blob = true, .host_visible = true, .caps_transfer = true },
+	  { { 0, true }, { VIRTGPU_BLOB_MEM_GUEST, false }, { 0, true } } },
+	/* The host never reads CPU-only buffers, so they skip transfers as resources too. */
+	{ "blob creation fails",
+	  { .resource_blob = true,
+	    .host_visible = true,
+	    .caps_blob = true,
+	    .caps_transfer = true,
+	    .fail_blob = true },
+	  { { 0, true }, { 0, false }, { 0, true } } },
+};
+
+static struct driver *open_driver(const struct fake_virtgpu_config *config)
+{
+	struct driver *drv;
+
+	pthread_mutex_lock(&probe_lock);
+	probe_cached = false;
+	pthread_mutex_unlock(&probe_lock);
+
+	drv = drv_create(fake_virtgpu_open(config));
+	assert(drv && !drv_init(drv, 0));
+	assert(!strcmp(drv_get_name(drv), "virtio_gpu"));
+	return drv;
+}
+
+/* Writes to a mapping of bo, flushes and invalidates it, and returns the transfers issued. */
+static uint32_t map_and_flush(struct bo *bo)
+{
+	struct rectangle rect = { 0, 0, WIDTH, HEIGHT };
+	struct fake_virtgpu_stats before, after;
+	struct mapping *mapping;
+	void *addr;
+
+	addr = drv_bo_map(bo, &rect, BO_MAP_READ_WRITE, &mapping, 0);
+	assert(addr != MAP_FAILED);
+
+	fake_virtgpu_get_stats(&before);
+	memset(addr, 0xff, drv_bo_get_plane_stride(bo, 0));
+	assert(!drv_bo_flush(bo, mapping));
+	assert(!drv_bo_invalidate(bo, mapping));
+	fake_virtgpu_get_stats(&after);
+
+	assert(!drv_bo_unmap(bo, mapping));
+
+	/* A mapping that skips transfers doesn't submit anything to the host either. */
+	if (after.transfers == before.transfers)
+		assert(after.submissions == before.submissions);
+
+	return after.transfers - before.transfers;
+}
+
+static void check_buffer(struct driver *drv, uint64_t use_flags,
+			 const struct expectation *expected)
+{
+	struct fake_virtgpu_stats before, after;
+	struct bo *bo;
+
+	fake_virtgpu_get_stats(&before);
+	bo = drv_bo_create(drv, WIDTH, HEIGHT, DRM_FORMAT_ABGR8888, use_flags);
+	assert(bo);
+	fake_virtgpu_get_stats(&after);
+
+	/* Blob state stays in the backend rather than in metadata gralloc hands out. */
+	assert(bo->meta.tiling == 0);
+
+	if (expected->blob_mem) {
+		assert(after.blobs == before.blobs + 1);
+		assert(after.last_blob_mem == expected->blob_mem);
+		assert(after.resources == before.resources);
+	} else {
+		assert(after.blobs == before.blobs);
+		assert(after.resources == before.resources + 1);
+	}
+
+	assert((map_and_flush(bo) > 0) == expected->transfers);
+	drv_bo_destroy(bo);
+}
+
+/*
+ * Drops what the backend recorded when it created the buffer behind handle, as if another process
+ * had created it.
+ */
+static void forget_resource(struct driver *drv, uint32_t handle)
+{
+	struct virtio_gpu_priv *priv = drv->priv;
+
+	pthread_mutex_lock(&priv->res_lock);
+	drv_hash_remove(priv->res_handles, &handle);
+	drv_hash_remove(priv->blob_handles, &handle);
+	pthread_mutex_unlock(&priv->res_lock);
+}
+
+/*
+ * An import of a buffer from another process must learn the buffer's blob_mem from the kernel,
+ * and flush and invalidate like the buffer.
+ */
+static void check_imported(struct driver *drv, uint64_t use_flags,
+			   const struct expectation *expected)
+{
+	struct drv_import_fd_data data;
+	struct bo *bo, *imported;
+	uint32_t res_handle, blob_mem;
+
+	bo = drv_bo_create(drv, WIDTH, HEIGHT, DRM_FORMAT_ABGR8888, use_flags);
+	assert(bo);
+
+	memset(&data, 0, sizeof(data));
+	data.fds[0] = drv_bo_get_plane_fd(bo, 0);
+	assert(data.fds[0] >= 0);
+	data.strides[0] = drv_bo_get_plane_stride(bo, 0);
+	data.offsets[0] = drv_bo_get_plane_offset(bo, 0);
+	data.format_modifiers[0] = DRM_FORMAT_MOD_LINEAR;
+	data.width = WIDTH;
+	data.height = HEIGHT;
+	data.format = DRM_FORMAT_ABGR8888;
+	data.use_flags = use_flags;
+
+	forget_resource(drv, bo->handles[0].u32);
+	imported = drv_bo_import(drv, &data);
+	assert(imported);
+	close(data.fds[0]);
+
+	assert(!virtio_gpu_lookup_resource(drv, imported->handles[0].u32, &res_handle, &blob_mem));
+	assert(blob_mem == expected->blob_mem);
+	assert(imported->meta.tiling == 0);
+	assert((map_and_flush(imported) > 0) == expected->transfers);
+
+	drv_bo_destroy(imported);
+	drv_bo_destroy(bo);
+}
+
+int main(void)
+{
+	const struct test_case *test;
+	struct driver *drv;
+	size_t i, kind;
+	int fd;
+
+	for (i = 0; i < ARRAY_SIZE(test_cases); i++) {
+		test = &test_cases[i];
+		drv = open_driver(&test->config);
+
+		for (kind = 0; kind < NUM_BUFFER_KINDS; kind++) {
+			check_buffer(drv, buffer_use_flags[kind], &test->expected[kind]);
+			check_imported(drv, buffer_use_flags[kind], &test->expected[kind]);
+		}
+
+		fd = drv_get_fd(drv);
+		drv_destroy(drv);
+		close(fd);
+		printf("virtio_gpu_test: %s passed\n", test->name);
+	}
+
+	return 0;
+}
@@ -6,14 +6,22 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <xf86drm.h>
 
 #include "drv_priv.h"
 #include "helpers.h"
+#include "helpers_hash.h"
 #include "util.h"
 #include "virgl_hw.h"
 #include "virtgpu_drm.h"
@@ -23,6 +31,43 @@
 #endif
 #define PIPE_TEXTURE_2D 2
 
+/* From virglrenderer's virgl_protocol.h, for creating host resources backing blobs. */
+#define VIRGL_CMD0(cmd, obj, len) ((cmd) | ((obj) << 8) | ((len) << 16))
+#define VIRGL_CCMD_PIPE_RESOURCE_CREATE 48
+#define VIRGL_PIPE_RES_CREATE_SIZE 11
+#define VIRGL_PIPE_RES_CREATE_FORMAT 1
+#define VIRGL_PIPE_RES_CREATE_BIND 2
+#define VIRGL_PIPE_RES_CREATE_TARGET 3
+#define VIRGL_PIPE_RES_CREATE_WIDTH 4
+#define VIRGL_PIPE_RES_CREATE_HEIGHT 5
+#define VIRGL_PIPE_RES_CREATE_DEPTH 6
+#define VIRGL_PIPE_RES_CREATE_ARRAY_SIZE 7
+#define VIRGL_PIPE_RES_CREATE_LAST_LEVEL 8
+#define VIRGL_PIPE_RES_CREATE_NR_SAMPLES 9
+#define VIRGL_PIPE_RES_CREATE_FLAGS 10
+#define VIRGL_PIPE_RES_CREATE_BLOB_ID 11
+
+/* Also from virgl_protocol.h, for encoding transfers into command buffers. */
+#define VIRGL_CCMD_TRANSFER3D 43
+#define VIRGL_TRANSFER3D_SIZE 13
+#define VIRGL_RESOURCE_IW_RES_HANDLE 1
+#define VIRGL_RESOURCE_IW_LEVEL 2
+#define VIRGL_RESOURCE_IW_USAGE 3
+#define VIRGL_RESOURCE_IW_STRIDE 4
+#define VIRGL_RESOURCE_IW_LAYER_STRIDE 5
+#define VIRGL_RESOURCE_IW_X 6
+#define VIRGL_RESOURCE_IW_Y 7
+#define VIRGL_RESOURCE_IW_Z 8
+#define VIRGL_RESOURCE_IW_W 9
+#define VIRGL_RESOURCE_IW_H 10
+#define VIRGL_RESOURCE_IW_D 11
+#define VIRGL_TRANSFER3D_DATA_OFFSET 12
+#define VIRGL_TRANSFER3D_DIRECTION 13
+#define VIRGL_TRANSFER_TO_HOST 1
+#define VIRGL_TRANSFER_FROM_HOST 2
+
+#define VIRTIO_GPU_TRANSFER_DWORDS (VIRGL_TRANSFER3D_SIZE + 1)
+
 #define MESA_LLVMPIPE_TILE_ORDER 6
 #define MESA_LLVMPIPE_TILE_SIZE (1 << MESA_LLVMPIPE_TILE_ORDER)
 
@@ -35,6 +80,8 @@ struct feature {
 enum feature_id {
 	feat_3d,
 	feat_capset_fix,
+	feat_resource_blob,
+	feat_host_visible,
 	feat_max,
 };
 
@@ -45,7 +92,9 @@ enum feature_id {
 	}
 
 static struct feature features[] = { FEATURE(VIRTGPU_PARAM_3D_FEATURES),
-				     FEATURE(VIRTGPU_PARAM_CAPSET_QUERY_FIX) };
+				     FEATURE(VIRTGPU_PARAM_CAPSET_QUERY_FIX),
+				     FEATURE(VIRTGPU_PARAM_RESOURCE_BLOB),
+				     FEATURE(VIRTGPU_PARAM_HOST_VISIBLE) };
 
 static const uint32_t render_target_formats[] = { DRM_FORMAT_ABGR8888, DRM_FORMAT_ARGB8888,
 						  DRM_FORMAT_RGB565, DRM_FORMAT_XBGR8888,
@@ -64,6 +113,18 @@ struct virtio_gpu_priv {
 	int caps_is_v2;
 	union virgl_caps caps;
 	int host_gbm_enabled;
+	uint32_t next_blob_id;
+	// Whether transfers are encoded into command buffers rather than issued as an ioctl each.
+	int encoded_transfers;
+	// Host resource ids by GEM handle, which encoded transfers refer to, and the blob_mem of
+	// the handles that are blobs. Both are recorded when a buffer is created or imported.
+	pthread_mutex_t res_lock;
+	struct drv_hash *res_handles;
+	struct drv_hash *blob_handles;
+	// Mappings flushed with transfers, the transfers, and the requests they were submitted in.
+	uint64_t flushes;
+	uint64_t transfers;
+	uint64_t submissions;
 };
 
 static uint32_t translate_format(uint32_t drm_fourcc)
@@ -436,6 +497,199 @@ static uint32_t use_flags_to_bind(uint64_t use_flags)
 	return bind;
 }
 
+// Whether the buffer is only ever accessed by the guest CPU, so the host never reads or writes it.
+static bool virtio_gpu_is_cpu_only(uint64_t use_flags)
+{
+	return (use_flags & BO_USE_SW_MASK) &&
+	       !(use_flags & ~(BO_USE_SW_MASK | BO_USE_LINEAR | BO_USE_TEST_ALLOC));
+}
+
+// Buffers that are accessed from the CPU often are backed by blob resources when the host supports
+// them, so that their mappings reach the memory the host uses directly. Buffers that the host never
+// touches can simply live in guest memory; all others need host memory the guest can map.
+static bool virtio_gpu_supports_blob(struct driver *drv, uint64_t use_flags)
+{
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+
+	if (!features[feat_resource_blob].enabled)
+		return false;
+
+	if (virtio_gpu_is_cpu_only(use_flags))
+		return true;
+
+	if (!(use_flags & (BO_USE_SW_READ_OFTEN | BO_USE_SW_WRITE_OFTEN)))
+		return false;
+
+	return features[feat_host_visible].enabled && priv->caps_is_v2 &&
+	       (priv->caps.v2.capability_bits_v2 & VIRGL_CAP_V2_BLOB);
+}
+
+// blob_mem is the VIRTGPU_BLOB_MEM_* of a blob resource, or 0 for a regular one.
+static void virtio_gpu_set_resource(struct driver *drv, uint32_t handle, uint32_t res_handle,
+				    uint32_t blob_mem)
+{
+	int ret;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+
+	pthread_mutex_lock(&priv->res_lock);
+	ret = drv_hash_insert(priv->res_handles, &handle, (void *)(uintptr_t)res_handle);
+	if (!ret && blob_mem)
+		ret = drv_hash_insert(priv->blob_handles, &handle, (void *)(uintptr_t)blob_mem);
+	else if (!ret)
+		drv_hash_remove(priv->blob_handles, &handle);
+	pthread_mutex_unlock(&priv->res_lock);
+
+	if (ret)
+		drv_log("Failed to record resource handle\n");
+}
+
+// Kernels since chromeos-5.10 report the blob_mem of blob resources where older ones reported
+// the stride of plane 0, which is never as small as a blob_mem.
+static uint32_t virtio_gpu_resource_info_blob_mem(const struct drm_virtgpu_resource_info *res_info)
+{
+	switch (res_info->blob_mem) {
+	case VIRTGPU_BLOB_MEM_GUEST:
+	case VIRTGPU_BLOB_MEM_HOST3D:
+	case VIRTGPU_BLOB_MEM_HOST3D_GUEST:
+		return res_info->blob_mem;
+	default:
+		return 0;
+	}
+}
+
+// Asks the kernel about the resource of a handle this driver didn't create, and records it.
+static int virtio_gpu_query_resource(struct driver *drv, uint32_t handle)
+{
+	int ret;
+	struct drm_virtgpu_resource_info res_info;
+
+	memset(&res_info, 0, sizeof(res_info));
+	res_info.bo_handle = handle;
+	ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO, &res_info);
+	if (ret) {
+		drv_log("DRM_IOCTL_VIRTGPU_RESOURCE_INFO failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	virtio_gpu_set_resource(drv, handle, res_info.res_handle,
+				virtio_gpu_resource_info_blob_mem(&res_info));
+	return 0;
+}
+
+static int virtio_gpu_lookup_resource(struct driver *drv, uint32_t handle, uint32_t *res_handle,
+				      uint32_t *blob_mem)
+{
+	int ret;
+	void *value;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+
+	pthread_mutex_lock(&priv->res_lock);
+	ret = drv_hash_lookup(priv->res_handles, &handle, &value);
+	if (!ret) {
+		*res_handle = (uint32_t)(uintptr_t)value;
+		*blob_mem = 0;
+		if (!drv_hash_lookup(priv->blob_handles, &handle, &value))
+			*blob_mem = (uint32_t)(uintptr_t)value;
+	}
+	pthread_mutex_unlock(&priv->res_lock);
+
+	return ret;
+}
+
+// Looks up the host resource id and blob_mem of handle, querying them if they aren't known.
+static int virtio_gpu_get_resource(struct driver *drv, uint32_t handle, uint32_t *res_handle,
+				   uint32_t *blob_mem)
+{
+	int ret;
+
+	if (!virtio_gpu_lookup_resource(drv, handle, res_handle, blob_mem))
+		return 0;
+
+	ret = virtio_gpu_query_resource(drv, handle);
+	if (ret)
+		return ret;
+
+	return virtio_gpu_lookup_resource(drv, handle, res_handle, blob_mem) ? -ENOMEM : 0;
+}
+
+static int virtio_gpu_get_res_handle(struct driver *drv, uint32_t handle, uint32_t *res_handle)
+{
+	uint32_t blob_mem;
+
+	return virtio_gpu_get_resource(drv, handle, res_handle, &blob_mem);
+}
+
+// Mappings of blob resources are the memory the host uses, so they never need transfers. CPU-only
+// buffers are decided on from the use flags alone, and need no transfers even as regular
+// resources since the host never accesses them.
+static bool virtio_gpu_bo_skips_transfers(struct bo *bo)
+{
+	uint32_t res_handle, blob_mem;
+
+	if (features[feat_resource_blob].enabled && virtio_gpu_is_cpu_only(bo->meta.use_flags))
+		return true;
+
+	if (!features[feat_resource_blob].enabled)
+		return false;
+
+	return !virtio_gpu_get_resource(bo->drv, bo->handles[0].u32, &res_handle, &blob_mem) &&
+	       blob_mem;
+}
+
+static int virtio_virgl_blob_create(struct bo *bo, uint32_t width, uint32_t height,
+				    uint32_t format, uint64_t use_flags)
+{
+	int ret;
+	uint32_t cmd[VIRGL_PIPE_RES_CREATE_SIZE + 1];
+	struct drm_virtgpu_resource_create_blob blob_create;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+
+	memset(&blob_create, 0, sizeof(blob_create));
+	blob_create.blob_flags = VIRTGPU_BLOB_FLAG_USE_MAPPABLE | VIRTGPU_BLOB_FLAG_USE_SHAREABLE;
+	blob_create.size = ALIGN(bo->meta.total_size, PAGE_SIZE);
+
+	if (virtio_gpu_is_cpu_only(use_flags)) {
+		blob_create.blob_mem = VIRTGPU_BLOB_MEM_GUEST;
+	} else {
+		// The host resource is created like a regular one, and then exposed as the blob
+		// with the matching id.
+		blob_create.blob_mem = VIRTGPU_BLOB_MEM_HOST3D;
+		blob_create.blob_id = __atomic_add_fetch(&priv->next_blob_id, 1, __ATOMIC_RELAXED);
+
+		memset(cmd, 0, sizeof(cmd));
+		cmd[0] = VIRGL_CMD0(VIRGL_CCMD_PIPE_RESOURCE_CREATE, 0, VIRGL_PIPE_RES_CREATE_SIZE);
+		cmd[VIRGL_PIPE_RES_CREATE_FORMAT] = translate_format(format);
+		cmd[VIRGL_PIPE_RES_CREATE_BIND] = use_flags_to_bind(use_flags);
+		cmd[VIRGL_PIPE_RES_CREATE_TARGET] = PIPE_TEXTURE_2D;
+		cmd[VIRGL_PIPE_RES_CREATE_WIDTH] = width;
+		cmd[VIRGL_PIPE_RES_CREATE_HEIGHT] = height;
+		cmd[VIRGL_PIPE_RES_CREATE_DEPTH] = 1;
+		cmd[VIRGL_PIPE_RES_CREATE_ARRAY_SIZE] = 1;
+		cmd[VIRGL_PIPE_RES_CREATE_LAST_LEVEL] = 0;
+		cmd[VIRGL_PIPE_RES_CREATE_NR_SAMPLES] = 0;
+		cmd[VIRGL_PIPE_RES_CREATE_FLAGS] = 0;
+		cmd[VIRGL_PIPE_RES_CREATE_BLOB_ID] = blob_create.blob_id;
+
+		blob_create.cmd = (uint64_t)(uintptr_t)cmd;
+		blob_create.cmd_size = sizeof(cmd);
+	}
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB, &blob_create);
+	if (ret) {
+		drv_log("DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	for (uint32_t plane = 0; plane < bo->meta.num_planes; plane++)
+		bo->handles[plane].u32 = blob_create.bo_handle;
+
+	// Recorded so that flushes and invalidates know the mappings need no transfers.
+	virtio_gpu_set_resource(bo->drv, blob_create.bo_handle, blob_create.res_handle,
+				blob_create.blob_mem);
+
+	return 0;
+}
+
 static int virtio_virgl_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 				  uint64_t use_flags)
 {
@@ -448,6 +702,11 @@ static int virtio_virgl_bo_create(struct bo *bo, uint32_t width, uint32_t height
 	if (virtio_gpu_supports_combination_natively(bo->drv, format, use_flags)) {
 		stride = drv_stride_from_format(format, width, 0);
 		drv_bo_from_format(bo, stride, height, format);
+
+		// Falls back to a regular resource if the host refuses the blob.
+		if (virtio_gpu_supports_blob(bo->drv, use_flags) &&
+		    !virtio_virgl_blob_create(bo, width, height, format, use_flags))
+			return 0;
 	} else {
 		assert(
 		    virtio_gpu_supports_combination_through_emulation(bo->drv, format, use_flags));
@@ -496,6 +755,8 @@ static int virtio_virgl_bo_create(struct bo *bo, uint32_t width, uint32_t height
 	for (uint32_t plane = 0; plane < bo->meta.num_planes; plane++)
 		bo->handles[plane].u32 = res_create.bo_handle;
 
+	virtio_gpu_set_resource(bo->drv, res_create.bo_handle, res_create.res_handle, 0);
+
 	return 0;
 }
 
@@ -553,24 +814,180 @@ static int virtio_gpu_get_caps(struct driver *drv, union virgl_caps *caps, int *
 	return ret;
 }
 
-static void virtio_gpu_init_features_and_caps(struct driver *drv)
+// What virtio_gpu_init_features_and_caps() learns from the kernel and the host.
+struct virtio_gpu_probe {
+	uint32_t features[feat_max];
+	int caps_is_v2;
+	union virgl_caps caps;
+};
+
+// The probe results are the same for every driver created on the device, so a process only
+// queries them once.
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool probe_cached;
+static dev_t probe_rdev;
+static struct virtio_gpu_probe probe_cache;
+
+// Returns non-zero if the results are incomplete and shouldn't be cached.
+static int virtio_gpu_probe(struct driver *drv, struct virtio_gpu_probe *probe)
 {
-	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+	int ret = 0;
 
+	memset(probe, 0, sizeof(*probe));
+
+	// Parameters the kernel doesn't know are simply reported as disabled.
 	for (uint32_t i = 0; i < ARRAY_SIZE(features); i++) {
 		struct drm_virtgpu_getparam params = { 0 };
 
+		features[i].enabled = 0;
 		params.param = features[i].feature;
 		params.value = (uint64_t)(uintptr_t)&features[i].enabled;
-		int ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GETPARAM, &params);
-		if (ret)
+		if (drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GETPARAM, &params))
 			drv_log("DRM_IOCTL_VIRTGPU_GET_PARAM failed with %s\n", strerror(errno));
+
+		probe->features[i] = features[i].enabled;
 	}
 
 	if (features[feat_3d].enabled) {
-		virtio_gpu_get_caps(drv, &priv->caps, &priv->caps_is_v2);
+		ret = virtio_gpu_get_caps(drv, &probe->caps, &probe->caps_is_v2);
 	}
 
+	return ret;
+}
+
+#ifdef VIRTIO_GPU_CAPS_CACHE
+// The on-disk cache holds a single record, which is only valid for the kernel and boot it was
+// written in. The host can't change without the guest rebooting, which changes the boot id.
+struct virtio_gpu_probe_record {
+	uint32_t size;
+	char drm_name[32];
+	int32_t drm_major;
+	int32_t drm_minor;
+	int32_t drm_patchlevel;
+	char boot_id[40];
+	struct virtio_gpu_probe probe;
+};
+
+static int virtio_gpu_probe_key(struct driver *drv, struct virtio_gpu_probe_record *record)
+{
+	int fd;
+	ssize_t len;
+	drmVersionPtr drm_version;
+
+	memset(record, 0, sizeof(*record));
+	record->size = sizeof(*record);
+
+	drm_version = drmGetVersion(drv->fd);
+	if (!drm_version)
+		return -EINVAL;
+
+	strncpy(record->drm_name, drm_version->name, sizeof(record->drm_name) - 1);
+	record->drm_major = drm_version->version_major;
+	record->drm_minor = drm_version->version_minor;
+	record->drm_patchlevel = drm_version->version_patchlevel;
+	drmFreeVersion(drm_version);
+
+	fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	len = read(fd, record->boot_id, sizeof(record->boot_id) - 1);
+	close(fd);
+	if (len <= 0)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int virtio_gpu_read_probe_cache(struct driver *drv, struct virtio_gpu_probe *probe)
+{
+	int fd;
+	ssize_t len;
+	struct virtio_gpu_probe_record key, record;
+
+	if (virtio_gpu_probe_key(drv, &key))
+		return -EINVAL;
+
+	fd = open(VIRTIO_GPU_CAPS_CACHE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	len = read(fd, &record, sizeof(record));
+	close(fd);
+	if (len != sizeof(record) ||
+	    memcmp(&record, &key, offsetof(struct virtio_gpu_probe_record, probe)))
+		return -EINVAL;
+
+	*probe = record.probe;
+	return 0;
+}
+
+// Replaces the cache atomically, so that concurrent readers never see a partial record.
+static void virtio_gpu_write_probe_cache(struct driver *drv, const struct virtio_gpu_probe *probe)
+{
+	int fd;
+	char path[] = VIRTIO_GPU_CAPS_CACHE ".XXXXXX";
+	struct virtio_gpu_probe_record record;
+
+	if (virtio_gpu_probe_key(drv, &record))
+		return;
+
+	record.probe = *probe;
+
+	fd = mkostemp(path, O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (write(fd, &record, sizeof(record)) != sizeof(record) || fchmod(fd, 0644) ||
+	    rename(path, VIRTIO_GPU_CAPS_CACHE))
+		unlink(path);
+
+	close(fd);
+}
+#else
+static int virtio_gpu_read_probe_cache(struct driver *drv, struct virtio_gpu_probe *probe)
+{
+	return -ENOENT;
+}
+
+static void virtio_gpu_write_probe_cache(struct driver *drv, const struct virtio_gpu_probe *probe)
+{
+}
+#endif
+
+static void virtio_gpu_init_features_and_caps(struct driver *drv)
+{
+	struct stat st;
+	struct virtio_gpu_probe probe;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+	bool have_rdev = !fstat(drv->fd, &st);
+	bool complete = false;
+
+	pthread_mutex_lock(&probe_lock);
+	if (have_rdev && probe_cached && probe_rdev == st.st_rdev) {
+		probe = probe_cache;
+	} else {
+		if (!virtio_gpu_read_probe_cache(drv, &probe)) {
+			complete = true;
+		} else if (!virtio_gpu_probe(drv, &probe)) {
+			virtio_gpu_write_probe_cache(drv, &probe);
+			complete = true;
+		}
+
+		if (complete && have_rdev) {
+			probe_cache = probe;
+			probe_rdev = st.st_rdev;
+			probe_cached = true;
+		}
+	}
+	pthread_mutex_unlock(&probe_lock);
+
+	for (uint32_t i = 0; i < ARRAY_SIZE(features); i++)
+		features[i].enabled = probe.features[i];
+
+	priv->caps = probe.caps;
+	priv->caps_is_v2 = probe.caps_is_v2;
+
 	// Multi-planar formats are currently only supported in virglrenderer through gbm.
 	priv->host_gbm_enabled =
 	    virtio_gpu_supports_combination_natively(drv, DRM_FORMAT_NV12, BO_USE_TEXTURE);
@@ -581,10 +998,30 @@ static int virtio_gpu_init(struct driver *drv)
 	struct virtio_gpu_priv *priv;
 
 	priv = calloc(1, sizeof(*priv));
+	if (!priv)
+		return -ENOMEM;
+
+	priv->res_handles = drv_hash_init(sizeof(uint32_t));
+	priv->blob_handles = drv_hash_init(sizeof(uint32_t));
+	if (!priv->res_handles || !priv->blob_handles) {
+		if (priv->res_handles)
+			drv_hash_destroy(priv->res_handles);
+		if (priv->blob_handles)
+			drv_hash_destroy(priv->blob_handles);
+		free(priv);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_init(&priv->res_lock, NULL);
 	drv->priv = priv;
 
 	virtio_gpu_init_features_and_caps(drv);
 
+	// Transfers in command buffers let a flush submit the boxes of every plane, and of every
+	// buffer flushed together, in a single request.
+	priv->encoded_transfers = features[feat_3d].enabled && priv->caps_is_v2 &&
+				  (priv->caps.v2.capability_bits & VIRGL_CAP_TRANSFER);
+
 	if (features[feat_3d].enabled) {
 		/* This doesn't mean host can scanout everything, it just means host
 		 * hypervisor can show it. */
@@ -648,6 +1085,11 @@ static int virtio_gpu_init(struct driver *drv)
 
 static void virtio_gpu_close(struct driver *drv)
 {
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+
+	drv_hash_destroy(priv->res_handles);
+	drv_hash_destroy(priv->blob_handles);
+	pthread_mutex_destroy(&priv->res_lock);
 	free(drv->priv);
 	drv->priv = NULL;
 }
@@ -663,10 +1105,33 @@ static int virtio_gpu_bo_create(struct bo *bo, uint32_t width, uint32_t height,
 
 static int virtio_gpu_bo_destroy(struct bo *bo)
 {
-	if (features[feat_3d].enabled)
-		return drv_gem_bo_destroy(bo);
-	else
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+
+	if (!features[feat_3d].enabled)
 		return drv_dumb_bo_destroy(bo);
+
+	// The handle may be reused for another resource once it is closed.
+	pthread_mutex_lock(&priv->res_lock);
+	drv_hash_remove(priv->res_handles, &bo->handles[0].u32);
+	drv_hash_remove(priv->blob_handles, &bo->handles[0].u32);
+	pthread_mutex_unlock(&priv->res_lock);
+
+	return drv_gem_bo_destroy(bo);
+}
+
+// Imported blobs are told apart from regular resources by what the kernel reports about them.
+static int virtio_gpu_bo_import(struct bo *bo, struct drv_import_fd_data *data)
+{
+	int ret;
+
+	ret = drv_prime_bo_import(bo, data);
+	if (ret || !features[feat_3d].enabled)
+		return ret;
+
+	if (virtio_gpu_query_resource(bo->drv, bo->handles[0].u32))
+		drv_log("Importing without knowing the host resource\n");
+
+	return 0;
 }
 
 static void *virtio_gpu_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
@@ -677,16 +1142,164 @@ static void *virtio_gpu_bo_map(struct bo *bo, struct vma *vma, size_t plane, uin
 		return drv_dumb_bo_map(bo, vma, plane, map_flags);
 }
 
-static int virtio_gpu_bo_invalidate(struct bo *bo, struct mapping *mapping)
+static void virtio_gpu_get_transfers_params(struct bo *bo, const struct rectangle *rect,
+					    struct virtio_transfers_params *xfer_params)
+{
+	if (virtio_gpu_supports_combination_natively(bo->drv, bo->meta.format,
+						     bo->meta.use_flags)) {
+		xfer_params->xfers_needed = 1;
+		xfer_params->xfer_boxes[0] = *rect;
+	} else {
+		assert(virtio_gpu_supports_combination_through_emulation(bo->drv, bo->meta.format,
+									 bo->meta.use_flags));
+
+		virtio_gpu_get_emulated_transfers_params(bo, rect, xfer_params);
+	}
+}
+
+// Appends a TRANSFER3D command per box to cmd and returns the number of dwords written.
+static uint32_t virtio_gpu_encode_transfers(const struct virtio_transfers_params *xfer_params,
+					    uint32_t res_handle, uint32_t level, uint32_t direction,
+					    uint32_t *cmd)
+{
+	size_t i;
+
+	for (i = 0; i < xfer_params->xfers_needed; i++) {
+		uint32_t *transfer = cmd + i * VIRTIO_GPU_TRANSFER_DWORDS;
+
+		// Everything else matches what the kernel sends for the transfer ioctls.
+		memset(transfer, 0, VIRTIO_GPU_TRANSFER_DWORDS * sizeof(*transfer));
+		transfer[0] = VIRGL_CMD0(VIRGL_CCMD_TRANSFER3D, 0, VIRGL_TRANSFER3D_SIZE);
+		transfer[VIRGL_RESOURCE_IW_RES_HANDLE] = res_handle;
+		transfer[VIRGL_RESOURCE_IW_LEVEL] = level;
+		transfer[VIRGL_RESOURCE_IW_X] = xfer_params->xfer_boxes[i].x;
+		transfer[VIRGL_RESOURCE_IW_Y] = xfer_params->xfer_boxes[i].y;
+		transfer[VIRGL_RESOURCE_IW_W] = xfer_params->xfer_boxes[i].width;
+		transfer[VIRGL_RESOURCE_IW_H] = xfer_params->xfer_boxes[i].height;
+		transfer[VIRGL_RESOURCE_IW_D] = 1;
+		transfer[VIRGL_TRANSFER3D_DIRECTION] = direction;
+	}
+
+	return xfer_params->xfers_needed * VIRTIO_GPU_TRANSFER_DWORDS;
+}
+
+// Issues one transfer ioctl per box, for hosts that don't take transfers in command buffers.
+static int virtio_gpu_transfer_boxes(struct bo *bo, uint32_t handle,
+				     const struct virtio_transfers_params *xfer_params,
+				     uint32_t level, uint32_t direction)
 {
 	int ret;
 	size_t i;
-	struct drm_virtgpu_3d_transfer_from_host xfer;
+	// The arguments of both directions have the same layout.
+	struct drm_virtgpu_3d_transfer_to_host xfer;
+	unsigned long request = direction == VIRGL_TRANSFER_TO_HOST
+				    ? DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST
+				    : DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST;
+
+	memset(&xfer, 0, sizeof(xfer));
+	xfer.bo_handle = handle;
+	xfer.level = level;
+
+	for (i = 0; i < xfer_params->xfers_needed; i++) {
+		xfer.box.x = xfer_params->xfer_boxes[i].x;
+		xfer.box.y = xfer_params->xfer_boxes[i].y;
+		xfer.box.w = xfer_params->xfer_boxes[i].width;
+		xfer.box.h = xfer_params->xfer_boxes[i].height;
+		xfer.box.d = 1;
+
+		ret = drmIoctl(bo->drv->fd, request, &xfer);
+		if (ret) {
+			drv_log("DRM_IOCTL_VIRTGPU_TRANSFER_%s_HOST failed with %s\n",
+				direction == VIRGL_TRANSFER_TO_HOST ? "TO" : "FROM", strerror(errno));
+			return -errno;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Submits num_dwords of commands referencing the given handles, and returns a sync_file fd in
+ * *fence, unless fence is NULL, that signals once the host has processed them. The host handles
+ * submissions in order, so the fence of an empty command buffer that references a resource also
+ * covers the transfers submitted for it so far.
+ */
+static int virtio_gpu_submit(struct driver *drv, uint32_t *cmd, uint32_t num_dwords,
+			     uint32_t *handles, uint32_t num_handles, int *fence)
+{
+	int ret;
+	struct drm_virtgpu_execbuffer exbuf;
+
+	memset(&exbuf, 0, sizeof(exbuf));
+	exbuf.flags = fence ? VIRTGPU_EXECBUF_FENCE_FD_OUT : 0;
+	exbuf.command = (uint64_t)(uintptr_t)cmd;
+	exbuf.size = num_dwords * sizeof(*cmd);
+	exbuf.bo_handles = (uint64_t)(uintptr_t)handles;
+	exbuf.num_bo_handles = num_handles;
+	exbuf.fence_fd = -1;
+
+	ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_EXECBUFFER, &exbuf);
+	if (ret) {
+		drv_log("DRM_IOCTL_VIRTGPU_EXECBUFFER failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	if (fence)
+		*fence = exbuf.fence_fd;
+
+	return 0;
+}
+
+/*
+ * Waits for fence, which is closed, or with a fence of -1 for all host work on the handles.
+ * Waiting on a transfer fence doesn't also wait for unrelated host work on the resources like
+ * DRM_IOCTL_VIRTGPU_WAIT does, which remains the fallback.
+ */
+static int virtio_gpu_wait_fence(struct driver *drv, int fence, uint32_t *handles,
+				 uint32_t num_handles)
+{
+	int ret;
+	uint32_t i;
+	struct pollfd fds;
 	struct drm_virtgpu_3d_wait waitcmd;
+
+	if (fence >= 0) {
+		fds.fd = fence;
+		fds.events = POLLIN;
+		do {
+			ret = poll(&fds, 1, -1);
+		} while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+		close(fence);
+		if (ret > 0 && !(fds.revents & (POLLERR | POLLNVAL)))
+			return 0;
+	}
+
+	for (i = 0; i < num_handles; i++) {
+		memset(&waitcmd, 0, sizeof(waitcmd));
+		waitcmd.handle = handles[i];
+		ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
+		if (ret) {
+			drv_log("DRM_IOCTL_VIRTGPU_WAIT failed with %s\n", strerror(errno));
+			return -errno;
+		}
+	}
+
+	return 0;
+}
+
+static int virtio_gpu_bo_invalidate(struct bo *bo, struct mapping *mapping)
+{
+	int ret;
+	int fence = -1;
+	uint32_t level = 0;
+	uint32_t res_handle;
+	uint32_t handle = mapping->vma->handle;
+	uint32_t cmd[DRV_MAX_PLANES * VIRTIO_GPU_TRANSFER_DWORDS];
 	struct virtio_transfers_params xfer_params;
 	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
 
-	if (!features[feat_3d].enabled)
+	if (!features[feat_3d].enabled || virtio_gpu_bo_skips_transfers(bo))
 		return 0;
 
 	// Invalidate is only necessary if the host writes to the buffer.
@@ -694,9 +1307,6 @@ static int virtio_gpu_bo_invalidate(struct bo *bo, struct mapping *mapping)
 				   BO_USE_HW_VIDEO_ENCODER | BO_USE_HW_VIDEO_DECODER)) == 0)
 		return 0;
 
-	memset(&xfer, 0, sizeof(xfer));
-	xfer.bo_handle = mapping->vma->handle;
-
 	if ((bo->meta.use_flags & BO_USE_RENDERING) == 0) {
 		// Unfortunately, the kernel doesn't actually pass the guest layer_stride
 		// and guest stride to the host (compare virtio_gpu.h and virtgpu_drm.h).
@@ -706,117 +1316,122 @@ static int virtio_gpu_bo_invalidate(struct bo *bo, struct mapping *mapping)
 		// which is resources with the BO_USE_RENDERING flag set.
 		// TODO(b/145993887): Send also stride when the patches are landed
 		if (priv->host_gbm_enabled) {
-			xfer.level = bo->meta.strides[0];
+			level = bo->meta.strides[0];
 		}
 	}
 
-	if (virtio_gpu_supports_combination_natively(bo->drv, bo->meta.format,
-						     bo->meta.use_flags)) {
-		xfer_params.xfers_needed = 1;
-		xfer_params.xfer_boxes[0] = mapping->rect;
-	} else {
-		assert(virtio_gpu_supports_combination_through_emulation(bo->drv, bo->meta.format,
-									 bo->meta.use_flags));
-
-		virtio_gpu_get_emulated_transfers_params(bo, &mapping->rect, &xfer_params);
-	}
-
-	for (i = 0; i < xfer_params.xfers_needed; i++) {
-		xfer.box.x = xfer_params.xfer_boxes[i].x;
-		xfer.box.y = xfer_params.xfer_boxes[i].y;
-		xfer.box.w = xfer_params.xfer_boxes[i].width;
-		xfer.box.h = xfer_params.xfer_boxes[i].height;
-		xfer.box.d = 1;
-
-		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST, &xfer);
-		if (ret) {
-			drv_log("DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST failed with %s\n",
-				strerror(errno));
-			return -errno;
-		}
-	}
+	virtio_gpu_get_transfers_params(bo, &mapping->rect, &xfer_params);
 
 	// The transfer needs to complete before invalidate returns so that any host changes
-	// are visible and to ensure the host doesn't overwrite subsequent guest changes.
-	// TODO(b/136733358): Support returning fences from transfers
-	memset(&waitcmd, 0, sizeof(waitcmd));
-	waitcmd.handle = mapping->vma->handle;
-	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
-	if (ret) {
-		drv_log("DRM_IOCTL_VIRTGPU_WAIT failed with %s\n", strerror(errno));
-		return -errno;
+	// are visible and to ensure the host doesn't overwrite subsequent guest changes. With
+	// encoded transfers, the submission of the transfers also provides the fence.
+	if (priv->encoded_transfers && !virtio_gpu_get_res_handle(bo->drv, handle, &res_handle)) {
+		ret = virtio_gpu_submit(bo->drv, cmd,
+					virtio_gpu_encode_transfers(&xfer_params, res_handle, level,
+								    VIRGL_TRANSFER_FROM_HOST, cmd),
+					&handle, 1, &fence);
+		if (ret)
+			return ret;
+	} else {
+		ret = virtio_gpu_transfer_boxes(bo, handle, &xfer_params, level,
+						VIRGL_TRANSFER_FROM_HOST);
+		if (ret)
+			return ret;
+
+		if (virtio_gpu_submit(bo->drv, NULL, 0, &handle, 1, &fence))
+			fence = -1;
 	}
 
-	return 0;
+	return virtio_gpu_wait_fence(bo->drv, fence, &handle, 1);
 }
 
-static int virtio_gpu_bo_flush(struct bo *bo, struct mapping *mapping)
+/*
+ * When the host takes transfers in command buffers, the transfers of all planes are submitted in
+ * a single request. A fence for the transfers that other host hardware waits for is returned in
+ * *fence, or waited for when fence is NULL.
+ */
+static int virtio_gpu_bo_flush_fence(struct bo *bo, struct mapping *mapping, int *fence)
 {
 	int ret;
-	size_t i;
-	struct drm_virtgpu_3d_transfer_to_host xfer;
-	struct drm_virtgpu_3d_wait waitcmd;
+	int out_fence = -1;
+	bool wait;
+	uint32_t level, res_handle, num_dwords = 0, num_submissions = 0;
+	uint32_t cmd[DRV_MAX_PLANES * VIRTIO_GPU_TRANSFER_DWORDS];
+	uint32_t handle = mapping->vma->handle;
 	struct virtio_transfers_params xfer_params;
 	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+	/* Only the region reported as written needs to reach the host. */
+	const struct rectangle *rect =
+	    mapping->damage.width && mapping->damage.height ? &mapping->damage : &mapping->rect;
 
 	if (!features[feat_3d].enabled)
 		return 0;
 
-	if (!(mapping->vma->map_flags & BO_MAP_WRITE))
+	if (virtio_gpu_bo_skips_transfers(bo) || !(mapping->vma->map_flags & BO_MAP_WRITE))
 		return 0;
 
-	memset(&xfer, 0, sizeof(xfer));
-	xfer.bo_handle = mapping->vma->handle;
-
 	// Unfortunately, the kernel doesn't actually pass the guest layer_stride and
 	// guest stride to the host (compare virtio_gpu.h and virtgpu_drm.h). We can use
 	// the level to work around this.
-	if (priv->host_gbm_enabled) {
-		xfer.level = bo->meta.strides[0];
-	}
+	level = priv->host_gbm_enabled ? bo->meta.strides[0] : 0;
 
-	if (virtio_gpu_supports_combination_natively(bo->drv, bo->meta.format,
-						     bo->meta.use_flags)) {
-		xfer_params.xfers_needed = 1;
-		xfer_params.xfer_boxes[0] = mapping->rect;
+	virtio_gpu_get_transfers_params(bo, rect, &xfer_params);
+
+	if (priv->encoded_transfers && !virtio_gpu_get_res_handle(bo->drv, handle, &res_handle)) {
+		num_dwords = virtio_gpu_encode_transfers(&xfer_params, res_handle, level,
+							 VIRGL_TRANSFER_TO_HOST, cmd);
 	} else {
-		assert(virtio_gpu_supports_combination_through_emulation(bo->drv, bo->meta.format,
-									 bo->meta.use_flags));
+		ret = virtio_gpu_transfer_boxes(bo, handle, &xfer_params, level,
+						VIRGL_TRANSFER_TO_HOST);
+		if (ret)
+			return ret;
 
-		virtio_gpu_get_emulated_transfers_params(bo, &mapping->rect, &xfer_params);
+		num_submissions = xfer_params.xfers_needed;
 	}
 
-	for (i = 0; i < xfer_params.xfers_needed; i++) {
-		xfer.box.x = xfer_params.xfer_boxes[i].x;
-		xfer.box.y = xfer_params.xfer_boxes[i].y;
-		xfer.box.w = xfer_params.xfer_boxes[i].width;
-		xfer.box.h = xfer_params.xfer_boxes[i].height;
-		xfer.box.d = 1;
+	// If the buffer is only accessed by the host GPU, then the flush is ordered with
+	// subsequent commands. However, if other host hardware can access the buffer, the
+	// transfer has to complete first, which a caller that takes a fence can wait for later.
+	wait = bo->meta.use_flags & BO_USE_NON_GPU_HW;
 
-		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST, &xfer);
-		if (ret) {
-			drv_log("DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST failed with %s\n",
-				strerror(errno));
-			return -errno;
-		}
-	}
+	if (num_dwords || wait) {
+		ret = virtio_gpu_submit(bo->drv, cmd, num_dwords, &handle, 1,
+					wait ? &out_fence : NULL);
+		// Without a fence the wait below falls back to DRM_IOCTL_VIRTGPU_WAIT.
+		if (ret && num_dwords)
+			return ret;
 
-	// If the buffer is only accessed by the host GPU, then the flush is ordered
-	// with subsequent commands. However, if other host hardware can access the
-	// buffer, we need to wait for the transfer to complete for consistency.
-	// TODO(b/136733358): Support returning fences from transfers
-	if (bo->meta.use_flags & BO_USE_NON_GPU_HW) {
-		memset(&waitcmd, 0, sizeof(waitcmd));
-		waitcmd.handle = mapping->vma->handle;
+		num_submissions += num_dwords ? 1 : 0;
+	}
 
-		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
-		if (ret) {
-			drv_log("DRM_IOCTL_VIRTGPU_WAIT failed with %s\n", strerror(errno));
-			return -errno;
-		}
+	ret = 0;
+	if (wait) {
+		if (fence && out_fence >= 0)
+			*fence = out_fence;
+		else
+			ret = virtio_gpu_wait_fence(bo->drv, out_fence, &handle, 1);
 	}
 
-	return 0;
+	__atomic_add_fetch(&priv->flushes, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&priv->transfers, xfer_params.xfers_needed, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&priv->submissions, num_submissions, __ATOMIC_RELAXED);
+
+	return ret;
+}
+
+static int virtio_gpu_bo_flush(struct bo *bo, struct mapping *mapping)
+{
+	return virtio_gpu_bo_flush_fence(bo, mapping, NULL);
+}
+
+static void virtio_gpu_get_transfer_stats(struct driver *drv, uint64_t *flushes,
+					  uint64_t *transfers, uint64_t *submissions)
+{
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+
+	*flushes = __atomic_load_n(&priv->flushes, __ATOMIC_RELAXED);
+	*transfers = __atomic_load_n(&priv->transfers, __ATOMIC_RELAXED);
+	*submissions = __atomic_load_n(&priv->submissions, __ATOMIC_RELAXED);
 }
 
 static uint32_t virtio_gpu_resolve_format(struct driver *drv, uint32_t format, uint64_t use_flags)
@@ -859,6 +1474,10 @@ static int virtio_gpu_resource_info(struct bo *bo, uint32_t strides[DRV_MAX_PLAN
 		return ret;
 	}
 
+	// Blobs keep the layout they were created with, and no strides are reported for them.
+	if (virtio_gpu_resource_info_blob_mem(&res_info))
+		return 0;
+
 	for (uint32_t plane = 0; plane < bo->meta.num_planes; plane++) {
 		/*
 		 * Currently, kernel v4.14 (Betty) doesn't have the extended resource info
@@ -879,11 +1498,13 @@ const struct backend backend_virtio_gpu = {
 	.close = virtio_gpu_close,
 	.bo_create = virtio_gpu_bo_create,
 	.bo_destroy = virtio_gpu_bo_destroy,
-	.bo_import = drv_prime_bo_import,
+	.bo_import = virtio_gpu_bo_import,
 	.bo_map = virtio_gpu_bo_map,
 	.bo_unmap = drv_bo_munmap,
 	.bo_invalidate = virtio_gpu_bo_invalidate,
 	.bo_flush = virtio_gpu_bo_flush,
+	.bo_flush_fence = virtio_gpu_bo_flush_fence,
 	.resolve_format = virtio_gpu_resolve_format,
 	.resource_info = virtio_gpu_resource_info,
+	.get_transfer_stats = virtio_gpu_get_transfer_stats,
 };